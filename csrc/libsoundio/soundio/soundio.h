@@ -11,6 +11,7 @@
 #include "config.h"
 #include "endian.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 /// \cond
 #ifdef __cplusplus
@@ -97,6 +98,8 @@ enum SoundIoError {
     SoundIoErrorUnderflow,
     /// Unable to convert to or from UTF-8 to the native string format.
     SoundIoErrorEncodingString,
+    /// The device was listed without being probed. See SoundIo::lazy_probe.
+    SoundIoErrorNotProbed,
 };
 
 /// Specifies where a channel is physically located.
@@ -227,6 +230,20 @@ enum SoundIoDeviceAim {
     SoundIoDeviceAimOutput, ///< playback
 };
 
+/// How ::soundio_outstream_begin_write and ::soundio_instream_begin_read get
+/// at the device buffer. See SoundIoOutStream::access_mode.
+enum SoundIoAccessMode {
+    /// Use direct access when the device supports it, otherwise copy.
+    SoundIoAccessModeAuto,
+    /// The areas point directly into the device buffer. For ALSA this means
+    /// mmap access.
+    SoundIoAccessModeDirect,
+    /// The areas point into a staging buffer which is copied to or from the
+    /// device. For ALSA this means `snd_pcm_writei` / `snd_pcm_readi` and
+    /// friends.
+    SoundIoAccessModeCopy,
+};
+
 /// For your convenience, Native Endian and Foreign Endian constants are defined
 /// which point to the respective SoundIoFormat values.
 enum SoundIoFormat {
@@ -249,6 +266,8 @@ enum SoundIoFormat {
     SoundIoFormatFloat32BE, ///< Float 32 bit Big Endian, Range -1.0 to 1.0
     SoundIoFormatFloat64LE, ///< Float 64 bit Little Endian, Range -1.0 to 1.0
     SoundIoFormatFloat64BE, ///< Float 64 bit Big Endian, Range -1.0 to 1.0
+    SoundIoFormatS24PackedLE, ///< Signed 24 bit Little Endian packed into three bytes
+    SoundIoFormatS24PackedBE, ///< Signed 24 bit Big Endian packed into three bytes
 };
 
 #if defined(SOUNDIO_OS_BIG_ENDIAN)
@@ -260,6 +279,7 @@ enum SoundIoFormat {
 #define SoundIoFormatU32NE SoundIoFormatU32BE
 #define SoundIoFormatFloat32NE SoundIoFormatFloat32BE
 #define SoundIoFormatFloat64NE SoundIoFormatFloat64BE
+#define SoundIoFormatS24PackedNE SoundIoFormatS24PackedBE
 
 #define SoundIoFormatS16FE SoundIoFormatS16LE
 #define SoundIoFormatU16FE SoundIoFormatU16LE
@@ -269,6 +289,7 @@ enum SoundIoFormat {
 #define SoundIoFormatU32FE SoundIoFormatU32LE
 #define SoundIoFormatFloat32FE SoundIoFormatFloat32LE
 #define SoundIoFormatFloat64FE SoundIoFormatFloat64LE
+#define SoundIoFormatS24PackedFE SoundIoFormatS24PackedLE
 
 #elif defined(SOUNDIO_OS_LITTLE_ENDIAN)
 
@@ -280,6 +301,7 @@ enum SoundIoFormat {
 #define SoundIoFormatU32NE SoundIoFormatU32LE
 #define SoundIoFormatFloat32NE SoundIoFormatFloat32LE
 #define SoundIoFormatFloat64NE SoundIoFormatFloat64LE
+#define SoundIoFormatS24PackedNE SoundIoFormatS24PackedLE
 
 #define SoundIoFormatS16FE SoundIoFormatS16BE
 #define SoundIoFormatU16FE SoundIoFormatU16BE
@@ -289,6 +311,7 @@ enum SoundIoFormat {
 #define SoundIoFormatU32FE SoundIoFormatU32BE
 #define SoundIoFormatFloat32FE SoundIoFormatFloat32BE
 #define SoundIoFormatFloat64FE SoundIoFormatFloat64BE
+#define SoundIoFormatS24PackedFE SoundIoFormatS24PackedBE
 
 #else
 #error unknown byte order
@@ -308,6 +331,59 @@ struct SoundIoSampleRateRange {
     int max;
 };
 
+/// Number of buckets in SoundIoCallbackStats::load_histogram.
+#define SOUNDIO_CALLBACK_LOAD_BUCKETS 11
+
+/// Callback timing gathered when SoundIoOutStream::watchdog or
+/// SoundIoInStream::watchdog is enabled.
+/// The size of this struct is OK to use.
+struct SoundIoCallbackStats {
+    /// Number of callbacks measured.
+    long callback_count;
+    /// Number of callbacks that took longer than their deadline. The deadline
+    /// of a callback is the duration of the `frame_count_max` frames offered
+    /// to it; a callback which takes longer than that cannot keep up.
+    long deadline_miss_count;
+    /// Longest callback duration seen, in seconds.
+    double max_duration;
+    /// Callbacks counted by duration divided by deadline, in steps of 10%.
+    /// The last bucket holds the deadline misses.
+    long load_histogram[SOUNDIO_CALLBACK_LOAD_BUCKETS];
+};
+
+/// A stream position paired with the time at which the device was at it.
+/// Frame `n` of the stream is played (or was captured) at
+/// `time + (n - frame) / sample_rate` seconds.
+/// See ::soundio_outstream_get_timestamp and ::soundio_instream_get_timestamp.
+struct SoundIoTimestamp {
+    /// Frames since the stream was opened, counting every frame passed
+    /// through ::soundio_outstream_end_write or ::soundio_instream_end_read.
+    /// For an output stream, the frame leaving the device at `time`; for an
+    /// input stream, the frame entering it.
+    int64_t frame;
+    /// Seconds on the system monotonic clock (`CLOCK_MONOTONIC`).
+    double time;
+};
+
+/// Underflow and overflow statistics of a stream.
+/// See ::soundio_outstream_get_xrun_stats.
+struct SoundIoXrunStats {
+    /// Number of times SoundIoOutStream::underflow_callback or
+    /// SoundIoInStream::overflow_callback was called.
+    long xrun_count;
+    /// Seconds on the system monotonic clock at which the last xrun was
+    /// reported, or 0 if there was none.
+    double last_xrun_time;
+    /// Seconds of audio the stream currently keeps buffered. This starts out
+    /// as the software latency and changes when the backend adapts it.
+    double fill_time;
+    /// Number of times the backend raised the fill level after underflows.
+    long grow_count;
+    /// Number of times the backend lowered the fill level again after a
+    /// stable period.
+    long shrink_count;
+};
+
 /// The size of this struct is OK to use.
 struct SoundIoChannelArea {
     /// Base address of buffer.
@@ -374,6 +450,40 @@ struct SoundIo {
     /// Optional: JACK error callback.
     /// See SoundIo::jack_info_callback
     void (*jack_error_callback)(const char *msg);
+
+    /// Optional: ALSA only. By default every started stream gets its own
+    /// high priority thread. When this is greater than zero, that many
+    /// shared threads are created instead, each waiting on the poll
+    /// descriptors of all its streams with a single `epoll` set. When several
+    /// streams become ready at once, their callbacks are called in order of
+    /// how little buffered audio they have left. Streams are assigned to the
+    /// least loaded thread when started. Read during ::soundio_connect.
+    /// A stream recovering from a system suspend is resumed on its shared
+    /// thread, and the kernel may block that until the card has power again,
+    /// stalling the other streams on the same thread meanwhile.
+    /// Defaults to 0.
+    int alsa_engine_thread_count;
+
+    /// Optional: ALSA only. When true, probed device capabilities are saved
+    /// to `$XDG_CACHE_HOME/libsoundio/alsa-capabilities` (or under
+    /// `~/.cache` if that is not set) and loaded again by the next
+    /// ::soundio_connect. A device whose card identity (card id, driver,
+    /// long name and mixer name) and ALSA configuration are unchanged is then
+    /// listed without being opened, and is probed in the background once the
+    /// first device list has been published. If that probe disagrees with
+    /// the cache, the devices are rescanned and SoundIo::on_devices_change is
+    /// called again. Read during ::soundio_connect. Defaults to false.
+    bool alsa_capability_cache;
+
+    /// Optional: When true, device scans only list ids and names for the
+    /// backends that probe devices by opening them (currently ALSA). Such
+    /// devices have SoundIoDevice::probe_error set to #SoundIoErrorNotProbed
+    /// until ::soundio_device_probe is called, which the
+    /// `soundio_device_supports_*` functions and opening a stream do
+    /// implicitly. Devices whose capabilities are already known from an
+    /// earlier probe are still listed with them. Read during
+    /// ::soundio_connect. Defaults to false.
+    bool lazy_probe;
 };
 
 /// The size of this struct is not part of the API or ABI.
@@ -470,8 +580,9 @@ struct SoundIoDevice {
     /// resampling and thus tend to have fewer formats available.
     bool is_raw;
 
-    /// Devices are reference counted. See ::soundio_device_ref and
-    /// ::soundio_device_unref.
+    /// Unused. Devices are reference counted, see ::soundio_device_ref and
+    /// ::soundio_device_unref, but the count is kept privately because it is
+    /// shared with other threads. This field remains for compatibility.
     int ref_count;
 
     /// This is set to a SoundIoError representing the result of the device
@@ -483,6 +594,7 @@ struct SoundIoDevice {
     /// Possible errors:
     /// * #SoundIoErrorOpeningDevice
     /// * #SoundIoErrorNoMem
+    /// * #SoundIoErrorNotProbed - see SoundIo::lazy_probe
     int probe_error;
 };
 
@@ -586,6 +698,111 @@ struct SoundIoOutStream {
     /// to an error code. Possible error codes are:
     /// * #SoundIoErrorIncompatibleDevice
     int layout_error;
+
+    /// Optional: measure how long each SoundIoOutStream::write_callback takes
+    /// and compare it against its deadline. See ::SoundIoCallbackStats and
+    /// ::soundio_outstream_get_callback_stats. Must be set before calling
+    /// ::soundio_outstream_start. Defaults to `false`.
+    bool watchdog;
+    /// Optional callback. Called when the watchdog has seen `miss_count`
+    /// write callbacks miss their deadline since the last call. Only called
+    /// during a call to ::soundio_flush_events or ::soundio_wait_events, never
+    /// from the audio thread.
+    void (*on_deadline_miss)(struct SoundIoOutStream *, int miss_count);
+
+    /// Optional: how the stream accesses the device buffer. Defaults to
+    /// #SoundIoAccessModeAuto. Requesting #SoundIoAccessModeDirect or
+    /// #SoundIoAccessModeCopy makes ::soundio_outstream_open fail with
+    /// #SoundIoErrorIncompatibleDevice if the device cannot provide it.
+    /// After you call ::soundio_outstream_open, this value is replaced with
+    /// the mode actually in use, either #SoundIoAccessModeDirect or
+    /// #SoundIoAccessModeCopy.
+    ///
+    /// With direct access, ::soundio_outstream_begin_write returns at most the
+    /// contiguous part of the buffer up to where it wraps around; call it
+    /// again after ::soundio_outstream_end_write to get the rest. A
+    /// SoundIoChannelArea cannot span the wrap, so a callback which writes
+    /// across it always takes two begin/end pairs.
+    ///
+    /// Only ALSA offers a choice. PulseAudio capture always copies and
+    /// reports #SoundIoAccessModeCopy; all other streams hand out the
+    /// backend's own buffer and report #SoundIoAccessModeDirect.
+    enum SoundIoAccessMode access_mode;
+
+    /// Optional: ALSA only. Instead of waking up on every period interrupt,
+    /// turn period interrupts off, use a large device buffer and wake up from
+    /// a timer shortly before the buffered audio runs low, like PulseAudio's
+    /// timer-based scheduling. SoundIoOutStream::software_latency then sets
+    /// how much audio is kept buffered instead of the size of the device
+    /// buffer, and SoundIoOutStream::write_callback is only offered enough
+    /// frames to top the buffer up to that level. The level and the margin
+    /// left at each wakeup grow after underflows and late wakeups, and shrink
+    /// back while wakeups are on time.
+    /// After you call ::soundio_outstream_open, this tells whether timer
+    /// scheduling is in use; devices which cannot turn period interrupts off
+    /// fall back to period wakeups. Defaults to `false`.
+    bool timer_scheduling;
+
+    /// Optional: ALSA only. Open a device buffer several times larger than
+    /// SoundIoOutStream::software_latency but keep only that much audio
+    /// queued. After repeated underflows the fill level grows, up to the
+    /// whole buffer, and after a while without underflows it shrinks back.
+    /// ::soundio_outstream_get_xrun_stats reports the current level.
+    /// With SoundIoOutStream::timer_scheduling the level always adapts and
+    /// this field has no effect. Defaults to `false`.
+    bool adaptive_latency;
+
+    /// Optional callback. Called once the audio written before
+    /// ::soundio_outstream_drain has been played. Like
+    /// SoundIoOutStream::on_deadline_miss, it is only called during a call to
+    /// ::soundio_flush_events or ::soundio_wait_events, so it may destroy the
+    /// stream. If the backend gives up on the drain, this is not called and
+    /// SoundIoOutStream::error_callback gets #SoundIoErrorStreaming instead.
+    void (*on_drained)(struct SoundIoOutStream *);
+
+    /// Optional: ALSA only, and only for devices with SoundIoDevice::is_raw.
+    /// Run the stream at the lowest latency the hardware allows: the device
+    /// is opened without any automatic conversion, the device buffer is
+    /// accessed directly, the period is the smallest power of two number of
+    /// frames the hardware supports and the buffer holds two periods, or more
+    /// if SoundIoOutStream::software_latency asks for more. The write
+    /// callback is called once per period.
+    /// Overrides SoundIoOutStream::timer_scheduling and
+    /// SoundIoOutStream::adaptive_latency, and cannot be combined with
+    /// #SoundIoAccessModeCopy.
+    /// After you call ::soundio_outstream_open, this tells whether the stream
+    /// is exclusive, and SoundIoOutStream::software_latency is the exact
+    /// amount of audio buffered in the device. Added to the
+    /// SoundIoInStream::software_latency of an exclusive input stream on the
+    /// same card, that is the round-trip latency. Defaults to `false`.
+    bool exclusive;
+
+    /// Optional: PulseAudio only. Seconds of audio the server asks for at a
+    /// time, which is the size of each SoundIoOutStream::write_callback.
+    /// SoundIoOutStream::software_latency is the total amount kept buffered
+    /// and this splits it into requests: a quarter of the software latency
+    /// gives four callbacks per buffer. 0 lets the server choose, which can
+    /// mean large requests at an irregular cadence.
+    /// After you call ::soundio_outstream_open, this value is replaced with
+    /// the request size the server granted, and
+    /// SoundIoOutStream::software_latency with the granted buffer length.
+    /// Defaults to 0.
+    double period_duration;
+
+    /// Optional: PulseAudio only. Ask for audio as if the server drove a
+    /// device whose period is SoundIoOutStream::period_duration, instead of
+    /// having the server lower the device latency to meet
+    /// SoundIoOutStream::software_latency. This gives a steadier callback
+    /// cadence at the cost of a less exact total latency.
+    /// Defaults to `false`.
+    bool early_requests;
+
+    /// Optional: PulseAudio only. Let the client interpolate the stream
+    /// clock between timing updates from the server. The latency snapshots
+    /// behind ::soundio_outstream_get_latency are also taken after every
+    /// write, and with this they no longer fall back to the clock of the
+    /// last server update. Defaults to `false`.
+    bool interpolate_timing;
 };
 
 /// The size of this struct is not part of the API or ABI.
@@ -668,6 +885,76 @@ struct SoundIoInStream {
     /// If setting the channel layout fails for some reason, this field is set
     /// to an error code. Possible error codes are: #SoundIoErrorIncompatibleDevice
     int layout_error;
+
+    /// Optional: measure how long each SoundIoInStream::read_callback takes.
+    /// See SoundIoOutStream::watchdog.
+    bool watchdog;
+    /// Optional callback. See SoundIoOutStream::on_deadline_miss.
+    void (*on_deadline_miss)(struct SoundIoInStream *, int miss_count);
+
+    /// Optional: how the stream accesses the device buffer. See
+    /// SoundIoOutStream::access_mode.
+    enum SoundIoAccessMode access_mode;
+
+    /// Optional: ALSA only. See SoundIoOutStream::exclusive. The read
+    /// callback is called once per period, and after
+    /// ::soundio_instream_open SoundIoInStream::software_latency is the
+    /// exact period length. Defaults to `false`.
+    bool exclusive;
+
+    /// Optional: PulseAudio only. Seconds of audio delivered to each
+    /// SoundIoInStream::read_callback. 0 uses
+    /// SoundIoInStream::software_latency. After you call
+    /// ::soundio_instream_start, this value and
+    /// SoundIoInStream::software_latency are replaced with the fragment size
+    /// the server granted. Defaults to 0.
+    double period_duration;
+
+    /// Optional: PulseAudio only. See SoundIoOutStream::interpolate_timing.
+    /// Defaults to `false`.
+    bool interpolate_timing;
+};
+
+/// An input stream and an output stream serviced by one thread with a single
+/// callback. The two streams are started together on the same sample and
+/// stay in lockstep, so the time from a frame being captured to the frame
+/// written in the same callback being played is constant.
+/// The size of this struct is not part of the API or ABI.
+struct SoundIoDuplexStream {
+    /// Populated automatically when you call ::soundio_duplex_stream_create.
+    struct SoundIoOutStream *outstream;
+    /// Populated automatically when you call ::soundio_duplex_stream_create.
+    struct SoundIoInStream *instream;
+
+    /// Defaults to NULL. Put whatever you want here.
+    void *userdata;
+    /// In this function read exactly `frame_count` frames from
+    /// SoundIoDuplexStream::instream with ::soundio_instream_begin_read and
+    /// ::soundio_instream_end_read, and write exactly `frame_count` frames to
+    /// SoundIoDuplexStream::outstream with ::soundio_outstream_begin_write and
+    /// ::soundio_outstream_end_write. Writing fewer frames eats into the
+    /// playback headroom and eventually causes an underflow.
+    ///
+    /// The read and write callbacks of the two streams are not called.
+    /// Their SoundIoOutStream::underflow_callback and
+    /// SoundIoInStream::overflow_callback are, after which both streams are
+    /// restarted together.
+    ///
+    /// The same real-time restrictions as for SoundIoOutStream::write_callback
+    /// apply.
+    void (*duplex_callback)(struct SoundIoDuplexStream *, int frame_count);
+    /// Optional callback. `err` is always SoundIoErrorStreaming.
+    /// SoundIoErrorStreaming is an unrecoverable error. The stream is in an
+    /// invalid state and must be destroyed.
+    /// If you do not supply `error_callback`, the default callback will print
+    /// a message to stderr and then abort().
+    /// This is called from the SoundIoDuplexStream::duplex_callback thread context.
+    void (*error_callback)(struct SoundIoDuplexStream *, int err);
+
+    /// Set by ::soundio_duplex_stream_open to the number of seconds from a
+    /// frame being captured to the frame written in the same callback being
+    /// played, ignoring hardware latency.
+    double software_latency;
 };
 
 // Main Context
@@ -688,6 +975,19 @@ SOUNDIO_EXPORT void soundio_destroy(struct SoundIo *soundio);
 /// * #SoundIoErrorNoSuchClient - when JACK returns `JackNoSuchClient`
 /// See also ::soundio_disconnect
 SOUNDIO_EXPORT int soundio_connect(struct SoundIo *soundio);
+/// Like ::soundio_connect, but gives up on backends which have not connected
+/// within `timeout` seconds. Backends which talk to a server (JACK and
+/// PulseAudio) are tried at the same time on separate threads, and the
+/// first available backend in the usual order is connected, so a host
+/// without a running sound server, or with one that does not answer, falls
+/// through to ALSA or the dummy backend in bounded time.
+/// The whole call, including the connect which follows a server answering,
+/// is bounded by `timeout`; the JACK client which answered is the one kept.
+/// An attempt which cannot be cut short (JACK) may keep running in the
+/// background after this function returns and cleans up after itself
+/// without holding up ::soundio_destroy.
+/// Possible errors are the same as for ::soundio_connect.
+SOUNDIO_EXPORT int soundio_connect_timeout(struct SoundIo *soundio, double timeout);
 /// Instead of calling ::soundio_connect you may call this function to try a
 /// specific backend.
 /// Possible errors:
@@ -747,6 +1047,22 @@ SOUNDIO_EXPORT void soundio_wait_events(struct SoundIo *soundio);
 /// Makes ::soundio_wait_events stop blocking.
 SOUNDIO_EXPORT void soundio_wakeup(struct SoundIo *soundio);
 
+/// Obtain a file descriptor which becomes readable whenever
+/// ::soundio_flush_events has work to do. Use it to integrate libsoundio
+/// events into your own `poll`/`epoll` loop instead of dedicating a thread to
+/// ::soundio_wait_events. When the fd polls readable, call
+/// ::soundio_flush_events, which resets it. Be ready for spurious wakeups.
+///
+/// The fd is created on the first call and is owned by `soundio`; do not
+/// close it. It remains valid across ::soundio_disconnect and is closed by
+/// ::soundio_destroy.
+///
+/// Possible errors:
+/// * #SoundIoErrorIncompatibleBackend - not supported on this platform
+///   (currently only Linux is supported).
+/// * #SoundIoErrorSystemResources
+SOUNDIO_EXPORT int soundio_get_event_fd(struct SoundIo *soundio, int *out_fd);
+
 
 /// If necessary you can manually trigger a device rescan. Normally you will
 /// not ever have to call this function, as libsoundio listens to system events
@@ -829,6 +1145,28 @@ static inline int soundio_get_bytes_per_second(enum SoundIoFormat format,
 /// Returns string representation of `format`.
 SOUNDIO_EXPORT const char * soundio_format_string(enum SoundIoFormat format);
 
+/// Converts `sample_count` samples to packed 24-bit samples in `dest`, in
+/// #SoundIoFormatS24PackedLE or #SoundIoFormatS24PackedBE according to
+/// `dest_format`. Float samples are clipped to -1.0 to 1.0 and rounded to
+/// the nearest integer; 32-bit integer samples keep their upper 24 bits.
+/// Samples are contiguous in both buffers, so to fill all channels of an
+/// interleaved stream at once, pass SoundIoChannelArea::ptr of the first
+/// channel as `dest` and `frame_count * channel_count` as `sample_count`.
+/// Safe to call from SoundIoOutStream::write_callback.
+SOUNDIO_EXPORT void soundio_pack_s24_float32(char *dest, enum SoundIoFormat dest_format,
+        const float *src, int sample_count);
+/// See ::soundio_pack_s24_float32.
+SOUNDIO_EXPORT void soundio_pack_s24_s32(char *dest, enum SoundIoFormat dest_format,
+        const int32_t *src, int sample_count);
+/// The inverse of ::soundio_pack_s24_float32. The result is in the range
+/// -1.0 to 1.0.
+SOUNDIO_EXPORT void soundio_unpack_s24_float32(float *dest, const char *src,
+        enum SoundIoFormat src_format, int sample_count);
+/// The inverse of ::soundio_pack_s24_s32: each sample ends up in the upper
+/// 24 bits of the result.
+SOUNDIO_EXPORT void soundio_unpack_s24_s32(int32_t *dest, const char *src,
+        enum SoundIoFormat src_format, int sample_count);
+
 
 
 
@@ -881,6 +1219,13 @@ SOUNDIO_EXPORT bool soundio_device_equal(
         const struct SoundIoDevice *a,
         const struct SoundIoDevice *b);
 
+/// Probes a device which was listed with SoundIo::lazy_probe, filling in its
+/// formats, channel layouts, sample rates and software latency. Returns the
+/// resulting SoundIoDevice::probe_error, without probing again if the device
+/// has been probed already. Devices are shared with the device list, so call
+/// this from the thread which calls ::soundio_flush_events.
+SOUNDIO_EXPORT int soundio_device_probe(struct SoundIoDevice *device);
+
 /// Sorts channel layouts by channel count, descending.
 SOUNDIO_EXPORT void soundio_device_sort_channel_layouts(struct SoundIoDevice *device);
 
@@ -992,6 +1337,10 @@ SOUNDIO_EXPORT int soundio_outstream_begin_write(struct SoundIoOutStream *outstr
 SOUNDIO_EXPORT int soundio_outstream_end_write(struct SoundIoOutStream *outstream);
 
 /// Clears the output stream buffer.
+/// On ALSA the queued audio is rewound, keeping only what the hardware may
+/// already have fetched, and SoundIoOutStream::write_callback is called
+/// immediately to refill it. Devices which cannot rewind are stopped and
+/// restarted instead.
 /// This function can be called from any thread.
 /// This function can be called regardless of whether the outstream is paused
 /// or not.
@@ -1006,6 +1355,21 @@ SOUNDIO_EXPORT int soundio_outstream_end_write(struct SoundIoOutStream *outstrea
 /// * #SoundIoErrorIncompatibleDevice
 SOUNDIO_EXPORT int soundio_outstream_clear_buffer(struct SoundIoOutStream *outstream);
 
+/// Asks the stream to play what has been written so far and then stop.
+/// SoundIoOutStream::write_callback is not called again, and once the device
+/// has played the last frame SoundIoOutStream::on_drained is called. A
+/// drained stream stays silent; destroy it when you are done with it.
+/// This function does not block. It can be called from any thread, including
+/// from within SoundIoOutStream::write_callback, in which case the frames
+/// written by that callback are the last ones. Calling it again has no
+/// effect. The stream was registered for SoundIoOutStream::on_drained when it
+/// was opened, so this neither allocates nor waits for the event loop.
+///
+/// Possible errors:
+/// * #SoundIoErrorIncompatibleBackend - only ALSA, PulseAudio and the dummy
+///   backend can drain.
+SOUNDIO_EXPORT int soundio_outstream_drain(struct SoundIoOutStream *outstream);
+
 /// If the underlying device supports pausing, this pauses the stream.
 /// SoundIoOutStream::write_callback may be called a few more times if the
 /// buffer is not full.
@@ -1032,12 +1396,45 @@ SOUNDIO_EXPORT int soundio_outstream_pause(struct SoundIoOutStream *outstream, b
 /// to become audible.
 ///
 /// This function must be called only from within SoundIoOutStream::write_callback.
+/// With PulseAudio it may be called from any thread: it extrapolates from
+/// the last timing update without locking or talking to the server.
 ///
 /// Possible errors:
 /// * #SoundIoErrorStreaming
 SOUNDIO_EXPORT int soundio_outstream_get_latency(struct SoundIoOutStream *outstream,
         double *out_latency);
 
+/// Obtain the position of the device's playback pointer together with the
+/// time at which the hardware reached it. Both come from a single snapshot
+/// of the driver state, so unlike ::soundio_outstream_get_latency the result
+/// does not go stale: it can be extrapolated to any frame of the stream.
+/// Frames discarded by ::soundio_outstream_clear_buffer do not count.
+///
+/// This function must be called only from within SoundIoOutStream::write_callback.
+///
+/// Possible errors:
+/// * #SoundIoErrorStreaming
+/// * #SoundIoErrorIncompatibleBackend - only ALSA reports timestamps.
+SOUNDIO_EXPORT int soundio_outstream_get_timestamp(struct SoundIoOutStream *outstream,
+        struct SoundIoTimestamp *out_timestamp);
+
+/// Copies the timing gathered by the watchdog into `out_stats`. The counters
+/// are updated lock-free by the audio thread, so a snapshot taken while the
+/// stream runs may be off by the callback in progress.
+/// This function may be called from any thread.
+///
+/// Possible errors:
+/// * #SoundIoErrorInvalid - SoundIoOutStream::watchdog is not enabled
+SOUNDIO_EXPORT int soundio_outstream_get_callback_stats(struct SoundIoOutStream *outstream,
+        struct SoundIoCallbackStats *out_stats);
+
+/// Copies the xrun statistics of the stream into `out_stats`. Every backend
+/// counts underflows; only ALSA adapts the fill level, see
+/// SoundIoOutStream::adaptive_latency.
+/// This function may be called from any thread.
+SOUNDIO_EXPORT void soundio_outstream_get_xrun_stats(struct SoundIoOutStream *outstream,
+        struct SoundIoXrunStats *out_stats);
+
 
 
 // Input Streams
@@ -1076,6 +1473,7 @@ SOUNDIO_EXPORT int soundio_instream_open(struct SoundIoInStream *instream);
 /// * #SoundIoErrorStreaming
 /// * #SoundIoErrorOpeningDevice
 /// * #SoundIoErrorSystemResources
+/// * #SoundIoErrorNoMem
 SOUNDIO_EXPORT int soundio_instream_start(struct SoundIoInStream *instream);
 
 /// Call this function when you are ready to begin reading from the device
@@ -1084,7 +1482,8 @@ SOUNDIO_EXPORT int soundio_instream_start(struct SoundIoInStream *instream);
 /// * `areas` - (out) The memory addresses you can read data from. It is OK
 ///   to modify the pointers if that helps you iterate. There might be a "hole"
 ///   in the buffer. To indicate this, `areas` will be `NULL` and `frame_count`
-///   tells how big the hole is in frames.
+///   tells how big the hole is in frames. PulseAudio never does this; it
+///   delivers holes as zeroed frames instead.
 /// * `frame_count` - (in/out) - Provide the number of frames you want to read;
 ///   returns the number of frames you can actually read. The returned value
 ///   will always be less than or equal to the provided value. If the provided
@@ -1137,12 +1536,78 @@ SOUNDIO_EXPORT int soundio_instream_pause(struct SoundIoInStream *instream, bool
 /// represented in the buffer. This includes both software and hardware latency.
 ///
 /// This function must be called only from within SoundIoInStream::read_callback.
+/// With PulseAudio it may be called from any thread, as with
+/// ::soundio_outstream_get_latency.
 ///
 /// Possible errors:
 /// * #SoundIoErrorStreaming
 SOUNDIO_EXPORT int soundio_instream_get_latency(struct SoundIoInStream *instream,
         double *out_latency);
 
+/// See ::soundio_outstream_get_timestamp. The frame is the one being
+/// captured at the returned time.
+///
+/// This function must be called only from within SoundIoInStream::read_callback.
+///
+/// Possible errors:
+/// * #SoundIoErrorStreaming
+/// * #SoundIoErrorIncompatibleBackend
+SOUNDIO_EXPORT int soundio_instream_get_timestamp(struct SoundIoInStream *instream,
+        struct SoundIoTimestamp *out_timestamp);
+
+/// See ::soundio_outstream_get_callback_stats.
+SOUNDIO_EXPORT int soundio_instream_get_callback_stats(struct SoundIoInStream *instream,
+        struct SoundIoCallbackStats *out_stats);
+
+/// See ::soundio_outstream_get_xrun_stats. Input streams count overflows and
+/// never adapt.
+SOUNDIO_EXPORT void soundio_instream_get_xrun_stats(struct SoundIoInStream *instream,
+        struct SoundIoXrunStats *out_stats);
+
+
+// Duplex Streams
+/// Allocates memory and sets defaults for a duplex stream driving
+/// `outstream` and `instream`. Both streams must be opened with
+/// ::soundio_outstream_open and ::soundio_instream_open, at the same sample
+/// rate, but not started. Next fill out the struct fields and call
+/// ::soundio_duplex_stream_open.
+/// Returns `NULL` if and only if memory could not be allocated.
+/// See also ::soundio_duplex_stream_destroy
+SOUNDIO_EXPORT struct SoundIoDuplexStream *soundio_duplex_stream_create(
+        struct SoundIoOutStream *outstream, struct SoundIoInStream *instream);
+/// Stops the duplex stream. It does not destroy SoundIoDuplexStream::outstream
+/// or SoundIoDuplexStream::instream; destroy those afterwards.
+/// You may not call this function from SoundIoDuplexStream::duplex_callback.
+SOUNDIO_EXPORT void soundio_duplex_stream_destroy(struct SoundIoDuplexStream *duplex);
+
+/// Links the two streams so that starting, stopping and pausing one does the
+/// same to the other. After you call this function,
+/// SoundIoDuplexStream::software_latency is set.
+/// Only ALSA supports duplex streams, and only for devices which can be
+/// linked, which usually means raw devices on the same card.
+///
+/// Possible errors:
+/// * #SoundIoErrorInvalid
+///   * the streams are not open, or have been started
+///   * the streams belong to different SoundIo contexts
+///   * the sample rates differ
+///   * SoundIoDuplexStream::duplex_callback is `NULL`
+///   * SoundIoOutStream::timer_scheduling or SoundIoOutStream::adaptive_latency
+///     is in use
+/// * #SoundIoErrorIncompatibleBackend
+/// * #SoundIoErrorIncompatibleDevice - the devices cannot be linked, or the
+///   output buffer is too small to hold two input periods.
+SOUNDIO_EXPORT int soundio_duplex_stream_open(struct SoundIoDuplexStream *duplex);
+
+/// Fills the output buffer with silence, starts both streams on the same
+/// sample and begins calling SoundIoDuplexStream::duplex_callback. Do not
+/// start the two streams yourself.
+///
+/// Possible errors:
+/// * #SoundIoErrorNoMem
+/// * #SoundIoErrorSystemResources
+/// * #SoundIoErrorIncompatibleBackend
+SOUNDIO_EXPORT int soundio_duplex_stream_start(struct SoundIoDuplexStream *duplex);
 
 /// A ring buffer is a single-reader single-writer lock-free fixed-size queue.
 /// libsoundio ring buffers use memory mapping techniques to enable a
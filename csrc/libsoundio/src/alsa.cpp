@@ -9,6 +9,13 @@
 #include "soundio.hpp"
 
 #include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 
 static snd_pcm_stream_t stream_types[] = {SND_PCM_STREAM_PLAYBACK, SND_PCM_STREAM_CAPTURE};
 
@@ -32,15 +39,36 @@ static void wakeup_device_poll(SoundIoAlsa *sia) {
     }
 }
 
+static void engine_thread_deinit(SoundIoAlsaEngineThread *et);
+static void probe_cache_clear(SoundIoAlsa *sia);
+static void merge_lazy_results(SoundIoAlsa *sia);
+static void save_capability_cache(SoundIoAlsa *sia);
+static void queue_lazy_result(SoundIoDevicePrivate *dev);
+
 static void destroy_alsa(SoundIoPrivate *si) {
     SoundIoAlsa *sia = &si->backend_data.alsa;
 
+    if (sia->engine_threads) {
+        for (int i = 0; i < sia->engine_thread_count; i += 1)
+            engine_thread_deinit(&sia->engine_threads[i]);
+        free(sia->engine_threads);
+    }
+
     if (sia->thread) {
         sia->abort_flag.clear();
         wakeup_device_poll(sia);
         soundio_os_thread_destroy(sia->thread);
     }
 
+    // keep what was probed since the last scan for the next process
+    if (sia->lazy_results_mutex) {
+        merge_lazy_results(sia);
+        if (sia->capability_cache_path && sia->probe_cache_dirty)
+            save_capability_cache(sia);
+        soundio_os_mutex_destroy(sia->lazy_results_mutex);
+    }
+    sia->lazy_results.deinit();
+
     sia->pending_files.deinit();
 
     if (sia->cond)
@@ -51,7 +79,11 @@ static void destroy_alsa(SoundIoPrivate *si) {
 
     soundio_destroy_devices_info(sia->ready_devices_info);
 
-
+    probe_cache_clear(sia);
+    sia->probe_cache.deinit();
+    soundio_destroy_devices_info(sia->last_devices_info);
+    sia->changed_cards.deinit();
+    free(sia->capability_cache_path);
 
     close(sia->notify_pipe_fd[0]);
     close(sia->notify_pipe_fd[1]);
@@ -227,6 +259,8 @@ static snd_pcm_format_t to_alsa_fmt(SoundIoFormat fmt) {
     case SoundIoFormatFloat32BE:    return SND_PCM_FORMAT_FLOAT_BE;
     case SoundIoFormatFloat64LE:    return SND_PCM_FORMAT_FLOAT64_LE;
     case SoundIoFormatFloat64BE:    return SND_PCM_FORMAT_FLOAT64_BE;
+    case SoundIoFormatS24PackedLE:  return SND_PCM_FORMAT_S24_3LE;
+    case SoundIoFormatS24PackedBE:  return SND_PCM_FORMAT_S24_3BE;
 
     case SoundIoFormatInvalid:
         return SND_PCM_FORMAT_UNKNOWN;
@@ -241,9 +275,19 @@ static void test_fmt_mask(SoundIoDevice *device, const snd_pcm_format_mask_t *fm
     }
 }
 
-static int set_access(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams, snd_pcm_access_t *out_access) {
+static bool is_mmap_access(snd_pcm_access_t access) {
+    return access != SND_PCM_ACCESS_RW_INTERLEAVED && access != SND_PCM_ACCESS_RW_NONINTERLEAVED;
+}
+
+static int set_access(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams, SoundIoAccessMode mode,
+        snd_pcm_access_t *out_access)
+{
     for (int i = 0; i < array_length(prioritized_access_types); i += 1) {
         snd_pcm_access_t access = prioritized_access_types[i];
+        if (mode == SoundIoAccessModeDirect && !is_mmap_access(access))
+            continue;
+        if (mode == SoundIoAccessModeCopy && is_mmap_access(access))
+            continue;
         int err = snd_pcm_hw_params_set_access(handle, hwparams, access);
         if (err >= 0) {
             if (out_access)
@@ -251,7 +295,46 @@ static int set_access(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams, snd_pcm_
             return 0;
         }
     }
-    return SoundIoErrorOpeningDevice;
+    return (mode == SoundIoAccessModeAuto) ? SoundIoErrorOpeningDevice : SoundIoErrorIncompatibleDevice;
+}
+
+// Exclusive streams skip the conversions the plug layer would insert.
+static const int exclusive_open_mode =
+    SND_PCM_NO_AUTO_RESAMPLE | SND_PCM_NO_AUTO_CHANNELS | SND_PCM_NO_AUTO_FORMAT;
+
+// Sets the smallest power of two period the hardware accepts, or the
+// smallest period at all if no power of two fits. Call after the format,
+// channel count and rate are set, since they constrain the period.
+static int set_exclusive_period(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams,
+        snd_pcm_uframes_t *out_period_size)
+{
+    snd_pcm_uframes_t period_min;
+    snd_pcm_uframes_t period_max;
+    int dir = 0;
+    if (snd_pcm_hw_params_get_period_size_min(hwparams, &period_min, &dir) < 0)
+        return SoundIoErrorOpeningDevice;
+    if (snd_pcm_hw_params_get_period_size_max(hwparams, &period_max, &dir) < 0)
+        return SoundIoErrorOpeningDevice;
+
+    snd_pcm_uframes_t period_size = 1;
+    while (period_size < period_min)
+        period_size *= 2;
+    for (; period_size <= period_max; period_size *= 2) {
+        if (snd_pcm_hw_params_test_period_size(handle, hwparams, period_size, 0) == 0) {
+            if (snd_pcm_hw_params_set_period_size(handle, hwparams, period_size, 0) < 0)
+                return SoundIoErrorOpeningDevice;
+            *out_period_size = period_size;
+            return 0;
+        }
+    }
+
+    dir = 0;
+    if (snd_pcm_hw_params_set_period_size_min(handle, hwparams, &period_min, &dir) < 0)
+        return SoundIoErrorOpeningDevice;
+    if (snd_pcm_hw_params_set_period_size_first(handle, hwparams, &period_min, &dir) < 0)
+        return SoundIoErrorOpeningDevice;
+    *out_period_size = period_min;
+    return 0;
 }
 
 // this function does not override device->formats, so if you want it to, deallocate and set it to NULL
@@ -270,7 +353,7 @@ static int probe_open_device(SoundIoDevice *device, snd_pcm_t *handle, int resam
     if ((err = snd_pcm_hw_params_set_rate_resample(handle, hwparams, resample)) < 0)
         return SoundIoErrorOpeningDevice;
 
-    if ((err = set_access(handle, hwparams, nullptr)))
+    if ((err = set_access(handle, hwparams, SoundIoAccessModeAuto, nullptr)))
         return err;
 
     unsigned int channels_min;
@@ -339,13 +422,15 @@ static int probe_open_device(SoundIoDevice *device, snd_pcm_t *handle, int resam
     snd_pcm_format_mask_set(fmt_mask, SND_PCM_FORMAT_FLOAT_BE);
     snd_pcm_format_mask_set(fmt_mask, SND_PCM_FORMAT_FLOAT64_LE);
     snd_pcm_format_mask_set(fmt_mask, SND_PCM_FORMAT_FLOAT64_BE);
+    snd_pcm_format_mask_set(fmt_mask, SND_PCM_FORMAT_S24_3LE);
+    snd_pcm_format_mask_set(fmt_mask, SND_PCM_FORMAT_S24_3BE);
 
     if ((err = snd_pcm_hw_params_set_format_mask(handle, hwparams, fmt_mask)) < 0)
         return SoundIoErrorOpeningDevice;
 
     if (!device->formats) {
         snd_pcm_hw_params_get_format_mask(hwparams, fmt_mask);
-        device->formats = allocate<SoundIoFormat>(18);
+        device->formats = allocate<SoundIoFormat>(20);
         if (!device->formats)
             return SoundIoErrorNoMem;
 
@@ -368,6 +453,8 @@ static int probe_open_device(SoundIoDevice *device, snd_pcm_t *handle, int resam
         test_fmt_mask(device, fmt_mask, SoundIoFormatFloat32BE);
         test_fmt_mask(device, fmt_mask, SoundIoFormatFloat64LE);
         test_fmt_mask(device, fmt_mask, SoundIoFormatFloat64BE);
+        test_fmt_mask(device, fmt_mask, SoundIoFormatS24PackedLE);
+        test_fmt_mask(device, fmt_mask, SoundIoFormatS24PackedBE);
     }
 
     return 0;
@@ -379,7 +466,8 @@ static int probe_device(SoundIoDevice *device, snd_pcm_chmap_query_t **maps) {
 
     snd_pcm_stream_t stream = aim_to_stream(device->aim);
 
-    if ((err = snd_pcm_open(&handle, device->id, stream, 0)) < 0) {
+    // don't wait for devices which are busy
+    if ((err = snd_pcm_open(&handle, device->id, stream, SND_PCM_NONBLOCK)) < 0) {
         handle_channel_maps(device, maps);
         return SoundIoErrorOpeningDevice;
     }
@@ -448,144 +536,107 @@ static int probe_device(SoundIoDevice *device, snd_pcm_chmap_query_t **maps) {
     return 0;
 }
 
-static inline bool str_has_prefix(const char *big_str, const char *prefix) {
-    return strncmp(big_str, prefix, strlen(prefix)) == 0;
+// Raw devices have ids of the form "hw:<card>,<device>".
+static snd_pcm_chmap_query_t **query_raw_chmaps(SoundIoDevice *device) {
+    int card_index;
+    int device_index;
+    if (!device->is_raw || sscanf(device->id, "hw:%d,%d", &card_index, &device_index) != 2)
+        return nullptr;
+    return snd_pcm_query_chmaps_from_hw(card_index, device_index, -1, aim_to_stream(device->aim));
 }
 
-static int refresh_devices(SoundIoPrivate *si) {
-    SoundIo *soundio = &si->pub;
-    SoundIoAlsa *sia = &si->backend_data.alsa;
-
-    int err;
-    if ((err = snd_config_update_free_global()) < 0)
-        return SoundIoErrorSystemResources;
-    if ((err = snd_config_update()) < 0)
-        return SoundIoErrorSystemResources;
-
-    SoundIoDevicesInfo *devices_info = allocate<SoundIoDevicesInfo>(1);
-    if (!devices_info)
-        return SoundIoErrorNoMem;
-    devices_info->default_output_index = -1;
-    devices_info->default_input_index = -1;
-
-    void **hints;
-    if (snd_device_name_hint(-1, "pcm", &hints) < 0) {
-        soundio_destroy_devices_info(devices_info);
-        return SoundIoErrorNoMem;
-    }
-
-    for (void **hint_ptr = hints; *hint_ptr; hint_ptr += 1) {
-        char *name = snd_device_name_get_hint(*hint_ptr, "NAME");
-        // null - libsoundio has its own dummy backend. API clients should use
-        // that instead of alsa null device.
-        if (strcmp(name, "null") == 0 ||
-            // sysdefault is confusing - the name and description is identical
-            // to default, and my best guess for what it does is ignore ~/.asoundrc
-            // which is just an accident waiting to happen.
-            str_has_prefix(name, "sysdefault:") ||
-            // all these surround devices are clutter
-            str_has_prefix(name, "front:") ||
-            str_has_prefix(name, "surround21:") ||
-            str_has_prefix(name, "surround40:") ||
-            str_has_prefix(name, "surround41:") ||
-            str_has_prefix(name, "surround50:") ||
-            str_has_prefix(name, "surround51:") ||
-            str_has_prefix(name, "surround71:"))
-        {
-            free(name);
-            continue;
-        }
-
-        char *descr = snd_device_name_get_hint(*hint_ptr, "DESC");
-        char *descr1 = str_partition_on_char(descr, '\n');
+static int device_probe_alsa(SoundIoDevicePrivate *dev) {
+    SoundIoDevice *device = &dev->pub;
+    int err = probe_device(device, query_raw_chmaps(device));
+    if (!err && dev->backend_data.alsa.identity)
+        queue_lazy_result(dev);
+    return err;
+}
 
-        char *io = snd_device_name_get_hint(*hint_ptr, "IOID");
-        bool is_playback;
-        bool is_capture;
-        if (io) {
-            if (strcmp(io, "Input") == 0) {
-                is_playback = false;
-                is_capture = true;
-            } else {
-                assert(strcmp(io, "Output") == 0);
-                is_playback = true;
-                is_capture = false;
-            }
-            free(io);
-        } else {
-            is_playback = true;
-            is_capture = true;
-        }
+static void destruct_device(SoundIoDevicePrivate *dev) {
+    free(dev->backend_data.alsa.identity);
+}
 
-        for (int stream_type_i = 0; stream_type_i < array_length(stream_types); stream_type_i += 1) {
-            snd_pcm_stream_t stream = stream_types[stream_type_i];
-            if (stream == SND_PCM_STREAM_PLAYBACK && !is_playback) continue;
-            if (stream == SND_PCM_STREAM_CAPTURE && !is_capture) continue;
-            if (stream == SND_PCM_STREAM_CAPTURE && descr1 &&
-                (strstr(descr1, "Output") || strstr(descr1, "output")))
-            {
-                continue;
-            }
+static inline bool str_has_prefix(const char *big_str, const char *prefix) {
+    return strncmp(big_str, prefix, strlen(prefix)) == 0;
+}
 
+static const int SOUNDIO_ALSA_MAX_PROBE_THREADS = 8;
 
-            SoundIoDevicePrivate *dev = allocate<SoundIoDevicePrivate>(1);
-            if (!dev) {
-                free(name);
-                free(descr);
-                soundio_destroy_devices_info(devices_info);
-                snd_device_name_free_hint(hints);
-                return SoundIoErrorNoMem;
-            }
-            SoundIoDevice *device = &dev->pub;
-            device->ref_count = 1;
-            device->soundio = soundio;
-            device->is_raw = false;
-            device->id = strdup(name);
-            device->name = descr1 ?
-                soundio_alloc_sprintf(nullptr, "%s: %s", descr, descr1) : strdup(descr);
+struct SoundIoAlsaCard {
+    int index;
+    char *id;
+    // card id, driver, long name (which includes the bus address) and mixer
+    // name (which names the codec). Stable across reboots, so that it can key
+    // the capability cache file.
+    char *identity;
+};
 
-            if (!device->id || !device->name) {
-                soundio_device_unref(device);
-                free(name);
-                free(descr);
-                soundio_destroy_devices_info(devices_info);
-                snd_device_name_free_hint(hints);
-                return SoundIoErrorNoMem;
-            }
+struct SoundIoAlsaProbeJob {
+    SoundIoDevice *device;
+    snd_pcm_chmap_query_t **maps;
+    // NULL if the result should not be cached
+    char *identity;
+};
 
-            SoundIoList<SoundIoDevice *> *device_list;
-            bool is_default = str_has_prefix(name, "default:") || strcmp(name, "default") == 0;
-            if (stream == SND_PCM_STREAM_PLAYBACK) {
-                device->aim = SoundIoDeviceAimOutput;
-                device_list = &devices_info->output_devices;
-                if (devices_info->default_output_index < 0 && is_default)
-                    devices_info->default_output_index = device_list->length;
-            } else {
-                assert(stream == SND_PCM_STREAM_CAPTURE);
-                device->aim = SoundIoDeviceAimInput;
-                device_list = &devices_info->input_devices;
-                if (devices_info->default_input_index < 0 && is_default)
-                    devices_info->default_input_index = device_list->length;
-            }
+struct SoundIoAlsaProbePool {
+    SoundIoList<SoundIoAlsaProbeJob> *jobs;
+    atomic_int next_job;
+};
 
-            device->probe_error = probe_device(device, nullptr);
+struct RefreshDevices {
+    SoundIoDevicesInfo *devices_info;
+    SoundIoList<SoundIoAlsaCard> cards;
+    SoundIoList<SoundIoAlsaProbeJob> jobs;
+    char *config_identity;
+    char *all_cards_identity;
+    void **hints;
+};
 
-            if (device_list->append(device)) {
-                soundio_device_unref(device);
-                free(name);
-                free(descr);
-                soundio_destroy_devices_info(devices_info);
-                snd_device_name_free_hint(hints);
-                return SoundIoErrorNoMem;
-            }
-        }
+static void deinit_refresh_devices(RefreshDevices *rd) {
+    soundio_destroy_devices_info(rd->devices_info);
+    for (int i = 0; i < rd->cards.length; i += 1) {
+        SoundIoAlsaCard *card = &rd->cards.at(i);
+        free(card->id);
+        free(card->identity);
+    }
+    rd->cards.deinit();
+    for (int i = 0; i < rd->jobs.length; i += 1) {
+        SoundIoAlsaProbeJob *job = &rd->jobs.at(i);
+        if (job->maps)
+            snd_pcm_free_chmaps(job->maps);
+        free(job->identity);
+    }
+    rd->jobs.deinit();
+    free(rd->config_identity);
+    free(rd->all_cards_identity);
+    if (rd->hints)
+        snd_device_name_free_hint(rd->hints);
+}
 
-        free(name);
-        free(descr);
+static struct timespec get_mtime(const char *path) {
+    struct stat st;
+    if (!path || stat(path, &st)) {
+        struct timespec zero = {0, 0};
+        return zero;
     }
+    return st.st_mtim;
+}
 
-    snd_device_name_free_hint(hints);
+// Devices defined by the configuration change whenever the configuration does.
+static char *get_config_identity(void) {
+    const char *home = getenv("HOME");
+    char *user_path = home ? soundio_alloc_sprintf(nullptr, "%s/.asoundrc", home) : nullptr;
+    struct timespec user_mtime = get_mtime(user_path);
+    struct timespec sys_mtime = get_mtime("/etc/asound.conf");
+    free(user_path);
+    return soundio_alloc_sprintf(nullptr, "%lld.%09ld,%lld.%09ld",
+            (long long)sys_mtime.tv_sec, (long)sys_mtime.tv_nsec,
+            (long long)user_mtime.tv_sec, (long)user_mtime.tv_nsec);
+}
 
+static int get_cards(RefreshDevices *rd) {
+    int err;
     int card_index = -1;
 
     if (snd_card_next(&card_index) < 0)
@@ -594,143 +645,1144 @@ static int refresh_devices(SoundIoPrivate *si) {
     snd_ctl_card_info_t *card_info;
     snd_ctl_card_info_alloca(&card_info);
 
-    snd_pcm_info_t *pcm_info;
-    snd_pcm_info_alloca(&pcm_info);
-
     while (card_index >= 0) {
-        int err;
         snd_ctl_t *handle;
         char name[32];
         sprintf(name, "hw:%d", card_index);
         if ((err = snd_ctl_open(&handle, name, 0)) < 0) {
-            if (err == -ENOENT) {
+            if (err == -ENOENT)
                 break;
-            } else {
-                soundio_destroy_devices_info(devices_info);
-                return SoundIoErrorOpeningDevice;
-            }
+            return SoundIoErrorOpeningDevice;
         }
 
         if ((err = snd_ctl_card_info(handle, card_info)) < 0) {
             snd_ctl_close(handle);
-            soundio_destroy_devices_info(devices_info);
             return SoundIoErrorSystemResources;
         }
-        const char *card_name = snd_ctl_card_info_get_name(card_info);
-
-        int device_index = -1;
-        for (;;) {
-            if (snd_ctl_pcm_next_device(handle, &device_index) < 0) {
-                snd_ctl_close(handle);
-                soundio_destroy_devices_info(devices_info);
-                return SoundIoErrorSystemResources;
-            }
-            if (device_index < 0)
-                break;
 
-            snd_pcm_info_set_device(pcm_info, device_index);
-            snd_pcm_info_set_subdevice(pcm_info, 0);
+        if ((err = rd->cards.add_one())) {
+            snd_ctl_close(handle);
+            return SoundIoErrorNoMem;
+        }
+        SoundIoAlsaCard *card = &rd->cards.last();
+        card->index = card_index;
+        card->id = strdup(snd_ctl_card_info_get_id(card_info));
+        card->identity = card->id ? soundio_alloc_sprintf(nullptr, "%s|%s|%s|%s", card->id,
+                snd_ctl_card_info_get_driver(card_info),
+                snd_ctl_card_info_get_longname(card_info),
+                snd_ctl_card_info_get_mixername(card_info)) : nullptr;
+        snd_ctl_close(handle);
+        if (!card->identity)
+            return SoundIoErrorNoMem;
 
-            for (int stream_type_i = 0; stream_type_i < array_length(stream_types); stream_type_i += 1) {
-                snd_pcm_stream_t stream = stream_types[stream_type_i];
-                snd_pcm_info_set_stream(pcm_info, stream);
+        if (snd_card_next(&card_index) < 0)
+            return SoundIoErrorSystemResources;
+    }
 
-                if ((err = snd_ctl_pcm_info(handle, pcm_info)) < 0) {
-                    if (err == -ENOENT) {
-                        continue;
-                    } else {
-                        snd_ctl_close(handle);
-                        soundio_destroy_devices_info(devices_info);
-                        return SoundIoErrorSystemResources;
-                    }
-                }
+    rd->all_cards_identity = strdup("");
+    for (int i = 0; i < rd->cards.length && rd->all_cards_identity; i += 1) {
+        char *prev = rd->all_cards_identity;
+        rd->all_cards_identity = soundio_alloc_sprintf(nullptr, "%s;%s", prev, rd->cards.at(i).identity);
+        free(prev);
+    }
+    if (!rd->all_cards_identity)
+        return SoundIoErrorNoMem;
 
-                const char *device_name = snd_pcm_info_get_name(pcm_info);
+    return 0;
+}
 
-                SoundIoDevicePrivate *dev = allocate<SoundIoDevicePrivate>(1);
-                if (!dev) {
-                    snd_ctl_close(handle);
-                    soundio_destroy_devices_info(devices_info);
-                    return SoundIoErrorNoMem;
-                }
-                SoundIoDevice *device = &dev->pub;
-                device->ref_count = 1;
-                device->soundio = soundio;
-                device->id = soundio_alloc_sprintf(nullptr, "hw:%d,%d", card_index, device_index);
-                device->name = soundio_alloc_sprintf(nullptr, "%s %s", card_name, device_name);
-                device->is_raw = true;
+static SoundIoAlsaCard *find_card(RefreshDevices *rd, int card_index) {
+    for (int i = 0; i < rd->cards.length; i += 1) {
+        SoundIoAlsaCard *card = &rd->cards.at(i);
+        if (card->index == card_index)
+            return card;
+    }
+    return nullptr;
+}
 
-                if (!device->id || !device->name) {
-                    soundio_device_unref(device);
-                    snd_ctl_close(handle);
-                    soundio_destroy_devices_info(devices_info);
-                    return SoundIoErrorNoMem;
-                }
+// card_param points just past "CARD=" in a device name
+static int card_index_from_id(RefreshDevices *rd, const char *card_param) {
+    size_t len = strcspn(card_param, ",");
+    for (int i = 0; i < rd->cards.length; i += 1) {
+        SoundIoAlsaCard *card = &rd->cards.at(i);
+        if (strlen(card->id) == len && strncmp(card->id, card_param, len) == 0)
+            return card->index;
+    }
+    return -1;
+}
 
-                SoundIoList<SoundIoDevice *> *device_list;
-                if (stream == SND_PCM_STREAM_PLAYBACK) {
-                    device->aim = SoundIoDeviceAimOutput;
-                    device_list = &devices_info->output_devices;
-                } else {
-                    assert(stream == SND_PCM_STREAM_CAPTURE);
-                    device->aim = SoundIoDeviceAimInput;
-                    device_list = &devices_info->input_devices;
-                }
+// Hint devices such as "plughw:CARD=PCH,DEV=0" depend on the configuration
+// and on the card they name. Devices which name no card, such as "default",
+// may depend on any of them.
+static char *hint_identity(RefreshDevices *rd, int card_index) {
+    SoundIoAlsaCard *card = (card_index >= 0) ? find_card(rd, card_index) : nullptr;
+    return soundio_alloc_sprintf(nullptr, "%s|%s", rd->config_identity,
+            card ? card->identity : rd->all_cards_identity);
+}
 
-                snd_pcm_chmap_query_t **maps = snd_pcm_query_chmaps_from_hw(card_index, device_index, -1, stream);
-                device->probe_error = probe_device(device, maps);
+static char *hw_identity(RefreshDevices *rd, int card_index) {
+    SoundIoAlsaCard *card = find_card(rd, card_index);
+    return card ? strdup(card->identity) : nullptr;
+}
 
-                if (device_list->append(device)) {
-                    soundio_device_unref(device);
-                    soundio_destroy_devices_info(devices_info);
-                    return SoundIoErrorNoMem;
-                }
-            }
-        }
-        snd_ctl_close(handle);
-        if (snd_card_next(&card_index) < 0) {
-            soundio_destroy_devices_info(devices_info);
-            return SoundIoErrorSystemResources;
+static SoundIoAlsaProbeCacheEntry *probe_cache_find(SoundIoAlsa *sia, SoundIoDevice *device) {
+    for (int i = 0; i < sia->probe_cache.length; i += 1) {
+        SoundIoAlsaProbeCacheEntry *entry = &sia->probe_cache.at(i);
+        SoundIoDevice *cached = entry->device;
+        if (cached->aim == device->aim && cached->is_raw == device->is_raw &&
+            strcmp(cached->id, device->id) == 0)
+        {
+            return entry;
         }
     }
+    return nullptr;
+}
 
-    soundio_os_mutex_lock(sia->mutex);
-    soundio_destroy_devices_info(sia->ready_devices_info);
-    sia->ready_devices_info = devices_info;
-    sia->have_devices_flag = true;
-    soundio_os_cond_signal(sia->cond, sia->mutex);
-    soundio->on_events_signal(soundio);
-    soundio_os_mutex_unlock(sia->mutex);
-    return 0;
+// Carrying over a device from the last scan counts as finding it again.
+static void probe_cache_keep(SoundIoAlsa *sia, SoundIoDevice *device) {
+    SoundIoAlsaProbeCacheEntry *entry = probe_cache_find(sia, device);
+    if (entry)
+        entry->seen = true;
 }
 
-static void shutdown_backend(SoundIoPrivate *si, int err) {
-    SoundIo *soundio = &si->pub;
-    SoundIoAlsa *sia = &si->backend_data.alsa;
-    soundio_os_mutex_lock(sia->mutex);
-    sia->shutdown_err = err;
-    soundio_os_cond_signal(sia->cond, sia->mutex);
-    soundio->on_events_signal(soundio);
-    soundio_os_mutex_unlock(sia->mutex);
+static bool card_changed(SoundIoAlsa *sia, int card_index) {
+    if (sia->rescan_all || !sia->last_devices_info)
+        return true;
+    for (int i = 0; i < sia->changed_cards.length; i += 1) {
+        if (sia->changed_cards.at(i) == card_index)
+            return true;
+    }
+    return false;
 }
 
-static bool copy_str(char *dest, const char *src, int buf_len) {
-    for (;;) {
-        buf_len -= 1;
-        if (buf_len <= 0)
-            return false;
-        *dest = *src;
-        dest += 1;
-        src += 1;
-        if (!*src)
-            break;
+// Devices which are not tied to a single card are only reused if no card
+// changed at all, since they may route to any of them.
+static SoundIoDevice *find_last_device(SoundIoAlsa *sia, const char *id, SoundIoDeviceAim aim) {
+    if (sia->rescan_all || !sia->last_devices_info)
+        return nullptr;
+    SoundIoList<SoundIoDevice *> *device_list = (aim == SoundIoDeviceAimOutput) ?
+        &sia->last_devices_info->output_devices : &sia->last_devices_info->input_devices;
+    for (int i = 0; i < device_list->length; i += 1) {
+        SoundIoDevice *device = device_list->at(i);
+        if (strcmp(device->id, id) == 0)
+            return device;
     }
-    *dest = '\0';
-    return true;
+    return nullptr;
 }
 
-static void device_thread_run(void *arg) {
-    SoundIoPrivate *si = (SoundIoPrivate *)arg;
+// Keeps references to the published devices so that the next scan can carry
+// over the devices of cards which did not change.
+static int remember_devices(SoundIoAlsa *sia, SoundIoDevicesInfo *devices_info) {
+    SoundIoDevicesInfo *last = allocate<SoundIoDevicesInfo>(1);
+    if (!last)
+        return SoundIoErrorNoMem;
+    for (int i = 0; i < devices_info->output_devices.length; i += 1) {
+        SoundIoDevice *device = devices_info->output_devices.at(i);
+        if (last->output_devices.append(device)) {
+            soundio_destroy_devices_info(last);
+            return SoundIoErrorNoMem;
+        }
+        soundio_device_ref(device);
+    }
+    for (int i = 0; i < devices_info->input_devices.length; i += 1) {
+        SoundIoDevice *device = devices_info->input_devices.at(i);
+        if (last->input_devices.append(device)) {
+            soundio_destroy_devices_info(last);
+            return SoundIoErrorNoMem;
+        }
+        soundio_device_ref(device);
+    }
+    soundio_destroy_devices_info(sia->last_devices_info);
+    sia->last_devices_info = last;
+    return 0;
+}
+
+static int reuse_card_devices(SoundIoAlsa *sia, RefreshDevices *rd, int card_index) {
+    SoundIoList<SoundIoDevice *> *lists[] = {
+        &sia->last_devices_info->output_devices,
+        &sia->last_devices_info->input_devices,
+    };
+    SoundIoList<SoundIoDevice *> *new_lists[] = {
+        &rd->devices_info->output_devices,
+        &rd->devices_info->input_devices,
+    };
+    for (int list_i = 0; list_i < array_length(lists); list_i += 1) {
+        for (int i = 0; i < lists[list_i]->length; i += 1) {
+            SoundIoDevice *device = lists[list_i]->at(i);
+            SoundIoDevicePrivate *dev = (SoundIoDevicePrivate *)device;
+            if (!device->is_raw || dev->backend_data.alsa.card_index != card_index)
+                continue;
+            if (new_lists[list_i]->append(device))
+                return SoundIoErrorNoMem;
+            soundio_device_ref(device);
+            probe_cache_keep(sia, device);
+        }
+    }
+    return 0;
+}
+
+// Copies everything probe_device fills in.
+static int copy_probe_result(SoundIoDevice *dest, const SoundIoDevice *src) {
+    SoundIoDevicePrivate *dest_dev = (SoundIoDevicePrivate *)dest;
+
+    assert(src->sample_rate_count == 1);
+    dest->sample_rate_count = 1;
+    dest->sample_rates = &dest_dev->prealloc_sample_rate_range;
+    dest->sample_rates[0] = src->sample_rates[0];
+    dest->sample_rate_current = src->sample_rate_current;
+
+    dest->software_latency_min = src->software_latency_min;
+    dest->software_latency_max = src->software_latency_max;
+    dest->software_latency_current = src->software_latency_current;
+
+    dest->current_format = src->current_format;
+    dest->current_layout = src->current_layout;
+
+    dest->formats = allocate_nonzero<SoundIoFormat>(max(src->format_count, 1));
+    dest->layouts = allocate_nonzero<SoundIoChannelLayout>(max(src->layout_count, 1));
+    if (!dest->formats || !dest->layouts)
+        return SoundIoErrorNoMem;
+    memcpy(dest->formats, src->formats, src->format_count * sizeof(SoundIoFormat));
+    dest->format_count = src->format_count;
+    memcpy(dest->layouts, src->layouts, src->layout_count * sizeof(SoundIoChannelLayout));
+    dest->layout_count = src->layout_count;
+
+    dest->probe_error = src->probe_error;
+    return 0;
+}
+
+// Takes ownership of identity. A device whose cached identity still matches
+// is filled in from the cache, otherwise it is queued to be probed, or left
+// for soundio_device_probe with SoundIo::lazy_probe. Channel maps are only
+// queried for devices which actually need probing.
+static int add_probe_job(SoundIoAlsa *sia, RefreshDevices *rd, SoundIoDevice *device, char *identity,
+        int card_index, int device_index, snd_pcm_stream_t stream)
+{
+    int err;
+    SoundIoAlsaProbeCacheEntry *entry = identity ? probe_cache_find(sia, device) : nullptr;
+    if (entry && strcmp(entry->identity, identity) == 0 && strcmp(entry->device->name, device->name) == 0) {
+        free(identity);
+        entry->seen = true;
+        return copy_probe_result(device, entry->device);
+    }
+
+    if (sia->lazy_probe) {
+        SoundIoDevicePrivate *dev = (SoundIoDevicePrivate *)device;
+        dev->backend_data.alsa.identity = identity;
+        dev->destruct = destruct_device;
+        dev->probe = device_probe_alsa;
+        device->probe_error = SoundIoErrorNotProbed;
+        return 0;
+    }
+
+    if ((err = rd->jobs.add_one())) {
+        free(identity);
+        return SoundIoErrorNoMem;
+    }
+    SoundIoAlsaProbeJob *job = &rd->jobs.last();
+    job->device = device;
+    job->identity = identity;
+    job->maps = (card_index >= 0) ?
+        snd_pcm_query_chmaps_from_hw(card_index, device_index, -1, stream) : nullptr;
+    return 0;
+}
+
+static void probe_thread_run(void *arg) {
+    SoundIoAlsaProbePool *pool = (SoundIoAlsaProbePool *)arg;
+    for (;;) {
+        int job_index = pool->next_job.fetch_add(1);
+        if (job_index >= pool->jobs->length)
+            return;
+        SoundIoAlsaProbeJob *job = &pool->jobs->at(job_index);
+        snd_pcm_chmap_query_t **maps = job->maps;
+        // probe_device takes ownership of the maps
+        job->maps = nullptr;
+        job->device->probe_error = probe_device(job->device, maps);
+    }
+}
+
+// Probes on the calling thread plus up to SOUNDIO_ALSA_MAX_PROBE_THREADS - 1
+// helpers. Probing mostly waits on the kernel and on device servers, so this
+// is not limited by the number of CPUs.
+static void run_probe_jobs(SoundIoList<SoundIoAlsaProbeJob> *jobs) {
+    SoundIoAlsaProbePool pool;
+    pool.jobs = jobs;
+    pool.next_job.store(0);
+
+    int thread_count = min(jobs->length, SOUNDIO_ALSA_MAX_PROBE_THREADS);
+
+    SoundIoOsThread *threads[SOUNDIO_ALSA_MAX_PROBE_THREADS];
+    int started_count = 0;
+    for (int i = 1; i < thread_count; i += 1) {
+        if (soundio_os_thread_create(probe_thread_run, &pool, nullptr, &threads[started_count]))
+            break;
+        started_count += 1;
+    }
+
+    probe_thread_run(&pool);
+
+    for (int i = 0; i < started_count; i += 1)
+        soundio_os_thread_destroy(threads[i]);
+}
+
+// Makes the private copy of a probed device which the probe cache holds.
+static int copy_cached_device(SoundIo *soundio, SoundIoDevice *device, SoundIoDevice **out_cached) {
+    SoundIoDevicePrivate *cached_dev = allocate<SoundIoDevicePrivate>(1);
+    if (!cached_dev)
+        return SoundIoErrorNoMem;
+    SoundIoDevice *cached = &cached_dev->pub;
+    cached_dev->ref_count.store(1);
+    cached->soundio = soundio;
+    cached->aim = device->aim;
+    cached->is_raw = device->is_raw;
+    cached->id = strdup(device->id);
+    cached->name = strdup(device->name);
+    int err;
+    if (!cached->id || !cached->name) {
+        soundio_device_unref(cached);
+        return SoundIoErrorNoMem;
+    }
+    if ((err = copy_probe_result(cached, device))) {
+        soundio_device_unref(cached);
+        return err;
+    }
+    *out_cached = cached;
+    return 0;
+}
+
+// Takes ownership of cached and identity, also when it fails.
+static int probe_cache_insert(SoundIoAlsa *sia, SoundIoDevice *cached, char *identity, bool seen) {
+    SoundIoAlsaProbeCacheEntry *entry = probe_cache_find(sia, cached);
+    if (entry) {
+        soundio_device_unref(entry->device);
+        free(entry->identity);
+    } else {
+        if (sia->probe_cache.add_one()) {
+            soundio_device_unref(cached);
+            free(identity);
+            return SoundIoErrorNoMem;
+        }
+        entry = &sia->probe_cache.last();
+    }
+    entry->device = cached;
+    entry->identity = identity;
+    entry->seen = seen;
+    entry->from_disk = false;
+    sia->probe_cache_dirty = true;
+    return 0;
+}
+
+static int probe_cache_store(SoundIoPrivate *si, SoundIoAlsaProbeJob *job) {
+    SoundIoAlsa *sia = &si->backend_data.alsa;
+    SoundIoDevice *cached;
+    int err;
+    if ((err = copy_cached_device(&si->pub, job->device, &cached)))
+        return err;
+    char *identity = job->identity;
+    job->identity = nullptr;
+    return probe_cache_insert(sia, cached, identity, true);
+}
+
+// Called on the application's thread, which must not touch probe_cache, so
+// the result is handed to the device thread. Caching is only an
+// optimization, so this gives up quietly.
+static void queue_lazy_result(SoundIoDevicePrivate *dev) {
+    SoundIoDevice *device = &dev->pub;
+    SoundIo *soundio = device->soundio;
+    SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+    SoundIoAlsa *sia = &si->backend_data.alsa;
+    // the device may have outlived its backend
+    if (soundio->current_backend != SoundIoBackendAlsa)
+        return;
+
+    SoundIoAlsaProbeCacheEntry entry = {};
+    if (copy_cached_device(soundio, device, &entry.device))
+        return;
+    // not filled in until soundio_device_probe returns
+    entry.device->probe_error = SoundIoErrorNone;
+    if (!(entry.identity = strdup(dev->backend_data.alsa.identity))) {
+        soundio_device_unref(entry.device);
+        return;
+    }
+
+    soundio_os_mutex_lock(sia->lazy_results_mutex);
+    int err = sia->lazy_results.append(entry);
+    soundio_os_mutex_unlock(sia->lazy_results_mutex);
+    if (err) {
+        soundio_device_unref(entry.device);
+        free(entry.identity);
+    }
+}
+
+// Entries are added as not yet seen, so the scan which follows keeps only
+// those whose devices are still there.
+static void merge_lazy_results(SoundIoAlsa *sia) {
+    soundio_os_mutex_lock(sia->lazy_results_mutex);
+    for (int i = 0; i < sia->lazy_results.length; i += 1) {
+        SoundIoAlsaProbeCacheEntry *entry = &sia->lazy_results.at(i);
+        probe_cache_insert(sia, entry->device, entry->identity, false);
+    }
+    sia->lazy_results.clear();
+    soundio_os_mutex_unlock(sia->lazy_results_mutex);
+}
+
+// Forgets devices which were not found by the scan which just completed.
+static void probe_cache_prune(SoundIoAlsa *sia) {
+    for (int i = 0; i < sia->probe_cache.length;) {
+        SoundIoAlsaProbeCacheEntry *entry = &sia->probe_cache.at(i);
+        if (entry->seen) {
+            entry->seen = false;
+            i += 1;
+            continue;
+        }
+        soundio_device_unref(entry->device);
+        free(entry->identity);
+        sia->probe_cache.swap_remove(i);
+        sia->probe_cache_dirty = true;
+    }
+}
+
+// The capability cache file holds the probe cache between processes, so that
+// a cold start can publish devices without opening any of them. Each entry is
+// a whitespace separated list of fields, strings are written as
+// "<length>:<bytes>" and doubles as the hexadecimal bits of their value. Any
+// malformed entry discards the whole file.
+static const char *SOUNDIO_ALSA_CACHE_MAGIC = "libsoundio alsa capability cache 2\n";
+static const long SOUNDIO_ALSA_CACHE_MAX_SIZE = 4 * 1024 * 1024;
+static const int SOUNDIO_ALSA_CACHE_MAX_STR_LEN = 4096;
+
+struct SoundIoAlsaCacheReader {
+    const char *ptr;
+    const char *end;
+};
+
+static void probe_cache_clear(SoundIoAlsa *sia) {
+    for (int i = 0; i < sia->probe_cache.length; i += 1) {
+        SoundIoAlsaProbeCacheEntry *entry = &sia->probe_cache.at(i);
+        soundio_device_unref(entry->device);
+        free(entry->identity);
+    }
+    sia->probe_cache.clear();
+}
+
+// $XDG_CACHE_HOME/libsoundio/alsa-capabilities, or under ~/.cache if that is
+// not set to an absolute path.
+static char *get_capability_cache_path(void) {
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home && cache_home[0] == '/')
+        return soundio_alloc_sprintf(nullptr, "%s/libsoundio/alsa-capabilities", cache_home);
+    const char *home = getenv("HOME");
+    if (!home || !home[0])
+        return nullptr;
+    return soundio_alloc_sprintf(nullptr, "%s/.cache/libsoundio/alsa-capabilities", home);
+}
+
+static bool make_parent_dirs(const char *path) {
+    char *dir = strdup(path);
+    if (!dir)
+        return false;
+    for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0700) && errno != EEXIST) {
+            free(dir);
+            return false;
+        }
+        *slash = '/';
+    }
+    free(dir);
+    return true;
+}
+
+static void write_cache_str(FILE *f, const char *str) {
+    fprintf(f, " %d:%s", (int)strlen(str), str);
+}
+
+static void write_cache_double(FILE *f, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    fprintf(f, " %llx", (unsigned long long)bits);
+}
+
+static void write_cache_layout(FILE *f, const SoundIoChannelLayout *layout) {
+    fprintf(f, " %d", layout->channel_count);
+    for (int i = 0; i < layout->channel_count; i += 1)
+        fprintf(f, " %d", (int)layout->channels[i]);
+}
+
+// The cache only ever saves probing time, so failing to write it is ignored
+// and retried after the next scan.
+static void save_capability_cache(SoundIoAlsa *sia) {
+    const char *path = sia->capability_cache_path;
+    if (!make_parent_dirs(path))
+        return;
+    char *tmp_path = soundio_alloc_sprintf(nullptr, "%s.%d", path, (int)getpid());
+    if (!tmp_path)
+        return;
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    FILE *f = (fd >= 0) ? fdopen(fd, "w") : nullptr;
+    if (!f) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        return;
+    }
+
+    fputs(SOUNDIO_ALSA_CACHE_MAGIC, f);
+    for (int i = 0; i < sia->probe_cache.length; i += 1) {
+        SoundIoAlsaProbeCacheEntry *entry = &sia->probe_cache.at(i);
+        SoundIoDevice *device = entry->device;
+        fprintf(f, "%d %d", (int)device->aim, (int)device->is_raw);
+        write_cache_str(f, device->id);
+        write_cache_str(f, device->name);
+        write_cache_str(f, entry->identity);
+        fprintf(f, " %d %d %d", device->sample_rates[0].min, device->sample_rates[0].max,
+                device->sample_rate_current);
+        write_cache_double(f, device->software_latency_min);
+        write_cache_double(f, device->software_latency_max);
+        write_cache_double(f, device->software_latency_current);
+        fprintf(f, " %d %d", (int)device->current_format, device->format_count);
+        for (int format_i = 0; format_i < device->format_count; format_i += 1)
+            fprintf(f, " %d", (int)device->formats[format_i]);
+        fprintf(f, " %d", device->layout_count);
+        for (int layout_i = 0; layout_i < device->layout_count; layout_i += 1)
+            write_cache_layout(f, &device->layouts[layout_i]);
+        write_cache_layout(f, &device->current_layout);
+        fputc('\n', f);
+    }
+
+    bool ok = !ferror(f);
+    if (fclose(f))
+        ok = false;
+    if (ok && rename(tmp_path, path) == 0)
+        sia->probe_cache_dirty = false;
+    else
+        unlink(tmp_path);
+    free(tmp_path);
+}
+
+static bool read_cache_int(SoundIoAlsaCacheReader *r, long long min_value, long long max_value, int *out) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(r->ptr, &end, 10);
+    if (end == r->ptr || errno || value < min_value || value > max_value)
+        return false;
+    r->ptr = end;
+    *out = (int)value;
+    return true;
+}
+
+static bool read_cache_double(SoundIoAlsaCacheReader *r, double *out) {
+    char *end;
+    errno = 0;
+    unsigned long long bits = strtoull(r->ptr, &end, 16);
+    if (end == r->ptr || errno)
+        return false;
+    r->ptr = end;
+    uint64_t bits64 = bits;
+    memcpy(out, &bits64, sizeof(*out));
+    return true;
+}
+
+static char *read_cache_str(SoundIoAlsaCacheReader *r) {
+    int len;
+    if (!read_cache_int(r, 0, SOUNDIO_ALSA_CACHE_MAX_STR_LEN, &len))
+        return nullptr;
+    if (r->ptr >= r->end || *r->ptr != ':' || r->end - (r->ptr + 1) < len)
+        return nullptr;
+    char *str = allocate_nonzero<char>(len + 1);
+    if (!str)
+        return nullptr;
+    memcpy(str, r->ptr + 1, len);
+    str[len] = '\0';
+    r->ptr += 1 + len;
+    return str;
+}
+
+static bool read_cache_layout(SoundIoAlsaCacheReader *r, SoundIoChannelLayout *layout) {
+    if (!read_cache_int(r, 0, SOUNDIO_MAX_CHANNELS, &layout->channel_count))
+        return false;
+    for (int i = 0; i < layout->channel_count; i += 1) {
+        int channel_id;
+        if (!read_cache_int(r, SoundIoChannelIdInvalid, SoundIoChannelIdAux15, &channel_id))
+            return false;
+        layout->channels[i] = (SoundIoChannelId)channel_id;
+    }
+    soundio_channel_layout_detect_builtin(layout);
+    return true;
+}
+
+static bool read_cache_format(SoundIoAlsaCacheReader *r, SoundIoFormat *format) {
+    int value;
+    if (!read_cache_int(r, SoundIoFormatInvalid, SoundIoFormatS24PackedBE, &value))
+        return false;
+    *format = (SoundIoFormat)value;
+    return true;
+}
+
+// The caller owns whatever has been filled into entry, even on failure.
+static bool read_cache_entry(SoundIoPrivate *si, SoundIoAlsaCacheReader *r, SoundIoAlsaProbeCacheEntry *entry) {
+    entry->device = nullptr;
+    entry->identity = nullptr;
+    entry->seen = false;
+    entry->from_disk = true;
+
+    SoundIoDevicePrivate *dev = allocate<SoundIoDevicePrivate>(1);
+    if (!dev)
+        return false;
+    SoundIoDevice *device = &dev->pub;
+    dev->ref_count.store(1);
+    device->soundio = &si->pub;
+    device->sample_rate_count = 1;
+    device->sample_rates = &dev->prealloc_sample_rate_range;
+    entry->device = device;
+
+    int aim;
+    int is_raw;
+    if (!read_cache_int(r, SoundIoDeviceAimInput, SoundIoDeviceAimOutput, &aim) ||
+        !read_cache_int(r, 0, 1, &is_raw) ||
+        !(device->id = read_cache_str(r)) ||
+        !(device->name = read_cache_str(r)) ||
+        !(entry->identity = read_cache_str(r)) ||
+        !read_cache_int(r, 1, INT_MAX, &device->sample_rates[0].min) ||
+        !read_cache_int(r, device->sample_rates[0].min, INT_MAX, &device->sample_rates[0].max) ||
+        !read_cache_int(r, 0, INT_MAX, &device->sample_rate_current) ||
+        !read_cache_double(r, &device->software_latency_min) ||
+        !read_cache_double(r, &device->software_latency_max) ||
+        !read_cache_double(r, &device->software_latency_current) ||
+        !read_cache_format(r, &device->current_format) ||
+        !read_cache_int(r, 0, SoundIoFormatS24PackedBE, &device->format_count))
+    {
+        return false;
+    }
+    device->aim = (SoundIoDeviceAim)aim;
+    device->is_raw = is_raw;
+
+    if (!(device->formats = allocate_nonzero<SoundIoFormat>(max(device->format_count, 1))))
+        return false;
+    for (int i = 0; i < device->format_count; i += 1) {
+        if (!read_cache_format(r, &device->formats[i]))
+            return false;
+    }
+
+    if (!read_cache_int(r, 0, 256, &device->layout_count))
+        return false;
+    if (!(device->layouts = allocate_nonzero<SoundIoChannelLayout>(max(device->layout_count, 1))))
+        return false;
+    for (int i = 0; i < device->layout_count; i += 1) {
+        if (!read_cache_layout(r, &device->layouts[i]))
+            return false;
+    }
+    return read_cache_layout(r, &device->current_layout);
+}
+
+// Loaded entries are only trusted while their identity matches, and are
+// probed again in the background once the first scan has been published.
+static void load_capability_cache(SoundIoPrivate *si) {
+    SoundIoAlsa *sia = &si->backend_data.alsa;
+    FILE *f = fopen(sia->capability_cache_path, "re");
+    if (!f)
+        return;
+
+    char *buf = nullptr;
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0)
+        size = ftell(f);
+    if (size < 0 || size > SOUNDIO_ALSA_CACHE_MAX_SIZE || fseek(f, 0, SEEK_SET) ||
+        !(buf = allocate_nonzero<char>(size + 1)) || fread(buf, 1, size, f) != (size_t)size)
+    {
+        free(buf);
+        fclose(f);
+        return;
+    }
+    fclose(f);
+    buf[size] = '\0';
+
+    size_t magic_len = strlen(SOUNDIO_ALSA_CACHE_MAGIC);
+    if ((size_t)size < magic_len || memcmp(buf, SOUNDIO_ALSA_CACHE_MAGIC, magic_len) != 0) {
+        free(buf);
+        return;
+    }
+
+    SoundIoAlsaCacheReader r;
+    r.ptr = buf + magic_len;
+    r.end = buf + size;
+    for (;;) {
+        while (r.ptr < r.end && isspace((unsigned char)*r.ptr))
+            r.ptr += 1;
+        if (r.ptr >= r.end)
+            break;
+
+        SoundIoAlsaProbeCacheEntry entry;
+        if (!read_cache_entry(si, &r, &entry) || probe_cache_find(sia, entry.device) ||
+            sia->probe_cache.append(entry))
+        {
+            soundio_device_unref(entry.device);
+            free(entry.identity);
+            probe_cache_clear(sia);
+            break;
+        }
+    }
+    free(buf);
+    sia->probe_cache_dirty = false;
+}
+
+static int refresh_devices(SoundIoPrivate *si) {
+    SoundIo *soundio = &si->pub;
+    SoundIoAlsa *sia = &si->backend_data.alsa;
+
+    int err;
+    if ((err = snd_config_update_free_global()) < 0)
+        return SoundIoErrorSystemResources;
+    if ((err = snd_config_update()) < 0)
+        return SoundIoErrorSystemResources;
+
+    merge_lazy_results(sia);
+
+    RefreshDevices rd = {};
+
+    if (!(rd.devices_info = allocate<SoundIoDevicesInfo>(1)))
+        return SoundIoErrorNoMem;
+    rd.devices_info->default_output_index = -1;
+    rd.devices_info->default_input_index = -1;
+
+    if (!(rd.config_identity = get_config_identity())) {
+        deinit_refresh_devices(&rd);
+        return SoundIoErrorNoMem;
+    }
+
+    if ((err = get_cards(&rd))) {
+        deinit_refresh_devices(&rd);
+        return err;
+    }
+
+    if (snd_device_name_hint(-1, "pcm", &rd.hints) < 0) {
+        rd.hints = nullptr;
+        deinit_refresh_devices(&rd);
+        return SoundIoErrorNoMem;
+    }
+
+    for (void **hint_ptr = rd.hints; *hint_ptr; hint_ptr += 1) {
+        char *name = snd_device_name_get_hint(*hint_ptr, "NAME");
+        // null - libsoundio has its own dummy backend. API clients should use
+        // that instead of alsa null device.
+        if (strcmp(name, "null") == 0 ||
+            // sysdefault is confusing - the name and description is identical
+            // to default, and my best guess for what it does is ignore ~/.asoundrc
+            // which is just an accident waiting to happen.
+            str_has_prefix(name, "sysdefault:") ||
+            // all these surround devices are clutter
+            str_has_prefix(name, "front:") ||
+            str_has_prefix(name, "surround21:") ||
+            str_has_prefix(name, "surround40:") ||
+            str_has_prefix(name, "surround41:") ||
+            str_has_prefix(name, "surround50:") ||
+            str_has_prefix(name, "surround51:") ||
+            str_has_prefix(name, "surround71:"))
+        {
+            free(name);
+            continue;
+        }
+
+        const char *card_param = strstr(name, "CARD=");
+        int card_index = card_param ? card_index_from_id(&rd, card_param + strlen("CARD=")) : -1;
+        bool reusable = card_index >= 0 && !card_changed(sia, card_index);
+
+        char *descr = snd_device_name_get_hint(*hint_ptr, "DESC");
+        char *descr1 = str_partition_on_char(descr, '\n');
+
+        char *io = snd_device_name_get_hint(*hint_ptr, "IOID");
+        bool is_playback;
+        bool is_capture;
+        if (io) {
+            if (strcmp(io, "Input") == 0) {
+                is_playback = false;
+                is_capture = true;
+            } else {
+                assert(strcmp(io, "Output") == 0);
+                is_playback = true;
+                is_capture = false;
+            }
+            free(io);
+        } else {
+            is_playback = true;
+            is_capture = true;
+        }
+
+        for (int stream_type_i = 0; stream_type_i < array_length(stream_types); stream_type_i += 1) {
+            snd_pcm_stream_t stream = stream_types[stream_type_i];
+            if (stream == SND_PCM_STREAM_PLAYBACK && !is_playback) continue;
+            if (stream == SND_PCM_STREAM_CAPTURE && !is_capture) continue;
+            if (stream == SND_PCM_STREAM_CAPTURE && descr1 &&
+                (strstr(descr1, "Output") || strstr(descr1, "output")))
+            {
+                continue;
+            }
+
+            SoundIoDeviceAim aim;
+            SoundIoList<SoundIoDevice *> *device_list;
+            bool is_default = str_has_prefix(name, "default:") || strcmp(name, "default") == 0;
+            if (stream == SND_PCM_STREAM_PLAYBACK) {
+                aim = SoundIoDeviceAimOutput;
+                device_list = &rd.devices_info->output_devices;
+                if (rd.devices_info->default_output_index < 0 && is_default)
+                    rd.devices_info->default_output_index = device_list->length;
+            } else {
+                assert(stream == SND_PCM_STREAM_CAPTURE);
+                aim = SoundIoDeviceAimInput;
+                device_list = &rd.devices_info->input_devices;
+                if (rd.devices_info->default_input_index < 0 && is_default)
+                    rd.devices_info->default_input_index = device_list->length;
+            }
+
+            SoundIoDevice *last_device = reusable ? find_last_device(sia, name, aim) : nullptr;
+            if (last_device) {
+                if (device_list->append(last_device)) {
+                    free(name);
+                    free(descr);
+                    deinit_refresh_devices(&rd);
+                    return SoundIoErrorNoMem;
+                }
+                soundio_device_ref(last_device);
+                probe_cache_keep(sia, last_device);
+                continue;
+            }
+
+            SoundIoDevicePrivate *dev = allocate<SoundIoDevicePrivate>(1);
+            if (!dev) {
+                free(name);
+                free(descr);
+                deinit_refresh_devices(&rd);
+                return SoundIoErrorNoMem;
+            }
+            dev->backend_data.alsa.card_index = card_index;
+            SoundIoDevice *device = &dev->pub;
+            dev->ref_count.store(1);
+            device->soundio = soundio;
+            device->aim = aim;
+            device->is_raw = false;
+            device->id = strdup(name);
+            device->name = descr1 ?
+                soundio_alloc_sprintf(nullptr, "%s: %s", descr, descr1) : strdup(descr);
+
+            if (!device->id || !device->name) {
+                soundio_device_unref(device);
+                free(name);
+                free(descr);
+                deinit_refresh_devices(&rd);
+                return SoundIoErrorNoMem;
+            }
+
+            if (device_list->append(device)) {
+                soundio_device_unref(device);
+                free(name);
+                free(descr);
+                deinit_refresh_devices(&rd);
+                return SoundIoErrorNoMem;
+            }
+
+            char *identity = hint_identity(&rd, card_index);
+            if (!identity || (err = add_probe_job(sia, &rd, device, identity, -1, -1, stream))) {
+                free(name);
+                free(descr);
+                deinit_refresh_devices(&rd);
+                return SoundIoErrorNoMem;
+            }
+        }
+
+        free(name);
+        free(descr);
+    }
+
+    snd_device_name_free_hint(rd.hints);
+    rd.hints = nullptr;
+
+    snd_ctl_card_info_t *card_info;
+    snd_ctl_card_info_alloca(&card_info);
+
+    snd_pcm_info_t *pcm_info;
+    snd_pcm_info_alloca(&pcm_info);
+
+    for (int card_i = 0; card_i < rd.cards.length; card_i += 1) {
+        int card_index = rd.cards.at(card_i).index;
+        if (!card_changed(sia, card_index)) {
+            if ((err = reuse_card_devices(sia, &rd, card_index))) {
+                deinit_refresh_devices(&rd);
+                return err;
+            }
+            continue;
+        }
+
+        snd_ctl_t *handle;
+        char name[32];
+        sprintf(name, "hw:%d", card_index);
+        if ((err = snd_ctl_open(&handle, name, 0)) < 0) {
+            if (err == -ENOENT) {
+                break;
+            } else {
+                deinit_refresh_devices(&rd);
+                return SoundIoErrorOpeningDevice;
+            }
+        }
+
+        if ((err = snd_ctl_card_info(handle, card_info)) < 0) {
+            snd_ctl_close(handle);
+            deinit_refresh_devices(&rd);
+            return SoundIoErrorSystemResources;
+        }
+        const char *card_name = snd_ctl_card_info_get_name(card_info);
+
+        int device_index = -1;
+        for (;;) {
+            if (snd_ctl_pcm_next_device(handle, &device_index) < 0) {
+                snd_ctl_close(handle);
+                deinit_refresh_devices(&rd);
+                return SoundIoErrorSystemResources;
+            }
+            if (device_index < 0)
+                break;
+
+            snd_pcm_info_set_device(pcm_info, device_index);
+            snd_pcm_info_set_subdevice(pcm_info, 0);
+
+            for (int stream_type_i = 0; stream_type_i < array_length(stream_types); stream_type_i += 1) {
+                snd_pcm_stream_t stream = stream_types[stream_type_i];
+                snd_pcm_info_set_stream(pcm_info, stream);
+
+                if ((err = snd_ctl_pcm_info(handle, pcm_info)) < 0) {
+                    if (err == -ENOENT) {
+                        continue;
+                    } else {
+                        snd_ctl_close(handle);
+                        deinit_refresh_devices(&rd);
+                        return SoundIoErrorSystemResources;
+                    }
+                }
+
+                const char *device_name = snd_pcm_info_get_name(pcm_info);
+
+                SoundIoDevicePrivate *dev = allocate<SoundIoDevicePrivate>(1);
+                if (!dev) {
+                    snd_ctl_close(handle);
+                    deinit_refresh_devices(&rd);
+                    return SoundIoErrorNoMem;
+                }
+                dev->backend_data.alsa.card_index = card_index;
+                SoundIoDevice *device = &dev->pub;
+                dev->ref_count.store(1);
+                device->soundio = soundio;
+                device->id = soundio_alloc_sprintf(nullptr, "hw:%d,%d", card_index, device_index);
+                device->name = soundio_alloc_sprintf(nullptr, "%s %s", card_name, device_name);
+                device->is_raw = true;
+
+                if (!device->id || !device->name) {
+                    soundio_device_unref(device);
+                    snd_ctl_close(handle);
+                    deinit_refresh_devices(&rd);
+                    return SoundIoErrorNoMem;
+                }
+
+                SoundIoList<SoundIoDevice *> *device_list;
+                if (stream == SND_PCM_STREAM_PLAYBACK) {
+                    device->aim = SoundIoDeviceAimOutput;
+                    device_list = &rd.devices_info->output_devices;
+                } else {
+                    assert(stream == SND_PCM_STREAM_CAPTURE);
+                    device->aim = SoundIoDeviceAimInput;
+                    device_list = &rd.devices_info->input_devices;
+                }
+
+                if (device_list->append(device)) {
+                    soundio_device_unref(device);
+                    snd_ctl_close(handle);
+                    deinit_refresh_devices(&rd);
+                    return SoundIoErrorNoMem;
+                }
+
+                char *identity = hw_identity(&rd, card_index);
+                if ((err = add_probe_job(sia, &rd, device, identity, card_index, device_index, stream))) {
+                    snd_ctl_close(handle);
+                    deinit_refresh_devices(&rd);
+                    return err;
+                }
+            }
+        }
+        snd_ctl_close(handle);
+    }
+
+    run_probe_jobs(&rd.jobs);
+
+    for (int i = 0; i < rd.jobs.length; i += 1) {
+        SoundIoAlsaProbeJob *job = &rd.jobs.at(i);
+        if (!job->identity || job->device->probe_error)
+            continue;
+        if ((err = probe_cache_store(si, job))) {
+            deinit_refresh_devices(&rd);
+            return err;
+        }
+    }
+    probe_cache_prune(sia);
+
+    if ((err = remember_devices(sia, rd.devices_info))) {
+        deinit_refresh_devices(&rd);
+        return err;
+    }
+    sia->rescan_all = false;
+    sia->changed_cards.clear();
+
+    // the audio threads take the mutex to wake up the event loop, so the
+    // old list is freed outside of it
+    soundio_os_mutex_lock(sia->mutex);
+    SoundIoDevicesInfo *old_devices_info = sia->ready_devices_info;
+    sia->ready_devices_info = rd.devices_info;
+    sia->have_devices_flag = true;
+    soundio_os_cond_signal(sia->cond, sia->mutex);
+    soundio_signal_events(si);
+    soundio_os_mutex_unlock(sia->mutex);
+
+    soundio_destroy_devices_info(old_devices_info);
+    rd.devices_info = nullptr;
+    deinit_refresh_devices(&rd);
+    return 0;
+}
+
+static bool same_probe_result(const SoundIoDevice *a, const SoundIoDevice *b) {
+    if (a->sample_rates[0].min != b->sample_rates[0].min ||
+        a->sample_rates[0].max != b->sample_rates[0].max ||
+        a->sample_rate_current != b->sample_rate_current ||
+        a->software_latency_min != b->software_latency_min ||
+        a->software_latency_max != b->software_latency_max ||
+        a->software_latency_current != b->software_latency_current ||
+        a->current_format != b->current_format ||
+        a->format_count != b->format_count ||
+        a->layout_count != b->layout_count ||
+        !soundio_channel_layout_equal(&a->current_layout, &b->current_layout))
+    {
+        return false;
+    }
+    if (memcmp(a->formats, b->formats, a->format_count * sizeof(SoundIoFormat)) != 0)
+        return false;
+    for (int i = 0; i < a->layout_count; i += 1) {
+        if (!soundio_channel_layout_equal(&a->layouts[i], &b->layouts[i]))
+            return false;
+    }
+    return true;
+}
+
+// Probes the devices which were published with capabilities from the cache
+// file, and scans again if any of them turned out to be different. Devices
+// which cannot be probed right now stay as cached until a later scan.
+static int verify_capability_cache(SoundIoPrivate *si) {
+    SoundIoAlsa *sia = &si->backend_data.alsa;
+    SoundIoList<SoundIoAlsaProbeJob> jobs = {};
+    int err = 0;
+
+    for (int i = 0; i < sia->probe_cache.length; i += 1) {
+        SoundIoAlsaProbeCacheEntry *entry = &sia->probe_cache.at(i);
+        if (!entry->from_disk)
+            continue;
+        SoundIoDevice *cached = entry->device;
+
+        SoundIoDevicePrivate *dev = allocate<SoundIoDevicePrivate>(1);
+        if (!dev || (err = jobs.add_one())) {
+            free(dev);
+            err = SoundIoErrorNoMem;
+            break;
+        }
+        SoundIoDevice *device = &dev->pub;
+        dev->ref_count.store(1);
+        device->soundio = &si->pub;
+        device->aim = cached->aim;
+        device->is_raw = cached->is_raw;
+        device->id = strdup(cached->id);
+        device->name = strdup(cached->name);
+
+        SoundIoAlsaProbeJob *job = &jobs.last();
+        job->device = device;
+        job->identity = nullptr;
+        job->maps = nullptr;
+        if (!device->id || !device->name) {
+            err = SoundIoErrorNoMem;
+            break;
+        }
+        job->maps = query_raw_chmaps(device);
+    }
+
+    bool changed = false;
+    if (!err) {
+        run_probe_jobs(&jobs);
+
+        for (int i = 0; i < jobs.length; i += 1) {
+            SoundIoAlsaProbeJob *job = &jobs.at(i);
+            SoundIoDevice *probed = job->device;
+            SoundIoAlsaProbeCacheEntry *entry = probe_cache_find(sia, probed);
+            // Most often the device is busy because the application already
+            // has it open, so keep the cached result and try again at the
+            // next scan.
+            if (probed->probe_error)
+                continue;
+            entry->from_disk = false;
+            if (same_probe_result(entry->device, probed))
+                continue;
+            changed = true;
+            soundio_device_unref(entry->device);
+            entry->device = probed;
+            job->device = nullptr;
+        }
+    }
+
+    for (int i = 0; i < jobs.length; i += 1) {
+        SoundIoAlsaProbeJob *job = &jobs.at(i);
+        soundio_device_unref(job->device);
+        if (job->maps)
+            snd_pcm_free_chmaps(job->maps);
+    }
+    jobs.deinit();
+
+    if (err)
+        return err;
+    if (!changed)
+        return 0;
+    sia->probe_cache_dirty = true;
+    sia->rescan_all = true;
+    return refresh_devices(si);
+}
+
+static void shutdown_backend(SoundIoPrivate *si, int err) {
+    SoundIoAlsa *sia = &si->backend_data.alsa;
+    soundio_os_mutex_lock(sia->mutex);
+    sia->shutdown_err = err;
+    soundio_os_cond_signal(sia->cond, sia->mutex);
+    soundio_signal_events(si);
+    soundio_os_mutex_unlock(sia->mutex);
+}
+
+static bool copy_str(char *dest, const char *src, int buf_len) {
+    for (;;) {
+        buf_len -= 1;
+        if (buf_len <= 0)
+            return false;
+        *dest = *src;
+        dest += 1;
+        src += 1;
+        if (!*src)
+            break;
+    }
+    *dest = '\0';
+    return true;
+}
+
+static int mark_card_changed(SoundIoAlsa *sia, int card_index) {
+    for (int i = 0; i < sia->changed_cards.length; i += 1) {
+        if (sia->changed_cards.at(i) == card_index)
+            return 0;
+    }
+    return sia->changed_cards.append(card_index) ? SoundIoErrorNoMem : 0;
+}
+
+static void device_thread_run(void *arg) {
+    SoundIoPrivate *si = (SoundIoPrivate *)arg;
     SoundIoAlsa *sia = &si->backend_data.alsa;
 
     // Some systems cannot read integer variables if they are not
@@ -800,6 +1852,10 @@ static void device_thread_run(void *arg) {
                     if (strncmp(event->name, "controlC", 8) != 0) {
                         continue;
                     }
+                    if ((err = mark_card_changed(sia, atoi(event->name + 8)))) {
+                        shutdown_backend(si, err);
+                        return;
+                    }
                     if (event->mask & IN_CREATE) {
                         if ((err = sia->pending_files.add_one())) {
                             shutdown_backend(si, SoundIoErrorNoMem);
@@ -836,6 +1892,7 @@ static void device_thread_run(void *arg) {
         }
         if (fds[1].revents & POLLIN) {
             got_rescan_event = true;
+            sia->rescan_all = true;
             for (;;) {
                 ssize_t len = read(sia->notify_pipe_fd[0], buf, sizeof(buf));
                 if (len == -1) {
@@ -856,10 +1913,12 @@ static void device_thread_run(void *arg) {
             }
         }
         if (got_rescan_event) {
-            if ((err = refresh_devices(si))) {
+            if ((err = refresh_devices(si)) || (err = verify_capability_cache(si))) {
                 shutdown_backend(si, err);
                 return;
             }
+            if (sia->capability_cache_path && sia->probe_cache_dirty)
+                save_capability_cache(sia);
         }
     }
 }
@@ -909,168 +1968,522 @@ static void wait_events_alsa(SoundIoPrivate *si) {
     my_flush_events(si, true);
 }
 
-static void wakeup_alsa(SoundIoPrivate *si) {
-    SoundIoAlsa *sia = &si->backend_data.alsa;
-    soundio_os_mutex_lock(sia->mutex);
-    soundio_os_cond_signal(sia->cond, sia->mutex);
-    soundio_os_mutex_unlock(sia->mutex);
+static void wakeup_alsa(SoundIoPrivate *si) {
+    SoundIoAlsa *sia = &si->backend_data.alsa;
+    soundio_os_mutex_lock(sia->mutex);
+    soundio_os_cond_signal(sia->cond, sia->mutex);
+    soundio_os_mutex_unlock(sia->mutex);
+}
+
+static void force_device_scan_alsa(SoundIoPrivate *si) {
+    SoundIoAlsa *sia = &si->backend_data.alsa;
+    wakeup_device_poll(sia);
+}
+
+static void outstream_arm_timer(SoundIoOutStreamAlsa *osa, double seconds) {
+    // a zero it_value would disarm the timer
+    seconds = max(seconds, 0.000001);
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)seconds;
+    its.it_value.tv_nsec = (long)((seconds - (double)its.it_value.tv_sec) * 1000000000.0);
+    timerfd_settime(osa->timer_fd, 0, &its, nullptr);
+}
+
+// Audio left queued by clear_buffer, which the hardware may already have
+// fetched and so cannot be rewound safely.
+static const double SOUNDIO_ALSA_REWIND_MARGIN_TIME = 0.0015;
+
+// Timer-based scheduling keeps fill_target frames buffered and sleeps until
+// only tsched_watermark frames are left.
+static const double SOUNDIO_ALSA_TSCHED_BUFFER_TIME = 2.0;
+static const double SOUNDIO_ALSA_TSCHED_WATERMARK_TIME = 0.020;
+static const double SOUNDIO_ALSA_TSCHED_WATERMARK_MIN_TIME = 0.001;
+// on time wakeups in a row before the watermark and target are lowered again
+static const int SOUNDIO_ALSA_TSCHED_RELAX_WAKEUPS = 64;
+
+// Adaptive latency opens a buffer this many times the requested latency.
+// This many underflows within the window raise the fill target by half, and
+// each stable period without underflows takes half of the excess away again.
+static const int SOUNDIO_ALSA_ADAPTIVE_BUFFER_FACTOR = 4;
+static const int SOUNDIO_ALSA_ADAPTIVE_GROW_XRUNS = 2;
+static const double SOUNDIO_ALSA_ADAPTIVE_WINDOW_TIME = 10.0;
+static const double SOUNDIO_ALSA_ADAPTIVE_STABLE_TIME = 30.0;
+
+static int set_start_threshold(snd_pcm_t *handle, snd_pcm_uframes_t frames) {
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_sw_params_alloca(&swparams);
+    int err;
+    if ((err = snd_pcm_sw_params_current(handle, swparams)) < 0)
+        return err;
+    if ((err = snd_pcm_sw_params_set_start_threshold(handle, swparams, frames)) < 0)
+        return err;
+    return snd_pcm_sw_params(handle, swparams);
+}
+
+static int set_avail_min(snd_pcm_t *handle, snd_pcm_uframes_t frames) {
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_sw_params_alloca(&swparams);
+    int err;
+    if ((err = snd_pcm_sw_params_current(handle, swparams)) < 0)
+        return err;
+    if ((err = snd_pcm_sw_params_set_avail_min(handle, swparams, frames)) < 0)
+        return err;
+    return snd_pcm_sw_params(handle, swparams);
+}
+
+// Without tsched the stream wakes up when a period more than the fill
+// target's complement of the buffer is writable.
+static snd_pcm_uframes_t fill_avail_min(SoundIoOutStreamAlsa *osa) {
+    return min(osa->buffer_size_frames - osa->fill_target + osa->period_size, osa->buffer_size_frames);
+}
+
+static void outstream_set_fill_target(SoundIoOutStreamPrivate *os, snd_pcm_uframes_t frames) {
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    if (frames == osa->fill_target)
+        return;
+    if (frames > osa->fill_target)
+        os->xruns.grow_count += 1;
+    else
+        os->xruns.shrink_count += 1;
+    osa->fill_target = frames;
+    os->xruns.fill_frames.store(frames);
+    os->watchdog.buffer_frames = frames;
+    if (osa->tsched)
+        return;
+    set_avail_min(osa->handle, fill_avail_min(osa));
+}
+
+static void adaptive_underflow(SoundIoOutStreamPrivate *os) {
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    double now = soundio_os_get_time();
+    osa->adaptive_stable_since = now;
+    if (now - osa->adaptive_window_start > SOUNDIO_ALSA_ADAPTIVE_WINDOW_TIME) {
+        osa->adaptive_window_start = now;
+        osa->adaptive_window_xruns = 0;
+    }
+    osa->adaptive_window_xruns += 1;
+    if (osa->adaptive_window_xruns < SOUNDIO_ALSA_ADAPTIVE_GROW_XRUNS)
+        return;
+    osa->adaptive_window_xruns = 0;
+    outstream_set_fill_target(os, min(osa->fill_target + osa->fill_target / 2, osa->buffer_size_frames));
+}
+
+static void adaptive_relax(SoundIoOutStreamPrivate *os) {
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    if (osa->fill_target == osa->fill_target_min)
+        return;
+    double now = soundio_os_get_time();
+    if (now - osa->adaptive_stable_since < SOUNDIO_ALSA_ADAPTIVE_STABLE_TIME)
+        return;
+    osa->adaptive_stable_since = now;
+    outstream_set_fill_target(os, osa->fill_target - (osa->fill_target - osa->fill_target_min + 1) / 2);
+}
+
+// Woke up too late or ran dry. Leave a bigger margin at each wakeup, and once
+// the margin is half of what is kept buffered, buffer more.
+static void tsched_raise(SoundIoOutStreamPrivate *os) {
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    osa->tsched_on_time_count = 0;
+    if (osa->tsched_watermark < osa->fill_target / 2) {
+        osa->tsched_watermark = min(osa->tsched_watermark * 2, osa->fill_target / 2);
+    } else {
+        outstream_set_fill_target(os, min(osa->fill_target + osa->fill_target / 2, osa->buffer_size_frames));
+        osa->tsched_watermark = osa->fill_target / 2;
+    }
+}
+
+static void tsched_adapt(SoundIoOutStreamPrivate *os, snd_pcm_sframes_t queued) {
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    if (queued < (snd_pcm_sframes_t)(osa->tsched_watermark / 2)) {
+        tsched_raise(os);
+        return;
+    }
+    osa->tsched_on_time_count += 1;
+    if (osa->tsched_on_time_count < SOUNDIO_ALSA_TSCHED_RELAX_WAKEUPS)
+        return;
+    osa->tsched_on_time_count = 0;
+    osa->tsched_watermark = max(osa->tsched_watermark - osa->tsched_watermark / 8, osa->tsched_watermark_min);
+    outstream_set_fill_target(os, osa->fill_target - (osa->fill_target - osa->fill_target_min) / 8);
+    osa->tsched_watermark = min(osa->tsched_watermark, osa->fill_target / 2);
+}
+
+// Gets the writable frames and an estimate of the frames still queued, and
+// whether the stream is paused, from a single status snapshot. The hardware
+// pointer only moves when the driver updates it, so the time since that
+// update, as told by the snapshot's timestamp, is accounted for as well.
+// `out_time` receives the monotonic time of the estimate. Fails with the
+// error snd_pcm_avail would return when the stream is not running.
+static int tsched_query(SoundIoOutStreamPrivate *os, snd_pcm_sframes_t *out_avail,
+        snd_pcm_sframes_t *out_queued, bool *out_paused, double *out_time)
+{
+    SoundIoOutStream *outstream = &os->pub;
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+
+    snd_pcm_status_t *status;
+    snd_pcm_status_alloca(&status);
+    int err;
+    if ((err = snd_pcm_status(osa->handle, status)) < 0)
+        return err;
+    *out_time = soundio_os_get_time();
+
+    snd_pcm_state_t state = snd_pcm_status_get_state(status);
+    switch (state) {
+        case SND_PCM_STATE_XRUN:
+            return -EPIPE;
+        case SND_PCM_STATE_SUSPENDED:
+            return -ESTRPIPE;
+        case SND_PCM_STATE_DISCONNECTED:
+            return -ENODEV;
+        default:
+            break;
+    }
+    *out_paused = (state == SND_PCM_STATE_PAUSED);
+
+    snd_pcm_sframes_t avail = snd_pcm_status_get_avail(status);
+    *out_avail = avail;
+
+    snd_pcm_sframes_t played = avail;
+    snd_htimestamp_t tstamp;
+    snd_pcm_status_get_htstamp(status, &tstamp);
+    if (state == SND_PCM_STATE_RUNNING && (tstamp.tv_sec || tstamp.tv_nsec)) {
+        struct timespec now;
+        clock_gettime(osa->tstamp_clock, &now);
+        double elapsed = (double)(now.tv_sec - tstamp.tv_sec) +
+            (double)(now.tv_nsec - tstamp.tv_nsec) / 1000000000.0;
+        // ignore clock jumps
+        if (elapsed > 0.0 && elapsed < SOUNDIO_ALSA_TSCHED_WATERMARK_TIME)
+            played = avail + (snd_pcm_sframes_t)(elapsed * outstream->sample_rate);
+    }
+    *out_queued = max((snd_pcm_sframes_t)osa->buffer_size_frames - played, (snd_pcm_sframes_t)0);
+    return 0;
+}
+
+// Sleeps until the queued audio is down to the watermark. `queued` is an
+// estimate made at `time`.
+static void tsched_sleep(SoundIoOutStreamPrivate *os, snd_pcm_sframes_t queued, double time) {
+    SoundIoOutStream *outstream = &os->pub;
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    snd_pcm_sframes_t sleep_frames = queued - (snd_pcm_sframes_t)osa->tsched_watermark;
+    double seconds = sleep_frames / (double)outstream->sample_rate - (soundio_os_get_time() - time);
+    outstream_arm_timer(osa, max(seconds, SOUNDIO_ALSA_TSCHED_WATERMARK_MIN_TIME));
 }
 
-static void force_device_scan_alsa(SoundIoPrivate *si) {
-    SoundIoAlsa *sia = &si->backend_data.alsa;
-    wakeup_device_poll(sia);
+static int tsched_schedule(SoundIoOutStreamPrivate *os) {
+    snd_pcm_sframes_t avail;
+    snd_pcm_sframes_t queued;
+    bool paused;
+    double time;
+    int err;
+    if ((err = tsched_query(os, &avail, &queued, &paused, &time)) < 0)
+        return err;
+    tsched_sleep(os, queued, time);
+    return 0;
 }
 
+static void engine_remove_stream(SoundIoAlsaEngineStream *es);
+
 static void outstream_destroy_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
     SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
 
+    engine_remove_stream(&osa->engine_stream);
+
     if (osa->thread) {
         osa->thread_exit_flag.clear();
+        outstream_arm_timer(osa, 0.0);
         soundio_os_thread_destroy(osa->thread);
+        osa->thread = nullptr;
     }
 
+    // open calls this on failure and soundio_outstream_destroy calls it again
     if (osa->handle)
         snd_pcm_close(osa->handle);
+    osa->handle = nullptr;
+    if (osa->timer_fd >= 0)
+        close(osa->timer_fd);
+    osa->timer_fd = -1;
 
     free(osa->poll_fds);
+    osa->poll_fds = nullptr;
     free(osa->chmap);
+    osa->chmap = nullptr;
     free(osa->sample_buffer);
+    osa->sample_buffer = nullptr;
+}
+
+// Resumes a suspended stream where it stopped if the driver can, or else
+// prepares it to start over. snd_pcm_prepare sleeps in the kernel until the
+// device has power again, so there is no need to retry on -EAGAIN.
+static int pcm_resume(snd_pcm_t *handle) {
+    int err = snd_pcm_resume(handle);
+    if (err < 0)
+        err = snd_pcm_prepare(handle);
+    return err;
 }
 
 static int outstream_xrun_recovery(SoundIoOutStreamPrivate *os, int err) {
-    SoundIoOutStream *outstream = &os->pub;
     SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
     if (err == -EPIPE) {
+        if (osa->tsched)
+            tsched_raise(os);
+        else if (osa->adaptive)
+            adaptive_underflow(os);
         err = snd_pcm_prepare(osa->handle);
-        if (err >= 0)
-            outstream->underflow_callback(outstream);
     } else if (err == -ESTRPIPE) {
-        while ((err = snd_pcm_resume(osa->handle)) == -EAGAIN) {
-            // wait until suspend flag is released
-            poll(nullptr, 0, 1);
-        }
-        if (err < 0)
-            err = snd_pcm_prepare(osa->handle);
-        if (err >= 0)
-            outstream->underflow_callback(outstream);
+        err = pcm_resume(osa->handle);
+    } else {
+        return err;
     }
-    return err;
+    if (err < 0)
+        return err;
+    // Restart with some silence ahead of the callback's audio, so that the
+    // buffer is back at the fill target without the callback which just ran
+    // late having to produce all of it.
+    if (snd_pcm_state(osa->handle) == SND_PCM_STATE_PREPARED)
+        osa->preroll_frames = osa->tsched ? osa->tsched_watermark : osa->period_size;
+    soundio_outstream_run_underflow_callback(os);
+    return 0;
 }
 
 static int instream_xrun_recovery(SoundIoInStreamPrivate *is, int err) {
-    SoundIoInStream *instream = &is->pub;
     SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
-    if (err == -EPIPE) {
+    if (err == -EPIPE)
         err = snd_pcm_prepare(isa->handle);
-        if (err >= 0)
-            instream->overflow_callback(instream);
-    } else if (err == -ESTRPIPE) {
-        while ((err = snd_pcm_resume(isa->handle)) == -EAGAIN) {
-            // wait until suspend flag is released
-            poll(nullptr, 0, 1);
-        }
-        if (err < 0)
-            err = snd_pcm_prepare(isa->handle);
-        if (err >= 0)
-            instream->overflow_callback(instream);
-    }
-    return err;
+    else if (err == -ESTRPIPE)
+        err = pcm_resume(isa->handle);
+    else
+        return err;
+    if (err < 0)
+        return err;
+    soundio_instream_run_overflow_callback(is);
+    return 0;
+}
+
+// Discards the queued audio, except for a margin which the hardware may
+// already have fetched, without stopping the stream. Returns false when the
+// device cannot rewind, in which case the buffer has to be dropped.
+static bool outstream_rewind(SoundIoOutStreamPrivate *os) {
+    SoundIoOutStream *outstream = &os->pub;
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+
+    snd_pcm_sframes_t avail = snd_pcm_avail(osa->handle);
+    if (avail < 0)
+        return false;
+    snd_pcm_sframes_t margin = ceil_dbl_to_uframes(SOUNDIO_ALSA_REWIND_MARGIN_TIME * outstream->sample_rate);
+    if ((snd_pcm_sframes_t)osa->buffer_size_frames - avail <= margin)
+        return true;
+
+    snd_pcm_sframes_t rewindable = snd_pcm_rewindable(osa->handle);
+    if (rewindable <= 0)
+        return false;
+    if (rewindable <= margin)
+        return true;
+
+    snd_pcm_sframes_t rewound = snd_pcm_rewind(osa->handle, rewindable - margin);
+    if (rewound < 0)
+        return false;
+    osa->frames_written -= rewound;
+    return true;
 }
 
-static int outstream_wait_for_poll(SoundIoOutStreamPrivate *os) {
+// Returns 1 when the stream is ready, 0 when `timeout` milliseconds passed
+// without the stream becoming ready, or a negative error code.
+static int outstream_wait_for_poll(SoundIoOutStreamPrivate *os, int timeout) {
     SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
     int err;
     unsigned short revents;
     for (;;) {
-        if ((err = poll(osa->poll_fds, osa->poll_fd_count, -1)) < 0) {
+        if ((err = poll(osa->poll_fds, osa->poll_fd_count + 1, timeout)) < 0) {
             return err;
         }
+        if (err == 0)
+            return 0;
+        if (osa->poll_fds[osa->poll_fd_count].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(osa->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                return -errno;
+            return 1;
+        }
         if ((err = snd_pcm_poll_descriptors_revents(osa->handle,
                         osa->poll_fds, osa->poll_fd_count, &revents)) < 0)
         {
             return err;
         }
         if (revents & (POLLERR|POLLNVAL|POLLHUP)) {
-            return 0;
+            return 1;
         }
         if (revents & POLLOUT)
+            return 1;
+        if (timeout == 0)
             return 0;
     }
 }
 
-static int instream_wait_for_poll(SoundIoInStreamPrivate *is) {
+// Returns 1 when the stream is ready, 0 when `timeout` milliseconds passed
+// without the stream becoming ready, or a negative error code.
+static int instream_wait_for_poll(SoundIoInStreamPrivate *is, int timeout) {
     SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
     int err;
     unsigned short revents;
     for (;;) {
-        if ((err = poll(isa->poll_fds, isa->poll_fd_count, -1)) < 0) {
+        if ((err = poll(isa->poll_fds, isa->poll_fd_count, timeout)) < 0) {
             return err;
         }
+        if (err == 0)
+            return 0;
         if ((err = snd_pcm_poll_descriptors_revents(isa->handle,
                         isa->poll_fds, isa->poll_fd_count, &revents)) < 0)
         {
             return err;
         }
         if (revents & (POLLERR|POLLNVAL|POLLHUP)) {
-            return 0;
+            return 1;
         }
         if (revents & POLLIN)
+            return 1;
+        if (timeout == 0)
             return 0;
     }
 }
 
-static void outstream_thread_run(void *arg) {
-    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *) arg;
+static int outstream_write_silence(SoundIoOutStreamPrivate *os, snd_pcm_uframes_t frames);
+
+// Starts draining if soundio_outstream_drain has been called. Returns
+// whether the stream is draining.
+static bool outstream_check_drain(SoundIoOutStreamAlsa *osa) {
+    if (!osa->draining && !osa->drain_flag.test_and_set()) {
+        osa->draining = true;
+        osa->drain_padding = 0;
+        // from now on the device only wakes us for errors
+        set_avail_min(osa->handle, osa->buffer_size_frames);
+    }
+    return osa->draining;
+}
+
+// Waits for the audio written before the drain to be played, keeping a
+// period of silence queued behind it so that the device does not play stale
+// buffer contents before the stream is stopped. Returns 1 once everything
+// has been played, 0 to wait for the timer, or a negative error code.
+static int outstream_drain_step(SoundIoOutStreamPrivate *os) {
+    SoundIoOutStream *outstream = &os->pub;
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+
+    snd_pcm_sframes_t delay;
+    int err;
+    if ((err = snd_pcm_delay(osa->handle, &delay)) < 0) {
+        // ran dry, which means it has all been played
+        return (err == -EPIPE) ? 1 : err;
+    }
+    if (delay <= (snd_pcm_sframes_t)osa->drain_padding)
+        return 1;
+
+    snd_pcm_sframes_t room = (snd_pcm_sframes_t)osa->buffer_size_frames - delay;
+    snd_pcm_sframes_t frames = min((snd_pcm_sframes_t)osa->period_size - (snd_pcm_sframes_t)osa->drain_padding, room);
+    if (frames > 0) {
+        if ((err = outstream_write_silence(os, frames)))
+            return (err == SoundIoErrorUnderflow) ? 1 : -EIO;
+        osa->drain_padding += frames;
+    }
+
+    outstream_arm_timer(osa, (delay - (snd_pcm_sframes_t)osa->drain_padding) / (double)outstream->sample_rate);
+    return 0;
+}
+
+// Runs the stream state machine until it has to wait for its poll
+// descriptors. `polled` tells whether they have just become ready.
+// Returns false when the stream is done, in which case the error callback
+// has already been called if necessary.
+//
+// The stream only waits while it is running or paused, so a wakeup costs a
+// single query of the device: snd_pcm_avail_update, or snd_pcm_status with
+// tsched, whose error tells when the stream has stopped. The state itself is
+// only read on entry without a wakeup and after leaving the running state.
+static bool outstream_service(SoundIoOutStreamPrivate *os, bool polled) {
     SoundIoOutStream *outstream = &os->pub;
     SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
 
     int err;
 
+    snd_pcm_state_t state = polled ? SND_PCM_STATE_RUNNING : snd_pcm_state(osa->handle);
     for (;;) {
-        snd_pcm_state_t state = snd_pcm_state(osa->handle);
         switch (state) {
             case SND_PCM_STATE_SETUP:
             {
                 if ((err = snd_pcm_prepare(osa->handle)) < 0) {
                     outstream->error_callback(outstream, SoundIoErrorStreaming);
-                    return;
+                    return false;
                 }
+                state = SND_PCM_STATE_PREPARED;
                 continue;
             }
             case SND_PCM_STATE_PREPARED:
             {
+                if (osa->draining) {
+                    // the buffer was cleared while draining
+                    soundio_outstream_report_drained(os);
+                    return false;
+                }
+
                 snd_pcm_sframes_t avail = snd_pcm_avail(osa->handle);
                 if (avail < 0) {
                     outstream->error_callback(outstream, SoundIoErrorStreaming);
-                    return;
+                    return false;
                 }
 
                 if ((snd_pcm_uframes_t)avail == osa->buffer_size_frames) {
-                    outstream->write_callback(outstream, 0, avail);
+                    snd_pcm_sframes_t frame_count = min(avail, (snd_pcm_sframes_t)osa->fill_target);
+                    if (osa->preroll_frames > 0) {
+                        snd_pcm_sframes_t preroll = min((snd_pcm_sframes_t)osa->preroll_frames, frame_count / 2);
+                        osa->preroll_frames = 0;
+                        if ((err = outstream_write_silence(os, preroll))) {
+                            outstream->error_callback(outstream, SoundIoErrorStreaming);
+                            return false;
+                        }
+                        frame_count -= preroll;
+                    }
+                    soundio_outstream_run_write_callback(os, 0, frame_count);
+                    // writing may have started the stream
+                    state = snd_pcm_state(osa->handle);
                     continue;
                 }
 
                 if ((err = snd_pcm_start(osa->handle)) < 0) {
                     outstream->error_callback(outstream, SoundIoErrorStreaming);
-                    return;
+                    return false;
                 }
+                state = SND_PCM_STATE_RUNNING;
                 continue;
             }
             case SND_PCM_STATE_RUNNING:
             case SND_PCM_STATE_PAUSED:
             {
-                if ((err = outstream_wait_for_poll(os)) < 0) {
-                    if (!osa->thread_exit_flag.test_and_set())
-                        return;
-                    outstream->error_callback(outstream, SoundIoErrorStreaming);
-                    return;
+                if (!polled) {
+                    if (osa->tsched && (err = tsched_schedule(os)) < 0) {
+                        if ((err = outstream_xrun_recovery(os, err)) < 0) {
+                            outstream->error_callback(outstream, SoundIoErrorStreaming);
+                            return false;
+                        }
+                        state = snd_pcm_state(osa->handle);
+                        continue;
+                    }
+                    return true;
                 }
+                polled = false;
+
                 if (!osa->thread_exit_flag.test_and_set())
-                    return;
+                    return false;
                 if (!osa->clear_buffer_flag.test_and_set()) {
+                    if (outstream_rewind(os)) {
+                        // refill right away instead of waiting for a period
+                        polled = true;
+                        continue;
+                    }
+                    snd_pcm_sframes_t delay;
+                    if (snd_pcm_delay(osa->handle, &delay) >= 0)
+                        osa->frames_written -= delay;
                     if ((err = snd_pcm_drop(osa->handle)) < 0) {
                         outstream->error_callback(outstream, SoundIoErrorStreaming);
-                        return;
+                        return false;
                     }
                     if ((err = snd_pcm_reset(osa->handle)) < 0) {
                         if (err == -EBADFD) {
@@ -1079,113 +2492,564 @@ static void outstream_thread_run(void *arg) {
                             // did not work.
                         } else {
                             outstream->error_callback(outstream, SoundIoErrorStreaming);
-                            return;
+                            return false;
                         }
                     }
+                    state = snd_pcm_state(osa->handle);
                     continue;
                 }
 
+                if (outstream_check_drain(osa)) {
+                    if ((err = outstream_drain_step(os)) < 0) {
+                        outstream->error_callback(outstream, SoundIoErrorStreaming);
+                        return false;
+                    }
+                    if (err == 0)
+                        return true;
+                    snd_pcm_drop(osa->handle);
+                    soundio_outstream_report_drained(os);
+                    return false;
+                }
+
+                if (osa->tsched) {
+                    snd_pcm_sframes_t avail;
+                    snd_pcm_sframes_t queued;
+                    bool paused;
+                    double time;
+                    if ((err = tsched_query(os, &avail, &queued, &paused, &time)) < 0) {
+                        if ((err = outstream_xrun_recovery(os, err)) < 0) {
+                            outstream->error_callback(outstream, SoundIoErrorStreaming);
+                            return false;
+                        }
+                        state = snd_pcm_state(osa->handle);
+                        continue;
+                    }
+                    if (!paused) {
+                        tsched_adapt(os, queued);
+                        snd_pcm_sframes_t frame_count = min((snd_pcm_sframes_t)osa->fill_target - queued, avail);
+                        if (frame_count > 0) {
+                            int64_t frames_written = osa->frames_written;
+                            soundio_outstream_run_write_callback(os, 0, frame_count);
+                            queued += osa->frames_written - frames_written;
+                        }
+                    }
+                    if (outstream_check_drain(osa)) {
+                        // drain was called from the callback
+                        polled = true;
+                        continue;
+                    }
+                    tsched_sleep(os, queued, time);
+                    return true;
+                }
+
                 snd_pcm_sframes_t avail = snd_pcm_avail_update(osa->handle);
                 if (avail < 0) {
                     if ((err = outstream_xrun_recovery(os, avail)) < 0) {
                         outstream->error_callback(outstream, SoundIoErrorStreaming);
-                        return;
+                        return false;
                     }
+                    state = snd_pcm_state(osa->handle);
                     continue;
                 }
 
-                if (avail > 0)
-                    outstream->write_callback(outstream, 0, avail);
-                continue;
+                if (osa->adaptive)
+                    adaptive_relax(os);
+                // with adaptive latency, only up to the fill target
+                snd_pcm_sframes_t frame_count = min(avail,
+                        (snd_pcm_sframes_t)osa->fill_target - (snd_pcm_sframes_t)osa->buffer_size_frames + avail);
+                if (frame_count > 0)
+                    soundio_outstream_run_write_callback(os, 0, frame_count);
+                // an underflow during the callback shows up at the next wakeup
+                return true;
             }
             case SND_PCM_STATE_XRUN:
                 if ((err = outstream_xrun_recovery(os, -EPIPE)) < 0) {
                     outstream->error_callback(outstream, SoundIoErrorStreaming);
-                    return;
+                    return false;
                 }
+                state = snd_pcm_state(osa->handle);
                 continue;
             case SND_PCM_STATE_SUSPENDED:
                 if ((err = outstream_xrun_recovery(os, -ESTRPIPE)) < 0) {
                     outstream->error_callback(outstream, SoundIoErrorStreaming);
-                    return;
+                    return false;
                 }
+                state = snd_pcm_state(osa->handle);
                 continue;
             case SND_PCM_STATE_OPEN:
             case SND_PCM_STATE_DRAINING:
             case SND_PCM_STATE_DISCONNECTED:
                 outstream->error_callback(outstream, SoundIoErrorStreaming);
+                return false;
+        }
+    }
+}
+
+// See outstream_service.
+static bool instream_service(SoundIoInStreamPrivate *is, bool polled) {
+    SoundIoInStream *instream = &is->pub;
+    SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
+
+    int err;
+
+    snd_pcm_state_t state = polled ? SND_PCM_STATE_RUNNING : snd_pcm_state(isa->handle);
+    for (;;) {
+        switch (state) {
+            case SND_PCM_STATE_SETUP:
+                if ((err = snd_pcm_prepare(isa->handle)) < 0) {
+                    instream->error_callback(instream, SoundIoErrorStreaming);
+                    return false;
+                }
+                state = SND_PCM_STATE_PREPARED;
+                continue;
+            case SND_PCM_STATE_PREPARED:
+                if ((err = snd_pcm_start(isa->handle)) < 0) {
+                    instream->error_callback(instream, SoundIoErrorStreaming);
+                    return false;
+                }
+                state = SND_PCM_STATE_RUNNING;
+                continue;
+            case SND_PCM_STATE_RUNNING:
+            case SND_PCM_STATE_PAUSED:
+            {
+                if (!polled)
+                    return true;
+                polled = false;
+
+                if (!isa->thread_exit_flag.test_and_set())
+                    return false;
+
+                snd_pcm_sframes_t avail = snd_pcm_avail_update(isa->handle);
+
+                if (avail < 0) {
+                    if ((err = instream_xrun_recovery(is, avail)) < 0) {
+                        instream->error_callback(instream, SoundIoErrorStreaming);
+                        return false;
+                    }
+                    state = snd_pcm_state(isa->handle);
+                    continue;
+                }
+
+                if (avail > 0)
+                    soundio_instream_run_read_callback(is, 0, avail);
+                return true;
+            }
+            case SND_PCM_STATE_XRUN:
+                if ((err = instream_xrun_recovery(is, -EPIPE)) < 0) {
+                    instream->error_callback(instream, SoundIoErrorStreaming);
+                    return false;
+                }
+                state = snd_pcm_state(isa->handle);
+                continue;
+            case SND_PCM_STATE_SUSPENDED:
+                if ((err = instream_xrun_recovery(is, -ESTRPIPE)) < 0) {
+                    instream->error_callback(instream, SoundIoErrorStreaming);
+                    return false;
+                }
+                state = snd_pcm_state(isa->handle);
+                continue;
+            case SND_PCM_STATE_OPEN:
+            case SND_PCM_STATE_DRAINING:
+            case SND_PCM_STATE_DISCONNECTED:
+                instream->error_callback(instream, SoundIoErrorStreaming);
+                return false;
+        }
+    }
+}
+
+static void outstream_thread_run(void *arg) {
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *) arg;
+    SoundIoOutStream *outstream = &os->pub;
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+
+    bool polled = false;
+    for (;;) {
+        if (!outstream_service(os, polled))
+            return;
+        if (outstream_wait_for_poll(os, -1) < 0) {
+            if (!osa->thread_exit_flag.test_and_set())
+                return;
+            outstream->error_callback(outstream, SoundIoErrorStreaming);
+            return;
+        }
+        polled = true;
+    }
+}
+
+static void instream_thread_run(void *arg) {
+    SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *) arg;
+    SoundIoInStream *instream = &is->pub;
+    SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
+
+    bool polled = false;
+    for (;;) {
+        if (!instream_service(is, polled))
+            return;
+        if (instream_wait_for_poll(is, -1) < 0) {
+            if (!isa->thread_exit_flag.test_and_set())
                 return;
+            instream->error_callback(instream, SoundIoErrorStreaming);
+            return;
+        }
+        polled = true;
+    }
+}
+
+static void engine_stream_error(SoundIoAlsaEngineStream *es) {
+    if (es->os) {
+        SoundIoOutStream *outstream = &es->os->pub;
+        outstream->error_callback(outstream, SoundIoErrorStreaming);
+    } else {
+        SoundIoInStream *instream = &es->is->pub;
+        instream->error_callback(instream, SoundIoErrorStreaming);
+    }
+}
+
+static void engine_stream_poll_fds(SoundIoAlsaEngineStream *es,
+        struct pollfd **out_poll_fds, int *out_poll_fd_count)
+{
+    if (es->os) {
+        SoundIoOutStreamAlsa *osa = &es->os->backend_data.alsa;
+        *out_poll_fds = osa->poll_fds;
+        *out_poll_fd_count = osa->poll_fd_count + 1;
+    } else {
+        *out_poll_fds = es->is->backend_data.alsa.poll_fds;
+        *out_poll_fd_count = es->is->backend_data.alsa.poll_fd_count;
+    }
+}
+
+// Seconds the stream can go without being serviced: the audio left to play
+// for output, the room left before an overrun for input.
+static double engine_stream_slack(SoundIoAlsaEngineStream *es) {
+    snd_pcm_t *handle;
+    snd_pcm_uframes_t buffer_size_frames;
+    int sample_rate;
+    if (es->os) {
+        handle = es->os->backend_data.alsa.handle;
+        buffer_size_frames = es->os->backend_data.alsa.buffer_size_frames;
+        sample_rate = es->os->pub.sample_rate;
+    } else {
+        handle = es->is->backend_data.alsa.handle;
+        buffer_size_frames = es->is->backend_data.alsa.buffer_size_frames;
+        sample_rate = es->is->pub.sample_rate;
+    }
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+    // an xrun is as urgent as it gets
+    if (avail < 0)
+        return 0.0;
+    return ((snd_pcm_sframes_t)buffer_size_frames - avail) / (double)sample_rate;
+}
+
+// Called from the engine thread. Returns false when the stream is done.
+static bool engine_stream_service(SoundIoAlsaEngineStream *es, bool polled) {
+    if (polled) {
+        // epoll only tells us that one of the descriptors changed; ALSA
+        // still has to translate that into stream readiness.
+        int ready = es->os ? outstream_wait_for_poll(es->os, 0) : instream_wait_for_poll(es->is, 0);
+        if (ready < 0) {
+            bool exiting = es->os ?
+                !es->os->backend_data.alsa.thread_exit_flag.test_and_set() :
+                !es->is->backend_data.alsa.thread_exit_flag.test_and_set();
+            if (!exiting)
+                engine_stream_error(es);
+            return false;
+        }
+        if (ready == 0)
+            return true;
+    }
+    return es->os ? outstream_service(es->os, polled) : instream_service(es->is, polled);
+}
+
+// Call with engine->mutex held.
+static int engine_stream_register(SoundIoAlsaEngineThread *et, SoundIoAlsaEngineStream *es) {
+    struct pollfd *poll_fds;
+    int poll_fd_count;
+    engine_stream_poll_fds(es, &poll_fds, &poll_fd_count);
+    for (int i = 0; i < poll_fd_count; i += 1) {
+        struct epoll_event event;
+        event.events = poll_fds[i].events;
+        event.data.ptr = es;
+        if (epoll_ctl(et->epoll_fd, EPOLL_CTL_ADD, poll_fds[i].fd, &event)) {
+            for (int j = 0; j < i; j += 1)
+                epoll_ctl(et->epoll_fd, EPOLL_CTL_DEL, poll_fds[j].fd, nullptr);
+            return SoundIoErrorSystemResources;
+        }
+    }
+    return 0;
+}
+
+// Call with engine->mutex held.
+static void engine_stream_unregister(SoundIoAlsaEngineThread *et, SoundIoAlsaEngineStream *es) {
+    struct pollfd *poll_fds;
+    int poll_fd_count;
+    engine_stream_poll_fds(es, &poll_fds, &poll_fd_count);
+    for (int i = 0; i < poll_fd_count; i += 1)
+        epoll_ctl(et->epoll_fd, EPOLL_CTL_DEL, poll_fds[i].fd, nullptr);
+    es->state = SoundIoAlsaEngineStreamStateStopped;
+}
+
+// Handles streams which were started or destroyed since the last call.
+static void engine_process_pending(SoundIoAlsaEngineThread *et) {
+    soundio_os_mutex_lock(et->mutex);
+    for (;;) {
+        SoundIoAlsaEngineStream *pending = nullptr;
+        for (int i = 0; i < et->streams.length; i += 1) {
+            SoundIoAlsaEngineStream *es = et->streams.at(i);
+            if (es->state == SoundIoAlsaEngineStreamStateActive && es->remove_requested)
+                engine_stream_unregister(et, es);
+            else if (es->state == SoundIoAlsaEngineStreamStatePending && !pending)
+                pending = es;
+        }
+        soundio_os_cond_signal(et->cond, et->mutex);
+        if (!pending)
+            break;
+
+        // The first callbacks are run without the mutex held, like all
+        // other callbacks.
+        pending->state = SoundIoAlsaEngineStreamStateStarting;
+        soundio_os_mutex_unlock(et->mutex);
+        bool ok = engine_stream_service(pending, false);
+        soundio_os_mutex_lock(et->mutex);
+
+        if (!ok || pending->remove_requested) {
+            pending->state = SoundIoAlsaEngineStreamStateStopped;
+        } else if (engine_stream_register(et, pending)) {
+            pending->state = SoundIoAlsaEngineStreamStateStopped;
+            soundio_os_mutex_unlock(et->mutex);
+            engine_stream_error(pending);
+            soundio_os_mutex_lock(et->mutex);
+        } else {
+            pending->state = SoundIoAlsaEngineStreamStateActive;
+        }
+    }
+    soundio_os_mutex_unlock(et->mutex);
+}
+
+static const int SOUNDIO_ALSA_ENGINE_MAX_EVENTS = 64;
+
+static void engine_thread_run(void *arg) {
+    SoundIoAlsaEngineThread *et = (SoundIoAlsaEngineThread *)arg;
+    struct epoll_event events[SOUNDIO_ALSA_ENGINE_MAX_EVENTS];
+    SoundIoAlsaEngineStream *ready[SOUNDIO_ALSA_ENGINE_MAX_EVENTS];
+
+    for (;;) {
+        int event_count = epoll_wait(et->epoll_fd, events, SOUNDIO_ALSA_ENGINE_MAX_EVENTS, -1);
+        if (!et->abort_flag.test_and_set())
+            return;
+        if (event_count < 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        // A stream has one event per poll descriptor, so collapse them.
+        int ready_count = 0;
+        for (int i = 0; i < event_count; i += 1) {
+            SoundIoAlsaEngineStream *es = (SoundIoAlsaEngineStream *)events[i].data.ptr;
+            if (!es) {
+                soundio_os_event_fd_drain(et->wakeup_fd);
+                continue;
+            }
+            if (es->ready)
+                continue;
+            es->ready = true;
+            ready[ready_count] = es;
+            ready_count += 1;
+        }
+
+        // Order the ready streams by how soon their buffers run out. A lone
+        // stream needs no ordering, which saves it a device query.
+        if (ready_count > 1) {
+            for (int i = 0; i < ready_count; i += 1) {
+                SoundIoAlsaEngineStream *es = ready[i];
+                es->slack = engine_stream_slack(es);
+                int j = i;
+                while (j > 0 && ready[j - 1]->slack > es->slack) {
+                    ready[j] = ready[j - 1];
+                    j -= 1;
+                }
+                ready[j] = es;
+            }
+        }
+
+        for (int i = 0; i < ready_count; i += 1) {
+            SoundIoAlsaEngineStream *es = ready[i];
+            es->ready = false;
+            if (!engine_stream_service(es, true)) {
+                soundio_os_mutex_lock(et->mutex);
+                engine_stream_unregister(et, es);
+                soundio_os_cond_signal(et->cond, et->mutex);
+                soundio_os_mutex_unlock(et->mutex);
+            }
+        }
+
+        engine_process_pending(et);
+    }
+}
+
+static int engine_add_stream(SoundIoAlsa *sia, SoundIoAlsaEngineStream *es) {
+    SoundIoAlsaEngineThread *et = nullptr;
+    int least_streams = 0;
+    for (int i = 0; i < sia->engine_thread_count; i += 1) {
+        SoundIoAlsaEngineThread *candidate = &sia->engine_threads[i];
+        soundio_os_mutex_lock(candidate->mutex);
+        int stream_count = candidate->streams.length;
+        soundio_os_mutex_unlock(candidate->mutex);
+        if (!et || stream_count < least_streams) {
+            et = candidate;
+            least_streams = stream_count;
+        }
+    }
+
+    soundio_os_mutex_lock(et->mutex);
+    int err;
+    if ((err = et->streams.append(es))) {
+        soundio_os_mutex_unlock(et->mutex);
+        return SoundIoErrorNoMem;
+    }
+    es->engine = et;
+    es->state = SoundIoAlsaEngineStreamStatePending;
+    es->remove_requested = false;
+    soundio_os_mutex_unlock(et->mutex);
+
+    soundio_os_event_fd_signal(et->wakeup_fd);
+    return 0;
+}
+
+// Blocks until the engine thread no longer touches the stream.
+static void engine_remove_stream(SoundIoAlsaEngineStream *es) {
+    SoundIoAlsaEngineThread *et = es->engine;
+    if (!et)
+        return;
+
+    soundio_os_mutex_lock(et->mutex);
+    if (es->state == SoundIoAlsaEngineStreamStateStarting ||
+        es->state == SoundIoAlsaEngineStreamStateActive)
+    {
+        es->remove_requested = true;
+        soundio_os_event_fd_signal(et->wakeup_fd);
+        while (es->state != SoundIoAlsaEngineStreamStateStopped)
+            soundio_os_cond_wait(et->cond, et->mutex);
+    }
+    for (int i = 0; i < et->streams.length; i += 1) {
+        if (et->streams.at(i) == es) {
+            et->streams.swap_remove(i);
+            break;
         }
     }
+    soundio_os_mutex_unlock(et->mutex);
+
+    es->engine = nullptr;
 }
 
-static void instream_thread_run(void *arg) {
-    SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *) arg;
-    SoundIoInStream *instream = &is->pub;
-    SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
+static void engine_thread_deinit(SoundIoAlsaEngineThread *et) {
+    if (et->thread) {
+        et->abort_flag.clear();
+        soundio_os_event_fd_signal(et->wakeup_fd);
+        soundio_os_thread_destroy(et->thread);
+    }
+
+    assert(et->streams.length == 0);
+    et->streams.deinit();
+
+    if (et->cond)
+        soundio_os_cond_destroy(et->cond);
+
+    if (et->mutex)
+        soundio_os_mutex_destroy(et->mutex);
+
+    if (et->wakeup_fd != -1)
+        soundio_os_event_fd_destroy(et->wakeup_fd);
+
+    if (et->epoll_fd != -1)
+        close(et->epoll_fd);
+}
 
+static int engine_thread_init(SoundIoPrivate *si, SoundIoAlsaEngineThread *et) {
+    SoundIo *soundio = &si->pub;
     int err;
 
-    for (;;) {
-        snd_pcm_state_t state = snd_pcm_state(isa->handle);
-        switch (state) {
-            case SND_PCM_STATE_SETUP:
-                if ((err = snd_pcm_prepare(isa->handle)) < 0) {
-                    instream->error_callback(instream, SoundIoErrorStreaming);
-                    return;
-                }
-                continue;
-            case SND_PCM_STATE_PREPARED:
-                if ((err = snd_pcm_start(isa->handle)) < 0) {
-                    instream->error_callback(instream, SoundIoErrorStreaming);
-                    return;
-                }
-                continue;
-            case SND_PCM_STATE_RUNNING:
-            case SND_PCM_STATE_PAUSED:
-            {
-                if ((err = instream_wait_for_poll(is)) < 0) {
-                    if (!isa->thread_exit_flag.test_and_set())
-                        return;
-                    instream->error_callback(instream, SoundIoErrorStreaming);
-                    return;
-                }
-                if (!isa->thread_exit_flag.test_and_set())
-                    return;
+    et->epoll_fd = -1;
+    et->wakeup_fd = -1;
+    et->abort_flag.test_and_set();
 
-                snd_pcm_sframes_t avail = snd_pcm_avail_update(isa->handle);
+    et->mutex = soundio_os_mutex_create_pi();
+    if (!et->mutex)
+        return SoundIoErrorNoMem;
 
-                if (avail < 0) {
-                    if ((err = instream_xrun_recovery(is, avail)) < 0) {
-                        instream->error_callback(instream, SoundIoErrorStreaming);
-                        return;
-                    }
-                    continue;
-                }
+    et->cond = soundio_os_cond_create();
+    if (!et->cond)
+        return SoundIoErrorNoMem;
 
-                if (avail > 0)
-                    instream->read_callback(instream, 0, avail);
-                continue;
-            }
-            case SND_PCM_STATE_XRUN:
-                if ((err = instream_xrun_recovery(is, -EPIPE)) < 0) {
-                    instream->error_callback(instream, SoundIoErrorStreaming);
-                    return;
-                }
-                continue;
-            case SND_PCM_STATE_SUSPENDED:
-                if ((err = instream_xrun_recovery(is, -ESTRPIPE)) < 0) {
-                    instream->error_callback(instream, SoundIoErrorStreaming);
-                    return;
-                }
-                continue;
-            case SND_PCM_STATE_OPEN:
-            case SND_PCM_STATE_DRAINING:
-            case SND_PCM_STATE_DISCONNECTED:
-                instream->error_callback(instream, SoundIoErrorStreaming);
-                return;
-        }
+    if ((err = soundio_os_event_fd_create(&et->wakeup_fd)))
+        return err;
+
+    et->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (et->epoll_fd == -1)
+        return SoundIoErrorSystemResources;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(et->epoll_fd, EPOLL_CTL_ADD, et->wakeup_fd, &event))
+        return SoundIoErrorSystemResources;
+
+    if ((err = soundio_os_thread_create(engine_thread_run, et, soundio->emit_rtprio_warning, &et->thread)))
+        return err;
+
+    return 0;
+}
+
+// Enables timestamps, on CLOCK_MONOTONIC where the kernel supports it.
+static int set_tstamp_params(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams, clockid_t *out_clock) {
+    // the default timestamp type uses the gettimeofday clock
+    *out_clock = CLOCK_REALTIME;
+    int err;
+    if ((err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE)) < 0)
+        return err;
+    if (snd_pcm_sw_params_set_tstamp_type(handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC) >= 0)
+        *out_clock = CLOCK_MONOTONIC;
+    return 0;
+}
+
+// Reads the delay and the time at which the hardware pointer was at it from
+// one snapshot of the driver state. The time is converted to CLOCK_MONOTONIC.
+static int get_status_tstamp(snd_pcm_t *handle, clockid_t clock,
+        snd_pcm_sframes_t *out_delay, double *out_time)
+{
+    snd_pcm_status_t *status;
+    snd_pcm_status_alloca(&status);
+    if (snd_pcm_status(handle, status) < 0)
+        return SoundIoErrorStreaming;
+
+    snd_htimestamp_t tstamp;
+    switch (snd_pcm_status_get_state(status)) {
+        case SND_PCM_STATE_RUNNING:
+        case SND_PCM_STATE_DRAINING:
+            snd_pcm_status_get_htstamp(status, &tstamp);
+            if (tstamp.tv_sec || tstamp.tv_nsec)
+                break;
+            clock_gettime(clock, &tstamp);
+            break;
+        case SND_PCM_STATE_PREPARED:
+        case SND_PCM_STATE_PAUSED:
+            // the position is not moving
+            clock_gettime(clock, &tstamp);
+            break;
+        default:
+            return SoundIoErrorStreaming;
+    }
+    *out_delay = snd_pcm_status_get_delay(status);
+
+    double time = (double)tstamp.tv_sec + (double)tstamp.tv_nsec / 1000000000.0;
+    if (clock != CLOCK_MONOTONIC) {
+        struct timespec mono;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        clock_gettime(clock, &now);
+        time += (double)(mono.tv_sec - now.tv_sec) + (double)(mono.tv_nsec - now.tv_nsec) / 1000000000.0;
     }
+    *out_time = time;
+    return 0;
 }
 
 static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
@@ -1194,9 +3058,11 @@ static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
     SoundIoDevice *device = outstream->device;
 
     osa->clear_buffer_flag.test_and_set();
+    osa->drain_flag.test_and_set();
+    osa->timer_fd = -1;
 
-    if (outstream->software_latency == 0.0)
-        outstream->software_latency = clamp(device->software_latency_min, 1.0, device->software_latency_max);
+    bool exclusive = outstream->exclusive && device->is_raw &&
+        outstream->access_mode != SoundIoAccessModeCopy;
 
     int ch_count = outstream->layout.channel_count;
 
@@ -1214,7 +3080,7 @@ static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
 
     snd_pcm_stream_t stream = aim_to_stream(outstream->device->aim);
 
-    if ((err = snd_pcm_open(&osa->handle, outstream->device->id, stream, 0)) < 0) {
+    if ((err = snd_pcm_open(&osa->handle, outstream->device->id, stream, exclusive ? exclusive_open_mode : 0)) < 0) {
         outstream_destroy_alsa(si, os);
         return SoundIoErrorOpeningDevice;
     }
@@ -1230,10 +3096,18 @@ static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
         return SoundIoErrorOpeningDevice;
     }
 
-    if ((err = set_access(osa->handle, hwparams, &osa->access))) {
+    // a failed set_access leaves hwparams untouched
+    if (exclusive && set_access(osa->handle, hwparams, SoundIoAccessModeDirect, &osa->access))
+        exclusive = false;
+    if (!exclusive && (err = set_access(osa->handle, hwparams, outstream->access_mode, &osa->access))) {
         outstream_destroy_alsa(si, os);
         return err;
     }
+    outstream->access_mode = is_mmap_access(osa->access) ? SoundIoAccessModeDirect : SoundIoAccessModeCopy;
+    outstream->exclusive = exclusive;
+
+    if (outstream->software_latency == 0.0 && !exclusive)
+        outstream->software_latency = clamp(device->software_latency_min, 1.0, device->software_latency_max);
 
     if ((err = snd_pcm_hw_params_set_channels(osa->handle, hwparams, ch_count)) < 0) {
         outstream_destroy_alsa(si, os);
@@ -1257,15 +3131,60 @@ static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
         return SoundIoErrorOpeningDevice;
     }
 
-    osa->buffer_size_frames = ceil_dbl_to_int(outstream->software_latency * (double)outstream->sample_rate);
+    bool tsched = outstream->timer_scheduling && !exclusive &&
+        snd_pcm_hw_params_can_disable_period_wakeup(hwparams) &&
+        snd_pcm_hw_params_set_period_wakeup(osa->handle, hwparams, 0) >= 0;
+    outstream->timer_scheduling = tsched;
+
+    osa->adaptive = outstream->adaptive_latency && !tsched && !exclusive;
+
+    snd_pcm_uframes_t latency_frames = ceil_dbl_to_uframes(outstream->software_latency * (double)outstream->sample_rate);
+    if (exclusive) {
+        snd_pcm_uframes_t period_frames;
+        if ((err = set_exclusive_period(osa->handle, hwparams, &period_frames))) {
+            outstream_destroy_alsa(si, os);
+            return err;
+        }
+        snd_pcm_uframes_t period_count = max((latency_frames + period_frames - 1) / period_frames,
+                (snd_pcm_uframes_t)2);
+        osa->buffer_size_frames = period_count * period_frames;
+    } else if (tsched)
+        osa->buffer_size_frames = max(latency_frames, ceil_dbl_to_uframes(SOUNDIO_ALSA_TSCHED_BUFFER_TIME * outstream->sample_rate));
+    else if (osa->adaptive)
+        osa->buffer_size_frames = latency_frames * SOUNDIO_ALSA_ADAPTIVE_BUFFER_FACTOR;
+    else
+        osa->buffer_size_frames = latency_frames;
 
     if ((err = snd_pcm_hw_params_set_buffer_size_near(osa->handle, hwparams, &osa->buffer_size_frames)) < 0) {
         outstream_destroy_alsa(si, os);
         return SoundIoErrorOpeningDevice;
     }
-    outstream->software_latency = ((double)osa->buffer_size_frames) / (double)outstream->sample_rate;
 
-    if (device->is_raw) {
+    // the device buffer only bounds how much may be kept buffered
+    osa->fill_target_min = (tsched || osa->adaptive) ?
+        min(latency_frames, osa->buffer_size_frames) : osa->buffer_size_frames;
+    osa->fill_target = osa->fill_target_min;
+    os->xruns.fill_frames.store(osa->fill_target);
+    // callbacks are asked for no more than the fill target
+    os->watchdog.buffer_frames = osa->fill_target;
+    if (tsched) {
+        osa->tsched_watermark_min = max(ceil_dbl_to_uframes(SOUNDIO_ALSA_TSCHED_WATERMARK_MIN_TIME * outstream->sample_rate),
+                (snd_pcm_uframes_t)1);
+        osa->tsched_watermark = max(min(ceil_dbl_to_uframes(SOUNDIO_ALSA_TSCHED_WATERMARK_TIME * outstream->sample_rate),
+                    osa->fill_target / 2), osa->tsched_watermark_min);
+    }
+    outstream->software_latency = ((double)osa->fill_target) / (double)outstream->sample_rate;
+
+    if (tsched) {
+        // Periods only matter for the granularity of the hardware pointer.
+        snd_pcm_uframes_t period_frames = osa->buffer_size_frames / 4;
+        if ((err = snd_pcm_hw_params_set_period_size_near(osa->handle, hwparams, &period_frames, nullptr)) < 0) {
+            outstream_destroy_alsa(si, os);
+            return SoundIoErrorOpeningDevice;
+        }
+    } else if (exclusive) {
+        // the period was chosen before the buffer
+    } else if (device->is_raw) {
         unsigned int microseconds = 0.25 * outstream->software_latency * 1000000.0;
         if ((err = snd_pcm_hw_params_set_period_time_near(osa->handle, hwparams, &microseconds, nullptr)) < 0) {
             outstream_destroy_alsa(si, os);
@@ -1288,6 +3207,7 @@ static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
         return SoundIoErrorOpeningDevice;
     }
     osa->period_size = period_size;
+    osa->engine_stream.os = os;
 
     // write the hardware parameters to device
     if ((err = snd_pcm_hw_params(osa->handle, hwparams)) < 0) {
@@ -1317,7 +3237,15 @@ static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
         return SoundIoErrorOpeningDevice;
     }
 
-    if ((err = snd_pcm_sw_params_set_avail_min(osa->handle, swparams, osa->period_size)) < 0) {
+    // With timer scheduling the poll descriptors only report errors, and an
+    // empty buffer.
+    snd_pcm_uframes_t avail_min = tsched ? osa->buffer_size_frames : fill_avail_min(osa);
+    if ((err = snd_pcm_sw_params_set_avail_min(osa->handle, swparams, avail_min)) < 0) {
+        outstream_destroy_alsa(si, os);
+        return SoundIoErrorOpeningDevice;
+    }
+
+    if ((err = set_tstamp_params(osa->handle, swparams, &osa->tstamp_clock)) < 0 && tsched) {
         outstream_destroy_alsa(si, os);
         return SoundIoErrorOpeningDevice;
     }
@@ -1329,7 +3257,10 @@ static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
     }
 
     if (osa->access == SND_PCM_ACCESS_RW_INTERLEAVED || osa->access == SND_PCM_ACCESS_RW_NONINTERLEAVED) {
-        osa->sample_buffer_size = ch_count * osa->period_size * phys_bytes_per_sample;
+        // room for the whole buffer so that one begin/end pair can cover
+        // everything that is available with a single syscall
+        osa->sample_buffer_frames = osa->buffer_size_frames;
+        osa->sample_buffer_size = ch_count * osa->sample_buffer_frames * phys_bytes_per_sample;
         osa->sample_buffer = allocate_nonzero<char>(osa->sample_buffer_size);
         if (!osa->sample_buffer) {
             outstream_destroy_alsa(si, os);
@@ -1343,7 +3274,7 @@ static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
         return SoundIoErrorOpeningDevice;
     }
 
-    osa->poll_fds = allocate<struct pollfd>(osa->poll_fd_count);
+    osa->poll_fds = allocate<struct pollfd>(osa->poll_fd_count + 1);
     if (!osa->poll_fds) {
         outstream_destroy_alsa(si, os);
         return SoundIoErrorNoMem;
@@ -1354,17 +3285,30 @@ static int outstream_open_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
         return SoundIoErrorOpeningDevice;
     }
 
+    osa->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (osa->timer_fd < 0) {
+        outstream_destroy_alsa(si, os);
+        return SoundIoErrorSystemResources;
+    }
+    osa->poll_fds[osa->poll_fd_count].fd = osa->timer_fd;
+    osa->poll_fds[osa->poll_fd_count].events = POLLIN;
+    osa->tsched = tsched;
+
     return 0;
 }
 
 static int outstream_start_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
     SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    SoundIoAlsa *sia = &si->backend_data.alsa;
     SoundIo *soundio = &si->pub;
 
     assert(!osa->thread);
 
     int err;
     osa->thread_exit_flag.test_and_set();
+    if (sia->engine_thread_count > 0)
+        return engine_add_stream(sia, &osa->engine_stream);
+
     if ((err = soundio_os_thread_create(outstream_thread_run, os, soundio->emit_rtprio_warning, &osa->thread)))
         return err;
 
@@ -1384,21 +3328,24 @@ static int outstream_begin_write_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivat
             osa->areas[ch].step = outstream->bytes_per_frame;
         }
 
-        osa->write_frame_count = min(*frame_count, osa->period_size);
+        osa->write_frame_count = min(*frame_count, osa->sample_buffer_frames);
         *frame_count = osa->write_frame_count;
     } else if (osa->access == SND_PCM_ACCESS_RW_NONINTERLEAVED) {
         for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
-            osa->areas[ch].ptr = osa->sample_buffer + ch * outstream->bytes_per_sample * osa->period_size;
+            osa->areas[ch].ptr = osa->sample_buffer + ch * outstream->bytes_per_sample * osa->sample_buffer_frames;
             osa->areas[ch].step = outstream->bytes_per_sample;
         }
 
-        osa->write_frame_count = min(*frame_count, osa->period_size);
+        osa->write_frame_count = min(*frame_count, osa->sample_buffer_frames);
         *frame_count = osa->write_frame_count;
     } else {
         const snd_pcm_channel_area_t *areas;
         snd_pcm_uframes_t frames = *frame_count;
         int err;
 
+        // A channel area cannot describe a region which wraps around the end
+        // of the device buffer, so this stops at the wrap and the caller gets
+        // the rest from the next begin_write.
         if ((err = snd_pcm_mmap_begin(osa->handle, &areas, &osa->offset, &frames)) < 0) {
             if (err == -EPIPE || err == -ESTRPIPE)
                 return SoundIoErrorUnderflow;
@@ -1432,13 +3379,16 @@ static int outstream_end_write_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate
     } else if (osa->access == SND_PCM_ACCESS_RW_NONINTERLEAVED) {
         char *ptrs[SOUNDIO_MAX_CHANNELS];
         for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
-            ptrs[ch] = osa->sample_buffer + ch * outstream->bytes_per_sample * osa->period_size;
+            ptrs[ch] = osa->sample_buffer + ch * outstream->bytes_per_sample * osa->sample_buffer_frames;
         }
         commitres = snd_pcm_writen(osa->handle, (void**)ptrs, osa->write_frame_count);
     } else {
         commitres = snd_pcm_mmap_commit(osa->handle, osa->offset, osa->write_frame_count);
     }
 
+    if (commitres > 0)
+        osa->frames_written += commitres;
+
     if (commitres < 0 || commitres != osa->write_frame_count) {
         int err = (commitres >= 0) ? -EPIPE : commitres;
         if (err == -EPIPE || err == -ESTRPIPE)
@@ -1449,11 +3399,42 @@ static int outstream_end_write_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate
     return 0;
 }
 
+// Queues silence, for instance to start over after an xrun.
+static int outstream_write_silence(SoundIoOutStreamPrivate *os, snd_pcm_uframes_t frames) {
+    SoundIoOutStream *outstream = &os->pub;
+    snd_pcm_format_t format = to_alsa_fmt(outstream->format);
+    int err;
+    while (frames > 0) {
+        SoundIoChannelArea *areas;
+        int frame_count = frames;
+        if ((err = outstream_begin_write_alsa(nullptr, os, &areas, &frame_count)))
+            return err;
+        for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
+            for (int frame = 0; frame < frame_count; frame += 1)
+                snd_pcm_format_set_silence(format, areas[ch].ptr + frame * areas[ch].step, 1);
+        }
+        if ((err = outstream_end_write_alsa(nullptr, os)))
+            return err;
+        // not part of the stream, see SoundIoTimestamp::frame
+        os->backend_data.alsa.frames_written -= frame_count;
+        frames -= frame_count;
+    }
+    return 0;
+}
+
+static int outstream_drain_alsa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    osa->drain_flag.clear();
+    outstream_arm_timer(osa, 0.0);
+    return 0;
+}
+
 static int outstream_clear_buffer_alsa(SoundIoPrivate *si,
         SoundIoOutStreamPrivate *os)
 {
     SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
     osa->clear_buffer_flag.clear();
+    outstream_arm_timer(osa, 0.0);
     return 0;
 }
 
@@ -1494,20 +3475,44 @@ static int outstream_get_latency_alsa(struct SoundIoPrivate *si, struct SoundIoO
     return 0;
 }
 
+static int outstream_get_timestamp_alsa(struct SoundIoPrivate *si, struct SoundIoOutStreamPrivate *os,
+        struct SoundIoTimestamp *out_timestamp)
+{
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    int err;
+
+    snd_pcm_sframes_t delay;
+    double time;
+    if ((err = get_status_tstamp(osa->handle, osa->tstamp_clock, &delay, &time)))
+        return err;
+
+    out_timestamp->frame = osa->frames_written - delay;
+    out_timestamp->time = time;
+    return 0;
+}
+
 static void instream_destroy_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
 
+    engine_remove_stream(&isa->engine_stream);
+
     if (isa->thread) {
         isa->thread_exit_flag.clear();
         soundio_os_thread_destroy(isa->thread);
+        isa->thread = nullptr;
     }
 
+    // See outstream_destroy_alsa.
     if (isa->handle)
         snd_pcm_close(isa->handle);
+    isa->handle = nullptr;
 
     free(isa->poll_fds);
+    isa->poll_fds = nullptr;
     free(isa->chmap);
+    isa->chmap = nullptr;
     free(isa->sample_buffer);
+    isa->sample_buffer = nullptr;
 }
 
 static int instream_open_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
@@ -1515,8 +3520,8 @@ static int instream_open_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     SoundIoInStream *instream = &is->pub;
     SoundIoDevice *device = instream->device;
 
-    if (instream->software_latency == 0.0)
-        instream->software_latency = clamp(device->software_latency_min, 1.0, device->software_latency_max);
+    bool exclusive = instream->exclusive && device->is_raw &&
+        instream->access_mode != SoundIoAccessModeCopy;
 
     int ch_count = instream->layout.channel_count;
 
@@ -1534,7 +3539,7 @@ static int instream_open_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
 
     snd_pcm_stream_t stream = aim_to_stream(instream->device->aim);
 
-    if ((err = snd_pcm_open(&isa->handle, instream->device->id, stream, 0)) < 0) {
+    if ((err = snd_pcm_open(&isa->handle, instream->device->id, stream, exclusive ? exclusive_open_mode : 0)) < 0) {
         instream_destroy_alsa(si, is);
         return SoundIoErrorOpeningDevice;
     }
@@ -1550,10 +3555,17 @@ static int instream_open_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
         return SoundIoErrorOpeningDevice;
     }
 
-    if ((err = set_access(isa->handle, hwparams, &isa->access))) {
+    if (exclusive && set_access(isa->handle, hwparams, SoundIoAccessModeDirect, &isa->access))
+        exclusive = false;
+    if (!exclusive && (err = set_access(isa->handle, hwparams, instream->access_mode, &isa->access))) {
         instream_destroy_alsa(si, is);
         return err;
     }
+    instream->access_mode = is_mmap_access(isa->access) ? SoundIoAccessModeDirect : SoundIoAccessModeCopy;
+    instream->exclusive = exclusive;
+
+    if (instream->software_latency == 0.0 && !exclusive)
+        instream->software_latency = clamp(device->software_latency_min, 1.0, device->software_latency_max);
 
     if ((err = snd_pcm_hw_params_set_channels(isa->handle, hwparams, ch_count)) < 0) {
         instream_destroy_alsa(si, is);
@@ -1577,20 +3589,28 @@ static int instream_open_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
         return SoundIoErrorOpeningDevice;
     }
 
-    snd_pcm_uframes_t period_frames = ceil_dbl_to_uframes(0.5 * instream->software_latency * (double)instream->sample_rate);
-    if ((err = snd_pcm_hw_params_set_period_size_near(isa->handle, hwparams, &period_frames, nullptr)) < 0) {
-        instream_destroy_alsa(si, is);
-        return SoundIoErrorOpeningDevice;
+    snd_pcm_uframes_t period_frames;
+    if (exclusive) {
+        if ((err = set_exclusive_period(isa->handle, hwparams, &period_frames))) {
+            instream_destroy_alsa(si, is);
+            return err;
+        }
+    } else {
+        period_frames = ceil_dbl_to_uframes(0.5 * instream->software_latency * (double)instream->sample_rate);
+        if ((err = snd_pcm_hw_params_set_period_size_near(isa->handle, hwparams, &period_frames, nullptr)) < 0) {
+            instream_destroy_alsa(si, is);
+            return SoundIoErrorOpeningDevice;
+        }
     }
     instream->software_latency = ((double)period_frames) / (double)instream->sample_rate;
     isa->period_size = period_frames;
 
 
-    snd_pcm_uframes_t buffer_size_frames;
-    if ((err = snd_pcm_hw_params_set_buffer_size_last(isa->handle, hwparams, &buffer_size_frames)) < 0) {
+    if ((err = snd_pcm_hw_params_set_buffer_size_last(isa->handle, hwparams, &isa->buffer_size_frames)) < 0) {
         instream_destroy_alsa(si, is);
         return SoundIoErrorOpeningDevice;
     }
+    isa->engine_stream.is = is;
 
     // write the hardware parameters to device
     if ((err = snd_pcm_hw_params(isa->handle, hwparams)) < 0) {
@@ -1615,14 +3635,22 @@ static int instream_open_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
         return SoundIoErrorOpeningDevice;
     }
 
+    // without timestamps snd_pcm_status reports the current time instead
+    set_tstamp_params(isa->handle, swparams, &isa->tstamp_clock);
+
     // write the software parameters to device
     if ((err = snd_pcm_sw_params(isa->handle, swparams)) < 0) {
         instream_destroy_alsa(si, is);
         return (err == -EINVAL) ? SoundIoErrorIncompatibleDevice : SoundIoErrorOpeningDevice;
     }
 
+    is->watchdog.buffer_frames = isa->buffer_size_frames;
+
     if (isa->access == SND_PCM_ACCESS_RW_INTERLEAVED || isa->access == SND_PCM_ACCESS_RW_NONINTERLEAVED) {
-        isa->sample_buffer_size = ch_count * isa->period_size * phys_bytes_per_sample;
+        // room for the whole buffer so that one begin/end pair can cover
+        // everything that is available with a single syscall
+        isa->sample_buffer_frames = isa->buffer_size_frames;
+        isa->sample_buffer_size = ch_count * isa->sample_buffer_frames * phys_bytes_per_sample;
         isa->sample_buffer = allocate_nonzero<char>(isa->sample_buffer_size);
         if (!isa->sample_buffer) {
             instream_destroy_alsa(si, is);
@@ -1652,12 +3680,21 @@ static int instream_open_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
 
 static int instream_start_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
+    SoundIoAlsa *sia = &si->backend_data.alsa;
     SoundIo *soundio = &si->pub;
 
     assert(!isa->thread);
 
     isa->thread_exit_flag.test_and_set();
     int err;
+    if (sia->engine_thread_count > 0) {
+        if ((err = engine_add_stream(sia, &isa->engine_stream))) {
+            instream_destroy_alsa(si, is);
+            return err;
+        }
+        return 0;
+    }
+
     if ((err = soundio_os_thread_create(instream_thread_run, is, soundio->emit_rtprio_warning, &isa->thread))) {
         instream_destroy_alsa(si, is);
         return err;
@@ -1679,7 +3716,7 @@ static int instream_begin_read_alsa(SoundIoPrivate *si,
             isa->areas[ch].step = instream->bytes_per_frame;
         }
 
-        isa->read_frame_count = min(*frame_count, isa->period_size);
+        isa->read_frame_count = min(*frame_count, isa->sample_buffer_frames);
         *frame_count = isa->read_frame_count;
 
         snd_pcm_sframes_t commitres = snd_pcm_readi(isa->handle, isa->sample_buffer, isa->read_frame_count);
@@ -1691,12 +3728,12 @@ static int instream_begin_read_alsa(SoundIoPrivate *si,
     } else if (isa->access == SND_PCM_ACCESS_RW_NONINTERLEAVED) {
         char *ptrs[SOUNDIO_MAX_CHANNELS];
         for (int ch = 0; ch < instream->layout.channel_count; ch += 1) {
-            isa->areas[ch].ptr = isa->sample_buffer + ch * instream->bytes_per_sample * isa->period_size;
+            isa->areas[ch].ptr = isa->sample_buffer + ch * instream->bytes_per_sample * isa->sample_buffer_frames;
             isa->areas[ch].step = instream->bytes_per_sample;
             ptrs[ch] = isa->areas[ch].ptr;
         }
 
-        isa->read_frame_count = min(*frame_count, isa->period_size);
+        isa->read_frame_count = min(*frame_count, isa->sample_buffer_frames);
         *frame_count = isa->read_frame_count;
 
         snd_pcm_sframes_t commitres = snd_pcm_readn(isa->handle, (void**)ptrs, isa->read_frame_count);
@@ -1734,6 +3771,8 @@ static int instream_begin_read_alsa(SoundIoPrivate *si,
 static int instream_end_read_alsa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
 
+    isa->frames_read += isa->read_frame_count;
+
     if (isa->access == SND_PCM_ACCESS_RW_INTERLEAVED) {
         // nothing to do
     } else if (isa->access == SND_PCM_ACCESS_RW_NONINTERLEAVED) {
@@ -1780,6 +3819,191 @@ static int instream_get_latency_alsa(struct SoundIoPrivate *si, struct SoundIoIn
     return 0;
 }
 
+static int instream_get_timestamp_alsa(struct SoundIoPrivate *si, struct SoundIoInStreamPrivate *is,
+        struct SoundIoTimestamp *out_timestamp)
+{
+    SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
+    int err;
+
+    snd_pcm_sframes_t delay;
+    double time;
+    if ((err = get_status_tstamp(isa->handle, isa->tstamp_clock, &delay, &time)))
+        return err;
+
+    out_timestamp->frame = isa->frames_read + delay;
+    out_timestamp->time = time;
+    return 0;
+}
+
+static bool pcm_state_is_started(snd_pcm_state_t state) {
+    return state == SND_PCM_STATE_RUNNING || state == SND_PCM_STATE_PAUSED;
+}
+
+// Stops both streams of a duplex stream, fills the output buffer with
+// silence and starts them again on the same sample.
+static int duplex_stream_restart(SoundIoDuplexStreamPrivate *ds) {
+    SoundIoDuplexStream *duplex = &ds->pub;
+    SoundIoDuplexStreamAlsa *dsa = &ds->backend_data.alsa;
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)duplex->outstream;
+    SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *)duplex->instream;
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
+
+    int err;
+
+    // The streams are linked, so this stops both. It fails harmlessly when
+    // they were never started.
+    snd_pcm_drop(isa->handle);
+
+    if (snd_pcm_prepare(osa->handle) < 0 || snd_pcm_prepare(isa->handle) < 0)
+        return SoundIoErrorStreaming;
+
+    if ((err = outstream_write_silence(os, dsa->prefill_frames)))
+        return err;
+
+    if (snd_pcm_start(isa->handle) < 0)
+        return SoundIoErrorStreaming;
+
+    return 0;
+}
+
+// Waits on the input stream only: the output is kept exactly
+// SoundIoDuplexStreamAlsa::prefill_frames ahead of it, so it has room for
+// whatever was captured.
+static void duplex_stream_thread_run(void *arg) {
+    SoundIoDuplexStreamPrivate *ds = (SoundIoDuplexStreamPrivate *) arg;
+    SoundIoDuplexStream *duplex = &ds->pub;
+    SoundIoDuplexStreamAlsa *dsa = &ds->backend_data.alsa;
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)duplex->outstream;
+    SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *)duplex->instream;
+    SoundIoOutStreamAlsa *osa = &os->backend_data.alsa;
+    SoundIoInStreamAlsa *isa = &is->backend_data.alsa;
+
+    // The states are only read at the start and after avail_update failed.
+    bool check_state = true;
+    for (;;) {
+        snd_pcm_state_t out_state = check_state ? snd_pcm_state(osa->handle) : SND_PCM_STATE_RUNNING;
+        snd_pcm_state_t in_state = check_state ? snd_pcm_state(isa->handle) : SND_PCM_STATE_RUNNING;
+        check_state = false;
+        if (!pcm_state_is_started(out_state) || !pcm_state_is_started(in_state)) {
+            if (out_state == SND_PCM_STATE_XRUN || out_state == SND_PCM_STATE_SUSPENDED)
+                soundio_outstream_run_underflow_callback(os);
+            if (in_state == SND_PCM_STATE_XRUN || in_state == SND_PCM_STATE_SUSPENDED)
+                soundio_instream_run_overflow_callback(is);
+            if (duplex_stream_restart(ds)) {
+                duplex->error_callback(duplex, SoundIoErrorStreaming);
+                return;
+            }
+        }
+
+        if (instream_wait_for_poll(is, -1) < 0) {
+            if (!dsa->thread_exit_flag.test_and_set())
+                return;
+            duplex->error_callback(duplex, SoundIoErrorStreaming);
+            return;
+        }
+        if (!dsa->thread_exit_flag.test_and_set())
+            return;
+
+        snd_pcm_sframes_t in_avail = snd_pcm_avail_update(isa->handle);
+        snd_pcm_sframes_t out_avail = snd_pcm_avail_update(osa->handle);
+        // an xrun stops both streams, which are restarted above
+        if (in_avail < 0 || out_avail < 0) {
+            check_state = true;
+            continue;
+        }
+
+        int frame_count = min(in_avail, out_avail);
+        if (frame_count > 0)
+            duplex->duplex_callback(duplex, frame_count);
+    }
+}
+
+static void duplex_stream_destroy_alsa(SoundIoPrivate *si, SoundIoDuplexStreamPrivate *ds) {
+    SoundIoDuplexStream *duplex = &ds->pub;
+    SoundIoDuplexStreamAlsa *dsa = &ds->backend_data.alsa;
+    SoundIoOutStreamAlsa *osa = &((SoundIoOutStreamPrivate *)duplex->outstream)->backend_data.alsa;
+    SoundIoInStreamAlsa *isa = &((SoundIoInStreamPrivate *)duplex->instream)->backend_data.alsa;
+
+    if (dsa->thread) {
+        dsa->thread_exit_flag.clear();
+        soundio_os_thread_destroy(dsa->thread);
+        dsa->thread = nullptr;
+    }
+
+    if (dsa->is_linked) {
+        snd_pcm_drop(isa->handle);
+        snd_pcm_unlink(isa->handle);
+        dsa->is_linked = false;
+    }
+
+    // the output may still be started on its own
+    if (dsa->start_threshold_saved) {
+        set_start_threshold(osa->handle, dsa->saved_start_threshold);
+        dsa->start_threshold_saved = false;
+    }
+}
+
+static int duplex_stream_open_alsa(SoundIoPrivate *si, SoundIoDuplexStreamPrivate *ds) {
+    SoundIoDuplexStream *duplex = &ds->pub;
+    SoundIoDuplexStreamAlsa *dsa = &ds->backend_data.alsa;
+    SoundIoOutStreamAlsa *osa = &((SoundIoOutStreamPrivate *)duplex->outstream)->backend_data.alsa;
+    SoundIoInStreamAlsa *isa = &((SoundIoInStreamPrivate *)duplex->instream)->backend_data.alsa;
+
+    if (!osa->handle || !isa->handle || osa->tsched || osa->adaptive)
+        return SoundIoErrorInvalid;
+
+    if (osa->thread || osa->engine_stream.engine || isa->thread || isa->engine_stream.engine)
+        return SoundIoErrorInvalid;
+
+    if (osa->buffer_size_frames < 2 * (snd_pcm_uframes_t)isa->period_size)
+        return SoundIoErrorIncompatibleDevice;
+
+    int err;
+    if ((err = snd_pcm_link(osa->handle, isa->handle)) < 0)
+        return SoundIoErrorIncompatibleDevice;
+    dsa->is_linked = true;
+
+    // Only snd_pcm_start may start the output, so that writing the silence
+    // does not start it early. Destroying the duplex stream puts the old
+    // threshold back.
+    snd_pcm_sw_params_t *swparams;
+    snd_pcm_sw_params_alloca(&swparams);
+    snd_pcm_uframes_t boundary;
+    if ((err = snd_pcm_sw_params_current(osa->handle, swparams)) < 0) {
+        duplex_stream_destroy_alsa(si, ds);
+        return SoundIoErrorIncompatibleDevice;
+    }
+    if ((err = snd_pcm_sw_params_get_start_threshold(swparams, &dsa->saved_start_threshold)) < 0) {
+        duplex_stream_destroy_alsa(si, ds);
+        return SoundIoErrorIncompatibleDevice;
+    }
+    if ((err = snd_pcm_sw_params_get_boundary(swparams, &boundary)) < 0) {
+        duplex_stream_destroy_alsa(si, ds);
+        return SoundIoErrorIncompatibleDevice;
+    }
+    if ((err = set_start_threshold(osa->handle, boundary)) < 0) {
+        duplex_stream_destroy_alsa(si, ds);
+        return SoundIoErrorIncompatibleDevice;
+    }
+    dsa->start_threshold_saved = true;
+
+    dsa->prefill_frames = osa->buffer_size_frames - isa->period_size;
+    duplex->software_latency = osa->buffer_size_frames / (double)duplex->outstream->sample_rate;
+
+    return 0;
+}
+
+static int duplex_stream_start_alsa(SoundIoPrivate *si, SoundIoDuplexStreamPrivate *ds) {
+    SoundIoDuplexStreamAlsa *dsa = &ds->backend_data.alsa;
+    SoundIo *soundio = &si->pub;
+
+    assert(!dsa->thread);
+
+    dsa->thread_exit_flag.test_and_set();
+    return soundio_os_thread_create(duplex_stream_thread_run, ds, soundio->emit_rtprio_warning, &dsa->thread);
+}
+
 int soundio_alsa_init(SoundIoPrivate *si) {
     SoundIoAlsa *sia = &si->backend_data.alsa;
     int err;
@@ -1788,7 +4012,7 @@ int soundio_alsa_init(SoundIoPrivate *si) {
     sia->notify_wd = -1;
     sia->abort_flag.test_and_set();
 
-    sia->mutex = soundio_os_mutex_create();
+    sia->mutex = soundio_os_mutex_create_pi();
     if (!sia->mutex) {
         destroy_alsa(si);
         return SoundIoErrorNoMem;
@@ -1800,6 +4024,12 @@ int soundio_alsa_init(SoundIoPrivate *si) {
         return SoundIoErrorNoMem;
     }
 
+    sia->lazy_results_mutex = soundio_os_mutex_create();
+    if (!sia->lazy_results_mutex) {
+        destroy_alsa(si);
+        return SoundIoErrorNoMem;
+    }
+
 
     // set up inotify to watch /dev/snd for devices added or removed
     sia->notify_fd = inotify_init1(IN_NONBLOCK);
@@ -1841,6 +4071,14 @@ int soundio_alsa_init(SoundIoPrivate *si) {
         return SoundIoErrorSystemResources;
     }
 
+    sia->lazy_probe = si->pub.lazy_probe;
+
+    if (si->pub.alsa_capability_cache) {
+        sia->capability_cache_path = get_capability_cache_path();
+        if (sia->capability_cache_path)
+            load_capability_cache(si);
+    }
+
     wakeup_device_poll(sia);
 
     if ((err = soundio_os_thread_create(device_thread_run, si, nullptr, &sia->thread))) {
@@ -1848,6 +4086,22 @@ int soundio_alsa_init(SoundIoPrivate *si) {
         return err;
     }
 
+    if (si->pub.alsa_engine_thread_count > 0) {
+        sia->engine_threads = allocate<SoundIoAlsaEngineThread>(si->pub.alsa_engine_thread_count);
+        if (!sia->engine_threads) {
+            destroy_alsa(si);
+            return SoundIoErrorNoMem;
+        }
+        // count only the threads that destroy_alsa has to clean up
+        while (sia->engine_thread_count < si->pub.alsa_engine_thread_count) {
+            sia->engine_thread_count += 1;
+            if ((err = engine_thread_init(si, &sia->engine_threads[sia->engine_thread_count - 1]))) {
+                destroy_alsa(si);
+                return err;
+            }
+        }
+    }
+
     si->destroy = destroy_alsa;
     si->flush_events = flush_events_alsa;
     si->wait_events = wait_events_alsa;
@@ -1862,6 +4116,8 @@ int soundio_alsa_init(SoundIoPrivate *si) {
     si->outstream_clear_buffer = outstream_clear_buffer_alsa;
     si->outstream_pause = outstream_pause_alsa;
     si->outstream_get_latency = outstream_get_latency_alsa;
+    si->outstream_get_timestamp = outstream_get_timestamp_alsa;
+    si->outstream_drain = outstream_drain_alsa;
 
     si->instream_open = instream_open_alsa;
     si->instream_destroy = instream_destroy_alsa;
@@ -1870,6 +4126,11 @@ int soundio_alsa_init(SoundIoPrivate *si) {
     si->instream_end_read = instream_end_read_alsa;
     si->instream_pause = instream_pause_alsa;
     si->instream_get_latency = instream_get_latency_alsa;
+    si->instream_get_timestamp = instream_get_timestamp_alsa;
+
+    si->duplex_stream_open = duplex_stream_open_alsa;
+    si->duplex_stream_destroy = duplex_stream_destroy_alsa;
+    si->duplex_stream_start = duplex_stream_start_alsa;
 
     return 0;
 }
@@ -17,13 +17,71 @@
 
 int soundio_alsa_init(struct SoundIoPrivate *si);
 
-struct SoundIoDeviceAlsa { };
+struct SoundIoDeviceAlsa {
+    // -1 if the device is not tied to a single card
+    int card_index;
+    // set for devices listed with SoundIo::lazy_probe, so that
+    // soundio_device_probe can add its result to the probe cache
+    char *identity;
+};
 
 #define SOUNDIO_MAX_ALSA_SND_FILE_LEN 16
 struct SoundIoAlsaPendingFile {
     char name[SOUNDIO_MAX_ALSA_SND_FILE_LEN];
 };
 
+// The probed capabilities of a device, reused by later scans for as long as
+// the identity of whatever backs the device stays the same.
+struct SoundIoAlsaProbeCacheEntry {
+    // private copy, never handed out to the API user
+    struct SoundIoDevice *device;
+    char *identity;
+    // found by the scan in progress
+    bool seen;
+    // loaded from the capability cache file and not yet confirmed by probing
+    bool from_disk;
+};
+
+enum SoundIoAlsaEngineStreamState {
+    // waiting for the engine thread to pick it up
+    SoundIoAlsaEngineStreamStatePending,
+    // the engine thread is running the stream's first callbacks
+    SoundIoAlsaEngineStreamStateStarting,
+    // the stream's poll descriptors are in the epoll set
+    SoundIoAlsaEngineStreamStateActive,
+    // the stream's poll descriptors are not in the epoll set
+    SoundIoAlsaEngineStreamStateStopped,
+};
+
+struct SoundIoAlsaEngineThread;
+
+struct SoundIoAlsaEngineStream {
+    struct SoundIoAlsaEngineThread *engine;
+    // exactly one of these is set
+    struct SoundIoOutStreamPrivate *os;
+    struct SoundIoInStreamPrivate *is;
+    // Seconds of audio left in the buffer, measured when the stream is
+    // found ready. Ready streams with less slack are serviced first.
+    double slack;
+    // protected by engine->mutex
+    SoundIoAlsaEngineStreamState state;
+    bool remove_requested;
+    // only touched by the engine thread
+    bool ready;
+};
+
+struct SoundIoAlsaEngineThread {
+    SoundIoOsThread *thread;
+    atomic_flag abort_flag;
+    int epoll_fd;
+    int wakeup_fd;
+    SoundIoOsMutex *mutex;
+    SoundIoOsCond *cond;
+    // protected by mutex. Only modified by the threads starting and
+    // destroying streams, so that the engine thread never allocates.
+    SoundIoList<SoundIoAlsaEngineStream *> streams;
+};
+
 struct SoundIoAlsa {
     SoundIoOsMutex *mutex;
     SoundIoOsCond *cond;
@@ -41,6 +99,26 @@ struct SoundIoAlsa {
 
     int shutdown_err;
     bool emitted_shutdown_cb;
+
+    int engine_thread_count;
+    struct SoundIoAlsaEngineThread *engine_threads;
+
+    // only touched by the device thread
+    SoundIoList<SoundIoAlsaProbeCacheEntry> probe_cache;
+    // the devices of the last scan, and what changed since
+    struct SoundIoDevicesInfo *last_devices_info;
+    SoundIoList<int> changed_cards;
+    bool rescan_all;
+    // NULL unless SoundIo::alsa_capability_cache is set
+    char *capability_cache_path;
+    // probe_cache differs from what the cache file holds
+    bool probe_cache_dirty;
+    bool lazy_probe;
+    // Results of soundio_device_probe, made on the application's thread,
+    // which the device thread moves into probe_cache at its next scan.
+    // Protected by lazy_results_mutex.
+    SoundIoOsMutex *lazy_results_mutex;
+    SoundIoList<SoundIoAlsaProbeCacheEntry> lazy_results;
 };
 
 struct SoundIoOutStreamAlsa {
@@ -51,6 +129,7 @@ struct SoundIoOutStreamAlsa {
     snd_pcm_access_t access;
     snd_pcm_uframes_t buffer_size_frames;
     int sample_buffer_size;
+    int sample_buffer_frames;
     char *sample_buffer;
     int poll_fd_count;
     struct pollfd *poll_fds;
@@ -60,7 +139,41 @@ struct SoundIoOutStreamAlsa {
     int write_frame_count;
     bool is_paused;
     atomic_flag clear_buffer_flag;
+    // cleared by drain; the rest is only touched by the audio thread
+    atomic_flag drain_flag;
+    bool draining;
+    // silence queued behind the last frame written before the drain
+    snd_pcm_uframes_t drain_padding;
     SoundIoChannelArea areas[SOUNDIO_MAX_CHANNELS];
+    SoundIoAlsaEngineStream engine_stream;
+    // clock of the device timestamps
+    clockid_t tstamp_clock;
+    // frames committed with end_write, for SoundIoTimestamp::frame
+    int64_t frames_written;
+
+    // The last entry of poll_fds. Armed to wake the thread at once for
+    // clear_buffer and destroy, and to schedule wakeups with tsched.
+    int timer_fd;
+
+    // frames to keep buffered; the whole buffer unless tsched or adaptive
+    // is on
+    snd_pcm_uframes_t fill_target;
+    snd_pcm_uframes_t fill_target_min;
+    // silence to write ahead of the callback's audio after an xrun
+    snd_pcm_uframes_t preroll_frames;
+
+    // adaptive latency, see SoundIoOutStream::adaptive_latency
+    bool adaptive;
+    double adaptive_window_start;
+    int adaptive_window_xruns;
+    double adaptive_stable_since;
+
+    // timer-based scheduling, see SoundIoOutStream::timer_scheduling.
+    bool tsched;
+    // frames which should be left at a wakeup
+    snd_pcm_uframes_t tsched_watermark;
+    snd_pcm_uframes_t tsched_watermark_min;
+    int tsched_on_time_count;
 };
 
 struct SoundIoInStreamAlsa {
@@ -69,7 +182,9 @@ struct SoundIoInStreamAlsa {
     int chmap_size;
     snd_pcm_uframes_t offset;
     snd_pcm_access_t access;
+    snd_pcm_uframes_t buffer_size_frames;
     int sample_buffer_size;
+    int sample_buffer_frames;
     char *sample_buffer;
     int poll_fd_count;
     struct pollfd *poll_fds;
@@ -79,6 +194,21 @@ struct SoundIoInStreamAlsa {
     int read_frame_count;
     bool is_paused;
     SoundIoChannelArea areas[SOUNDIO_MAX_CHANNELS];
+    SoundIoAlsaEngineStream engine_stream;
+    clockid_t tstamp_clock;
+    int64_t frames_read;
+};
+
+struct SoundIoDuplexStreamAlsa {
+    SoundIoOsThread *thread;
+    atomic_flag thread_exit_flag;
+    bool is_linked;
+    // the output's start threshold before open replaced it
+    bool start_threshold_saved;
+    snd_pcm_uframes_t saved_start_threshold;
+    // silence written to the output before each start, so that one input
+    // period can be captured before the output runs dry
+    snd_pcm_uframes_t prefill_frames;
 };
 
 #endif
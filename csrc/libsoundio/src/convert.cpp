@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libsoundio, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "soundio_private.h"
+
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const float s24_scale = 8388608.0f;
+static const float s24_max = 8388607.0f / 8388608.0f;
+
+static inline int32_t float_to_s24(float x) {
+    // written so that NaN ends up at the top of the range, like minps
+    x = (x < s24_max) ? x : s24_max;
+    x = (x > -1.0f) ? x : -1.0f;
+    return (int32_t)lrintf(x * s24_scale);
+}
+
+static inline void store_s24(char *dest, int32_t value, bool big_endian) {
+    uint8_t *d = (uint8_t *)dest;
+    if (big_endian) {
+        d[0] = (uint8_t)(value >> 16);
+        d[1] = (uint8_t)(value >> 8);
+        d[2] = (uint8_t)value;
+    } else {
+        d[0] = (uint8_t)value;
+        d[1] = (uint8_t)(value >> 8);
+        d[2] = (uint8_t)(value >> 16);
+    }
+}
+
+static inline int32_t load_s24(const char *src, bool big_endian) {
+    const uint8_t *s = (const uint8_t *)src;
+    uint32_t value = big_endian ?
+        ((uint32_t)s[0] << 24) | ((uint32_t)s[1] << 16) | ((uint32_t)s[2] << 8) :
+        ((uint32_t)s[2] << 24) | ((uint32_t)s[1] << 16) | ((uint32_t)s[0] << 8);
+    // sign extend from the top byte
+    return ((int32_t)value) >> 8;
+}
+
+#if defined(__SSE2__)
+// SSE2 is part of x86-64, so these need no runtime check. The packed layout
+// matches the little endian byte order of x86; big endian samples take the
+// scalar path.
+
+// Packs the low 24 bits of each lane into 12 bytes. Writes 14 bytes, so
+// the caller must own 2 bytes past the end.
+static inline void store_s24x4(char *dest, __m128i v) {
+    const __m128i low24 = _mm_set1_epi32(0x00ffffff);
+    const __m128i low32 = _mm_set_epi32(0, -1, 0, -1);
+    v = _mm_and_si128(v, low24);
+    // lanes 0 and 2 stay put, lanes 1 and 3 move down next to them: each
+    // 64-bit half now holds 6 bytes
+    __m128i even = _mm_and_si128(v, low32);
+    __m128i odd = _mm_srli_epi64(v, 32);
+    __m128i packed = _mm_or_si128(even, _mm_slli_epi64(odd, 24));
+    _mm_storel_epi64((__m128i *)dest, packed);
+    _mm_storel_epi64((__m128i *)(dest + 6), _mm_unpackhi_epi64(packed, packed));
+}
+
+// Loads 12 bytes into the upper 24 bits of each lane. Reads 14 bytes, so
+// the caller must own 2 bytes past the end.
+static inline __m128i load_s24x4(const char *src) {
+    const __m128i even_mask = _mm_set_epi32(0, -1, 0, -1);
+    const __m128i odd_mask = _mm_set_epi32(-256, 0, -256, 0);
+    __m128i v = _mm_unpacklo_epi64(
+            _mm_loadl_epi64((const __m128i *)src),
+            _mm_loadl_epi64((const __m128i *)(src + 6)));
+    // samples 0 and 2 start at the bottom of each 64-bit half, samples 1
+    // and 3 start 24 bits up; the shift for the odd ones drags the top
+    // byte of the even ones along
+    __m128i even = _mm_and_si128(_mm_slli_epi32(v, 8), even_mask);
+    __m128i odd = _mm_and_si128(_mm_slli_epi64(v, 16), odd_mask);
+    return _mm_or_si128(even, odd);
+}
+#endif
+
+void soundio_pack_s24_float32(char *dest, enum SoundIoFormat dest_format,
+        const float *src, int sample_count)
+{
+    bool big_endian = (dest_format == SoundIoFormatS24PackedBE);
+    int i = 0;
+#if defined(__SSE2__)
+    if (!big_endian) {
+        const __m128 scale = _mm_set1_ps(s24_scale);
+        const __m128 hi = _mm_set1_ps(s24_max);
+        const __m128 lo = _mm_set1_ps(-1.0f);
+        for (; i + 4 < sample_count; i += 4) {
+            __m128 x = _mm_loadu_ps(src + i);
+            x = _mm_max_ps(_mm_min_ps(x, hi), lo);
+            store_s24x4(dest + i * 3, _mm_cvtps_epi32(_mm_mul_ps(x, scale)));
+        }
+    }
+#endif
+    for (; i < sample_count; i += 1)
+        store_s24(dest + i * 3, float_to_s24(src[i]), big_endian);
+}
+
+void soundio_pack_s24_s32(char *dest, enum SoundIoFormat dest_format,
+        const int32_t *src, int sample_count)
+{
+    bool big_endian = (dest_format == SoundIoFormatS24PackedBE);
+    int i = 0;
+#if defined(__SSE2__)
+    if (!big_endian) {
+        for (; i + 4 < sample_count; i += 4) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+            store_s24x4(dest + i * 3, _mm_srai_epi32(x, 8));
+        }
+    }
+#endif
+    for (; i < sample_count; i += 1)
+        store_s24(dest + i * 3, src[i] >> 8, big_endian);
+}
+
+void soundio_unpack_s24_float32(float *dest, const char *src,
+        enum SoundIoFormat src_format, int sample_count)
+{
+    bool big_endian = (src_format == SoundIoFormatS24PackedBE);
+    int i = 0;
+#if defined(__SSE2__)
+    if (!big_endian) {
+        const __m128 scale = _mm_set1_ps(1.0f / s24_scale);
+        for (; i + 4 < sample_count; i += 4) {
+            __m128i x = _mm_srai_epi32(load_s24x4(src + i * 3), 8);
+            _mm_storeu_ps(dest + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+        }
+    }
+#endif
+    for (; i < sample_count; i += 1)
+        dest[i] = load_s24(src + i * 3, big_endian) * (1.0f / s24_scale);
+}
+
+void soundio_unpack_s24_s32(int32_t *dest, const char *src,
+        enum SoundIoFormat src_format, int sample_count)
+{
+    bool big_endian = (src_format == SoundIoFormatS24PackedBE);
+    int i = 0;
+#if defined(__SSE2__)
+    if (!big_endian) {
+        for (; i + 4 < sample_count; i += 4)
+            _mm_storeu_si128((__m128i *)(dest + i), load_s24x4(src + i * 3));
+    }
+#endif
+    for (; i < sample_count; i += 1)
+        dest[i] = load_s24(src + i * 3, big_endian) * 256;
+}
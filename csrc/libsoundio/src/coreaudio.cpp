@@ -583,7 +583,7 @@ static int refresh_devices(struct SoundIoPrivate *si) {
             dca->device_id = device_id;
             assert(!rd.device);
             rd.device = &dev->pub;
-            rd.device->ref_count = 1;
+            dev->ref_count.store(1);
             rd.device->soundio = soundio;
             rd.device->is_raw = false;
             rd.device->aim = aim;
@@ -774,7 +774,6 @@ static int refresh_devices(struct SoundIoPrivate *si) {
 }
 
 static void shutdown_backend(SoundIoPrivate *si, int err) {
-    SoundIo *soundio = &si->pub;
     SoundIoCoreAudio *sica = &si->backend_data.coreaudio;
     soundio_os_mutex_lock(sica->mutex);
     sica->shutdown_err = err;
@@ -782,7 +781,7 @@ static void shutdown_backend(SoundIoPrivate *si, int err) {
     soundio_os_mutex_unlock(sica->mutex);
     soundio_os_cond_signal(sica->cond, nullptr);
     soundio_os_cond_signal(sica->have_devices_cond, nullptr);
-    soundio->on_events_signal(soundio);
+    soundio_signal_events(si);
 }
 
 static void flush_events_ca(struct SoundIoPrivate *si) {
@@ -838,7 +837,6 @@ static void force_device_scan_ca(struct SoundIoPrivate *si) {
 
 static void device_thread_run(void *arg) {
     SoundIoPrivate *si = (SoundIoPrivate *)arg;
-    SoundIo *soundio = &si->pub;
     SoundIoCoreAudio *sica = &si->backend_data.coreaudio;
     int err;
 
@@ -858,7 +856,7 @@ static void device_thread_run(void *arg) {
             if (!sica->have_devices_flag.exchange(true))
                 soundio_os_cond_signal(sica->have_devices_cond, nullptr);
             soundio_os_cond_signal(sica->cond, nullptr);
-            soundio->on_events_signal(soundio);
+            soundio_signal_events(si);
         }
         soundio_os_cond_wait(sica->scan_devices_cond, nullptr);
     }
@@ -868,8 +866,7 @@ static OSStatus on_outstream_device_overload(AudioObjectID in_object_id, UInt32
     const AudioObjectPropertyAddress in_addresses[], void *in_client_data)
 {
     SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)in_client_data;
-    SoundIoOutStream *outstream = &os->pub;
-    outstream->underflow_callback(outstream);
+    soundio_outstream_run_underflow_callback(os);
     return noErr;
 }
 
@@ -898,13 +895,14 @@ static OSStatus write_callback_ca(void *userdata, AudioUnitRenderActionFlags *io
     AudioBufferList *io_data)
 {
     SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *) userdata;
-    SoundIoOutStream *outstream = &os->pub;
     SoundIoOutStreamCoreAudio *osca = &os->backend_data.coreaudio;
 
+    soundio_os_mark_rt_thread();
+
     osca->io_data = io_data;
     osca->buffer_index = 0;
     osca->frames_left = in_number_frames;
-    outstream->write_callback(outstream, osca->frames_left, osca->frames_left);
+    soundio_outstream_run_write_callback(os, osca->frames_left, osca->frames_left);
     osca->io_data = nullptr;
 
     return noErr;
@@ -917,6 +915,11 @@ static int outstream_open_ca(struct SoundIoPrivate *si, struct SoundIoOutStreamP
     SoundIoDevicePrivate *dev = (SoundIoDevicePrivate *)device;
     SoundIoDeviceCoreAudio *dca = &dev->backend_data.coreaudio;
 
+    // the areas always point into the audio unit's buffer list
+    if (outstream->access_mode == SoundIoAccessModeCopy)
+        return SoundIoErrorIncompatibleDevice;
+    outstream->access_mode = SoundIoAccessModeDirect;
+
     if (outstream->software_latency == 0.0)
         outstream->software_latency = device->software_latency_current;
 
@@ -1076,8 +1079,7 @@ static OSStatus on_instream_device_overload(AudioObjectID in_object_id, UInt32 i
     const AudioObjectPropertyAddress in_addresses[], void *in_client_data)
 {
     SoundIoInStreamPrivate *os = (SoundIoInStreamPrivate *)in_client_data;
-    SoundIoInStream *instream = &os->pub;
-    instream->overflow_callback(instream);
+    soundio_instream_run_overflow_callback(os);
     return noErr;
 }
 
@@ -1111,6 +1113,8 @@ static OSStatus read_callback_ca(void *userdata, AudioUnitRenderActionFlags *io_
     SoundIoInStream *instream = &is->pub;
     SoundIoInStreamCoreAudio *isca = &is->backend_data.coreaudio;
 
+    soundio_os_mark_rt_thread();
+
     for (int i = 0; i < isca->buffer_list->mNumberBuffers; i += 1) {
         isca->buffer_list->mBuffers[i].mData = nullptr;
     }
@@ -1142,7 +1146,7 @@ static OSStatus read_callback_ca(void *userdata, AudioUnitRenderActionFlags *io_
     }
 
     isca->frames_left = in_number_frames;
-    instream->read_callback(instream, isca->frames_left, isca->frames_left);
+    soundio_instream_run_read_callback(is, isca->frames_left, isca->frames_left);
 
     return noErr;
 }
@@ -1156,6 +1160,11 @@ static int instream_open_ca(struct SoundIoPrivate *si, struct SoundIoInStreamPri
     UInt32 io_size;
     OSStatus os_err;
 
+    // the areas always point into the audio unit's buffer list
+    if (instream->access_mode == SoundIoAccessModeCopy)
+        return SoundIoErrorIncompatibleDevice;
+    instream->access_mode = SoundIoAccessModeDirect;
+
     if (instream->software_latency == 0.0)
         instream->software_latency = device->software_latency_current;
 
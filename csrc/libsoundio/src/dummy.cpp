@@ -11,62 +11,104 @@
 #include <stdio.h>
 #include <string.h>
 
+// Blocks while the stream is paused. Returns false when the thread should exit.
+static bool wait_while_paused(SoundIoOsMutex *mutex, SoundIoOsCond *cond,
+        atomic_flag *abort_flag, atomic_bool *paused)
+{
+    soundio_os_mutex_lock(mutex);
+    for (;;) {
+        if (!abort_flag->test_and_set()) {
+            soundio_os_mutex_unlock(mutex);
+            return false;
+        }
+        if (!paused->load())
+            break;
+        soundio_os_cond_wait(cond, mutex);
+    }
+    soundio_os_mutex_unlock(mutex);
+    return true;
+}
+
+static void wait_for_period(SoundIoOsMutex *mutex, SoundIoOsCond *cond,
+        atomic_bool *paused, double seconds)
+{
+    soundio_os_mutex_lock(mutex);
+    if (!paused->load())
+        soundio_os_cond_timed_wait(cond, mutex, seconds);
+    soundio_os_mutex_unlock(mutex);
+}
+
 static void playback_thread_run(void *arg) {
     SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)arg;
     SoundIoOutStream *outstream = &os->pub;
     SoundIoOutStreamDummy *osd = &os->backend_data.dummy;
 
-    int fill_bytes = soundio_ring_buffer_fill_count(&osd->ring_buffer);
-    int free_bytes = soundio_ring_buffer_capacity(&osd->ring_buffer) - fill_bytes;
-    int free_frames = free_bytes / outstream->bytes_per_frame;
-    osd->frames_left = free_frames;
-    if (free_frames > 0)
-        outstream->write_callback(outstream, 0, free_frames);
-    double start_time = soundio_os_get_time();
-    long frames_consumed = 0;
-
-    while (osd->abort_flag.test_and_set()) {
-        double now = soundio_os_get_time();
-        double time_passed = now - start_time;
-        double next_period = start_time +
-            ceil_dbl(time_passed / osd->period_duration) * osd->period_duration;
-        double relative_time = next_period - now;
-        soundio_os_cond_timed_wait(osd->cond, nullptr, relative_time);
-        if (!osd->clear_buffer_flag.test_and_set()) {
-            soundio_ring_buffer_clear(&osd->ring_buffer);
-            int free_bytes = soundio_ring_buffer_capacity(&osd->ring_buffer);
-            int free_frames = free_bytes / outstream->bytes_per_frame;
-            osd->frames_left = free_frames;
-            if (free_frames > 0)
-                outstream->write_callback(outstream, 0, free_frames);
-            frames_consumed = 0;
-            start_time = soundio_os_get_time();
-            continue;
-        }
-
+    while (wait_while_paused(osd->mutex, osd->cond, &osd->abort_flag, &osd->paused)) {
         int fill_bytes = soundio_ring_buffer_fill_count(&osd->ring_buffer);
-        int fill_frames = fill_bytes / outstream->bytes_per_frame;
         int free_bytes = soundio_ring_buffer_capacity(&osd->ring_buffer) - fill_bytes;
         int free_frames = free_bytes / outstream->bytes_per_frame;
+        osd->frames_left = free_frames;
+        if (free_frames > 0 && !osd->draining)
+            soundio_outstream_run_write_callback(os, 0, free_frames);
+        double start_time = soundio_os_get_time();
+        long frames_consumed = 0;
+
+        for (;;) {
+            double now = soundio_os_get_time();
+            double time_passed = now - start_time;
+            double next_period = start_time +
+                ceil_dbl(time_passed / osd->period_duration) * osd->period_duration;
+            double relative_time = next_period - now;
+            wait_for_period(osd->mutex, osd->cond, &osd->paused, relative_time);
+            if (!osd->abort_flag.test_and_set())
+                return;
+            if (osd->paused.load())
+                break;
+            if (!osd->drain_flag.test_and_set())
+                osd->draining = true;
+            if (!osd->clear_buffer_flag.test_and_set()) {
+                soundio_ring_buffer_clear(&osd->ring_buffer);
+                int free_bytes = soundio_ring_buffer_capacity(&osd->ring_buffer);
+                int free_frames = free_bytes / outstream->bytes_per_frame;
+                osd->frames_left = free_frames;
+                if (free_frames > 0 && !osd->draining)
+                    soundio_outstream_run_write_callback(os, 0, free_frames);
+                frames_consumed = 0;
+                start_time = soundio_os_get_time();
+                continue;
+            }
 
-        double total_time = soundio_os_get_time() - start_time;
-        long total_frames = total_time * outstream->sample_rate;
-        int frames_to_kill = total_frames - frames_consumed;
-        int read_count = min(frames_to_kill, fill_frames);
-        int byte_count = read_count * outstream->bytes_per_frame;
-        soundio_ring_buffer_advance_read_ptr(&osd->ring_buffer, byte_count);
-        frames_consumed += read_count;
-
-        if (frames_to_kill > fill_frames) {
-            outstream->underflow_callback(outstream);
-            osd->frames_left = free_frames;
-            if (free_frames > 0)
-                outstream->write_callback(outstream, 0, free_frames);
-            frames_consumed = 0;
-            start_time = soundio_os_get_time();
-        } else if (free_frames > 0) {
-            osd->frames_left = free_frames;
-            outstream->write_callback(outstream, 0, free_frames);
+            int fill_bytes = soundio_ring_buffer_fill_count(&osd->ring_buffer);
+            int fill_frames = fill_bytes / outstream->bytes_per_frame;
+            int free_bytes = soundio_ring_buffer_capacity(&osd->ring_buffer) - fill_bytes;
+            int free_frames = free_bytes / outstream->bytes_per_frame;
+
+            double total_time = soundio_os_get_time() - start_time;
+            long total_frames = total_time * outstream->sample_rate;
+            int frames_to_kill = total_frames - frames_consumed;
+            int read_count = min(frames_to_kill, fill_frames);
+            int byte_count = read_count * outstream->bytes_per_frame;
+            soundio_ring_buffer_advance_read_ptr(&osd->ring_buffer, byte_count);
+            frames_consumed += read_count;
+
+            if (osd->draining) {
+                // nothing more will be written; the stream is done once the
+                // ring buffer has played out
+                if (frames_to_kill >= fill_frames) {
+                    soundio_outstream_report_drained(os);
+                    return;
+                }
+            } else if (frames_to_kill > fill_frames) {
+                soundio_outstream_run_underflow_callback(os);
+                osd->frames_left = free_frames;
+                if (free_frames > 0)
+                    soundio_outstream_run_write_callback(os, 0, free_frames);
+                frames_consumed = 0;
+                start_time = soundio_os_get_time();
+            } else if (free_frames > 0) {
+                osd->frames_left = free_frames;
+                soundio_outstream_run_write_callback(os, 0, free_frames);
+            }
         }
     }
 }
@@ -76,37 +118,43 @@ static void capture_thread_run(void *arg) {
     SoundIoInStream *instream = &is->pub;
     SoundIoInStreamDummy *isd = &is->backend_data.dummy;
 
-    long frames_consumed = 0;
-    double start_time = soundio_os_get_time();
-    while (isd->abort_flag.test_and_set()) {
-        double now = soundio_os_get_time();
-        double time_passed = now - start_time;
-        double next_period = start_time +
-            ceil_dbl(time_passed / isd->period_duration) * isd->period_duration;
-        double relative_time = next_period - now;
-        soundio_os_cond_timed_wait(isd->cond, nullptr, relative_time);
-
-        int fill_bytes = soundio_ring_buffer_fill_count(&isd->ring_buffer);
-        int free_bytes = soundio_ring_buffer_capacity(&isd->ring_buffer) - fill_bytes;
-        int fill_frames = fill_bytes / instream->bytes_per_frame;
-        int free_frames = free_bytes / instream->bytes_per_frame;
-
-        double total_time = soundio_os_get_time() - start_time;
-        long total_frames = total_time * instream->sample_rate;
-        int frames_to_kill = total_frames - frames_consumed;
-        int write_count = min(frames_to_kill, free_frames);
-        int byte_count = write_count * instream->bytes_per_frame;
-        soundio_ring_buffer_advance_write_ptr(&isd->ring_buffer, byte_count);
-        frames_consumed += write_count;
-
-        if (frames_to_kill > free_frames) {
-            instream->overflow_callback(instream);
-            frames_consumed = 0;
-            start_time = soundio_os_get_time();
-        }
-        if (fill_frames > 0) {
-            isd->frames_left = fill_frames;
-            instream->read_callback(instream, 0, fill_frames);
+    while (wait_while_paused(isd->mutex, isd->cond, &isd->abort_flag, &isd->paused)) {
+        long frames_consumed = 0;
+        double start_time = soundio_os_get_time();
+        for (;;) {
+            double now = soundio_os_get_time();
+            double time_passed = now - start_time;
+            double next_period = start_time +
+                ceil_dbl(time_passed / isd->period_duration) * isd->period_duration;
+            double relative_time = next_period - now;
+            wait_for_period(isd->mutex, isd->cond, &isd->paused, relative_time);
+            if (!isd->abort_flag.test_and_set())
+                return;
+            if (isd->paused.load())
+                break;
+
+            int fill_bytes = soundio_ring_buffer_fill_count(&isd->ring_buffer);
+            int free_bytes = soundio_ring_buffer_capacity(&isd->ring_buffer) - fill_bytes;
+            int fill_frames = fill_bytes / instream->bytes_per_frame;
+            int free_frames = free_bytes / instream->bytes_per_frame;
+
+            double total_time = soundio_os_get_time() - start_time;
+            long total_frames = total_time * instream->sample_rate;
+            int frames_to_kill = total_frames - frames_consumed;
+            int write_count = min(frames_to_kill, free_frames);
+            int byte_count = write_count * instream->bytes_per_frame;
+            soundio_ring_buffer_advance_write_ptr(&isd->ring_buffer, byte_count);
+            frames_consumed += write_count;
+
+            if (frames_to_kill > free_frames) {
+                soundio_instream_run_overflow_callback(is);
+                frames_consumed = 0;
+                start_time = soundio_os_get_time();
+            }
+            if (fill_frames > 0) {
+                isd->frames_left = fill_frames;
+                soundio_instream_run_read_callback(is, 0, fill_frames);
+            }
         }
     }
 }
@@ -150,14 +198,23 @@ static void outstream_destroy_dummy(SoundIoPrivate *si, SoundIoOutStreamPrivate
 
     if (osd->thread) {
         osd->abort_flag.clear();
-        soundio_os_cond_signal(osd->cond, nullptr);
+        soundio_os_mutex_lock(osd->mutex);
+        soundio_os_cond_signal(osd->cond, osd->mutex);
+        soundio_os_mutex_unlock(osd->mutex);
         soundio_os_thread_destroy(osd->thread);
         osd->thread = nullptr;
     }
-    soundio_os_cond_destroy(osd->cond);
+    if (osd->cond)
+        soundio_os_cond_destroy(osd->cond);
     osd->cond = nullptr;
 
-    soundio_ring_buffer_deinit(&osd->ring_buffer);
+    if (osd->mutex)
+        soundio_os_mutex_destroy(osd->mutex);
+    osd->mutex = nullptr;
+
+    // open can fail before the ring buffer is set up
+    if (osd->ring_buffer.mem.address)
+        soundio_ring_buffer_deinit(&osd->ring_buffer);
 }
 
 static int outstream_open_dummy(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
@@ -165,7 +222,14 @@ static int outstream_open_dummy(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
     SoundIoOutStream *outstream = &os->pub;
     SoundIoDevice *device = outstream->device;
 
+    // the areas always point into the stream's ring buffer
+    if (outstream->access_mode == SoundIoAccessModeCopy)
+        return SoundIoErrorIncompatibleDevice;
+    outstream->access_mode = SoundIoAccessModeDirect;
+
     osd->clear_buffer_flag.test_and_set();
+    osd->drain_flag.test_and_set();
+    osd->draining = false;
 
     if (outstream->software_latency == 0.0)
         outstream->software_latency = clamp(device->software_latency_min, 1.0, device->software_latency_max);
@@ -180,8 +244,15 @@ static int outstream_open_dummy(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
     }
     int actual_capacity = soundio_ring_buffer_capacity(&osd->ring_buffer);
     osd->buffer_frame_count = actual_capacity / outstream->bytes_per_frame;
+    os->watchdog.buffer_frames = osd->buffer_frame_count;
     outstream->software_latency = osd->buffer_frame_count / (double) outstream->sample_rate;
 
+    osd->mutex = soundio_os_mutex_create_pi();
+    if (!osd->mutex) {
+        outstream_destroy_dummy(si, os);
+        return SoundIoErrorNoMem;
+    }
+
     osd->cond = soundio_os_cond_create();
     if (!osd->cond) {
         outstream_destroy_dummy(si, os);
@@ -194,22 +265,19 @@ static int outstream_open_dummy(SoundIoPrivate *si, SoundIoOutStreamPrivate *os)
 static int outstream_pause_dummy(struct SoundIoPrivate *si, struct SoundIoOutStreamPrivate *os, bool pause) {
     SoundIoOutStreamDummy *osd = &os->backend_data.dummy;
     SoundIo *soundio = &si->pub;
-    if (pause) {
-        if (osd->thread) {
-            osd->abort_flag.clear();
-            soundio_os_cond_signal(osd->cond, nullptr);
-            soundio_os_thread_destroy(osd->thread);
-            osd->thread = nullptr;
-        }
-    } else {
-        if (!osd->thread) {
-            osd->abort_flag.test_and_set();
-            int err;
-            if ((err = soundio_os_thread_create(playback_thread_run, os,
-                            soundio->emit_rtprio_warning, &osd->thread)))
-            {
-                return err;
-            }
+    // The thread is created once and parked while paused so that unpausing
+    // is a single wakeup instead of a thread creation.
+    soundio_os_mutex_lock(osd->mutex);
+    osd->paused.store(pause);
+    soundio_os_cond_signal(osd->cond, osd->mutex);
+    soundio_os_mutex_unlock(osd->mutex);
+    if (!pause && !osd->thread) {
+        osd->abort_flag.test_and_set();
+        int err;
+        if ((err = soundio_os_thread_create(playback_thread_run, os,
+                        soundio->emit_rtprio_warning, &osd->thread)))
+        {
+            return err;
         }
     }
     return 0;
@@ -251,7 +319,18 @@ static int outstream_end_write_dummy(SoundIoPrivate *si, SoundIoOutStreamPrivate
 static int outstream_clear_buffer_dummy(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
     SoundIoOutStreamDummy *osd = &os->backend_data.dummy;
     osd->clear_buffer_flag.clear();
-    soundio_os_cond_signal(osd->cond, nullptr);
+    soundio_os_mutex_lock(osd->mutex);
+    soundio_os_cond_signal(osd->cond, osd->mutex);
+    soundio_os_mutex_unlock(osd->mutex);
+    return 0;
+}
+
+static int outstream_drain_dummy(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
+    SoundIoOutStreamDummy *osd = &os->backend_data.dummy;
+    osd->drain_flag.clear();
+    soundio_os_mutex_lock(osd->mutex);
+    soundio_os_cond_signal(osd->cond, osd->mutex);
+    soundio_os_mutex_unlock(osd->mutex);
     return 0;
 }
 
@@ -269,14 +348,23 @@ static void instream_destroy_dummy(SoundIoPrivate *si, SoundIoInStreamPrivate *i
 
     if (isd->thread) {
         isd->abort_flag.clear();
-        soundio_os_cond_signal(isd->cond, nullptr);
+        soundio_os_mutex_lock(isd->mutex);
+        soundio_os_cond_signal(isd->cond, isd->mutex);
+        soundio_os_mutex_unlock(isd->mutex);
         soundio_os_thread_destroy(isd->thread);
         isd->thread = nullptr;
     }
-    soundio_os_cond_destroy(isd->cond);
+    if (isd->cond)
+        soundio_os_cond_destroy(isd->cond);
     isd->cond = nullptr;
 
-    soundio_ring_buffer_deinit(&isd->ring_buffer);
+    if (isd->mutex)
+        soundio_os_mutex_destroy(isd->mutex);
+    isd->mutex = nullptr;
+
+    // open can fail before the ring buffer is set up
+    if (isd->ring_buffer.mem.address)
+        soundio_ring_buffer_deinit(&isd->ring_buffer);
 }
 
 static int instream_open_dummy(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
@@ -284,6 +372,10 @@ static int instream_open_dummy(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     SoundIoInStream *instream = &is->pub;
     SoundIoDevice *device = instream->device;
 
+    // the areas always point into the stream's ring buffer
+    if (instream->access_mode == SoundIoAccessModeCopy)
+        return SoundIoErrorIncompatibleDevice;
+    instream->access_mode = SoundIoAccessModeDirect;
 
     if (instream->software_latency == 0.0)
         instream->software_latency = clamp(device->software_latency_min, 1.0, device->software_latency_max);
@@ -301,6 +393,13 @@ static int instream_open_dummy(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
 
     int actual_capacity = soundio_ring_buffer_capacity(&isd->ring_buffer);
     isd->buffer_frame_count = actual_capacity / instream->bytes_per_frame;
+    is->watchdog.buffer_frames = isd->buffer_frame_count;
+
+    isd->mutex = soundio_os_mutex_create_pi();
+    if (!isd->mutex) {
+        instream_destroy_dummy(si, is);
+        return SoundIoErrorNoMem;
+    }
 
     isd->cond = soundio_os_cond_create();
     if (!isd->cond) {
@@ -314,22 +413,18 @@ static int instream_open_dummy(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
 static int instream_pause_dummy(SoundIoPrivate *si, SoundIoInStreamPrivate *is, bool pause) {
     SoundIoInStreamDummy *isd = &is->backend_data.dummy;
     SoundIo *soundio = &si->pub;
-    if (pause) {
-        if (isd->thread) {
-            isd->abort_flag.clear();
-            soundio_os_cond_signal(isd->cond, nullptr);
-            soundio_os_thread_destroy(isd->thread);
-            isd->thread = nullptr;
-        }
-    } else {
-        if (!isd->thread) {
-            isd->abort_flag.test_and_set();
-            int err;
-            if ((err = soundio_os_thread_create(capture_thread_run, is,
-                            soundio->emit_rtprio_warning, &isd->thread)))
-            {
-                return err;
-            }
+    // See outstream_pause_dummy.
+    soundio_os_mutex_lock(isd->mutex);
+    isd->paused.store(pause);
+    soundio_os_cond_signal(isd->cond, isd->mutex);
+    soundio_os_mutex_unlock(isd->mutex);
+    if (!pause && !isd->thread) {
+        isd->abort_flag.test_and_set();
+        int err;
+        if ((err = soundio_os_thread_create(capture_thread_run, is,
+                        soundio->emit_rtprio_warning, &isd->thread)))
+        {
+            return err;
         }
     }
     return 0;
@@ -378,7 +473,7 @@ static int instream_get_latency_dummy(SoundIoPrivate *si, SoundIoInStreamPrivate
 }
 
 static int set_all_device_formats(SoundIoDevice *device) {
-    device->format_count = 18;
+    device->format_count = 20;
     device->formats = allocate<SoundIoFormat>(device->format_count);
     if (!device->formats)
         return SoundIoErrorNoMem;
@@ -393,14 +488,16 @@ static int set_all_device_formats(SoundIoDevice *device) {
     device->formats[7] = SoundIoFormatS24FE;
     device->formats[8] = SoundIoFormatU24NE;
     device->formats[9] = SoundIoFormatU24FE;
-    device->formats[10] = SoundIoFormatFloat64NE;
-    device->formats[11] = SoundIoFormatFloat64FE;
-    device->formats[12] = SoundIoFormatS16NE;
-    device->formats[13] = SoundIoFormatS16FE;
-    device->formats[14] = SoundIoFormatU16NE;
-    device->formats[15] = SoundIoFormatU16FE;
-    device->formats[16] = SoundIoFormatS8;
-    device->formats[17] = SoundIoFormatU8;
+    device->formats[10] = SoundIoFormatS24PackedNE;
+    device->formats[11] = SoundIoFormatS24PackedFE;
+    device->formats[12] = SoundIoFormatFloat64NE;
+    device->formats[13] = SoundIoFormatFloat64FE;
+    device->formats[14] = SoundIoFormatS16NE;
+    device->formats[15] = SoundIoFormatS16FE;
+    device->formats[16] = SoundIoFormatU16NE;
+    device->formats[17] = SoundIoFormatU16FE;
+    device->formats[18] = SoundIoFormatS8;
+    device->formats[19] = SoundIoFormatU8;
 
     return 0;
 }
@@ -458,7 +555,7 @@ int soundio_dummy_init(SoundIoPrivate *si) {
         }
         SoundIoDevice *device = &dev->pub;
 
-        device->ref_count = 1;
+        dev->ref_count.store(1);
         device->soundio = soundio;
         device->id = strdup("dummy-out");
         device->name = strdup("Dummy Output Device");
@@ -504,7 +601,7 @@ int soundio_dummy_init(SoundIoPrivate *si) {
         }
         SoundIoDevice *device = &dev->pub;
 
-        device->ref_count = 1;
+        dev->ref_count.store(1);
         device->soundio = soundio;
         device->id = strdup("dummy-in");
         device->name = strdup("Dummy Input Device");
@@ -553,6 +650,7 @@ int soundio_dummy_init(SoundIoPrivate *si) {
     si->outstream_begin_write = outstream_begin_write_dummy;
     si->outstream_end_write = outstream_end_write_dummy;
     si->outstream_clear_buffer = outstream_clear_buffer_dummy;
+    si->outstream_drain = outstream_drain_dummy;
     si->outstream_pause = outstream_pause_dummy;
     si->outstream_get_latency = outstream_get_latency_dummy;
 
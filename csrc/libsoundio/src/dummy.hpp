@@ -25,8 +25,11 @@ struct SoundIoDeviceDummy { };
 
 struct SoundIoOutStreamDummy {
     struct SoundIoOsThread *thread;
+    struct SoundIoOsMutex *mutex;
     struct SoundIoOsCond *cond;
     atomic_flag abort_flag;
+    // the thread stays alive while paused, waiting on cond
+    atomic_bool paused;
     double period_duration;
     int buffer_frame_count;
     int frames_left;
@@ -34,13 +37,18 @@ struct SoundIoOutStreamDummy {
     struct SoundIoRingBuffer ring_buffer;
     double playback_start_time;
     atomic_flag clear_buffer_flag;
+    atomic_flag drain_flag;
+    bool draining;
     SoundIoChannelArea areas[SOUNDIO_MAX_CHANNELS];
 };
 
 struct SoundIoInStreamDummy {
     struct SoundIoOsThread *thread;
+    struct SoundIoOsMutex *mutex;
     struct SoundIoOsCond *cond;
     atomic_flag abort_flag;
+    // the thread stays alive while paused, waiting on cond
+    atomic_bool paused;
     double period_duration;
     int frames_left;
     int read_frame_count;
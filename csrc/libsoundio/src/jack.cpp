@@ -179,7 +179,7 @@ static int refresh_devices_bare(SoundIoPrivate *si) {
 
         dev->destruct = destruct_device;
 
-        device->ref_count = 1;
+        dev->ref_count.store(1);
         device->soundio = soundio;
         device->is_raw = false;
         device->aim = client->aim;
@@ -339,12 +339,11 @@ static void wakeup_jack(struct SoundIoPrivate *si) {
 }
 
 static void force_device_scan_jack(struct SoundIoPrivate *si) {
-    SoundIo *soundio = &si->pub;
     SoundIoJack *sij = &si->backend_data.jack;
     sij->refresh_devices_flag.clear();
     soundio_os_mutex_lock(sij->mutex);
     soundio_os_cond_signal(sij->cond, sij->mutex);
-    soundio->on_events_signal(soundio);
+    soundio_signal_events(si);
     soundio_os_mutex_unlock(sij->mutex);
 }
 
@@ -352,13 +351,14 @@ static int outstream_process_callback(jack_nframes_t nframes, void *arg) {
     SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)arg;
     SoundIoOutStreamJack *osj = &os->backend_data.jack;
     SoundIoOutStream *outstream = &os->pub;
+    soundio_os_mark_rt_thread();
     osj->frames_left = nframes;
     for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
         SoundIoOutStreamJackPort *osjp = &osj->ports[ch];
         osj->areas[ch].ptr = (char*)jack_port_get_buffer(osjp->source_port, nframes);
         osj->areas[ch].step = outstream->bytes_per_sample;
     }
-    outstream->write_callback(outstream, osj->frames_left, osj->frames_left);
+    soundio_outstream_run_write_callback(os, osj->frames_left, osj->frames_left);
     return 0;
 }
 
@@ -383,8 +383,7 @@ static SoundIoDeviceJackPort *find_port_matching_channel(SoundIoDevice *device,
 
 static int outstream_xrun_callback(void *arg) {
     SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)arg;
-    SoundIoOutStream *outstream = &os->pub;
-    outstream->underflow_callback(outstream);
+    soundio_outstream_run_underflow_callback(os);
     return 0;
 }
 
@@ -427,6 +426,11 @@ static int outstream_open_jack(struct SoundIoPrivate *si, struct SoundIoOutStrea
 
     osj->is_paused = true;
 
+    // the areas always point into the port buffers
+    if (outstream->access_mode == SoundIoAccessModeCopy)
+        return SoundIoErrorIncompatibleDevice;
+    outstream->access_mode = SoundIoAccessModeDirect;
+
     if (sij->is_shutdown)
         return SoundIoErrorBackendDisconnected;
 
@@ -595,8 +599,7 @@ static void instream_destroy_jack(struct SoundIoPrivate *si, struct SoundIoInStr
 
 static int instream_xrun_callback(void *arg) {
     SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *)arg;
-    SoundIoInStream *instream = &is->pub;
-    instream->overflow_callback(instream);
+    soundio_instream_run_overflow_callback(is);
     return 0;
 }
 
@@ -634,13 +637,14 @@ static int instream_process_callback(jack_nframes_t nframes, void *arg) {
     SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *)arg;
     SoundIoInStream *instream = &is->pub;
     SoundIoInStreamJack *isj = &is->backend_data.jack;
+    soundio_os_mark_rt_thread();
     isj->frames_left = nframes;
     for (int ch = 0; ch < instream->layout.channel_count; ch += 1) {
         SoundIoInStreamJackPort *isjp = &isj->ports[ch];
         isj->areas[ch].ptr = (char*)jack_port_get_buffer(isjp->dest_port, nframes);
         isj->areas[ch].step = instream->bytes_per_sample;
     }
-    instream->read_callback(instream, isj->frames_left, isj->frames_left);
+    soundio_instream_run_read_callback(is, isj->frames_left, isj->frames_left);
     return 0;
 }
 
@@ -652,6 +656,11 @@ static int instream_open_jack(struct SoundIoPrivate *si, struct SoundIoInStreamP
     SoundIoDevicePrivate *dev = (SoundIoDevicePrivate *)device;
     SoundIoDeviceJack *dj = &dev->backend_data.jack;
 
+    // the areas always point into the port buffers
+    if (instream->access_mode == SoundIoAccessModeCopy)
+        return SoundIoErrorIncompatibleDevice;
+    instream->access_mode = SoundIoAccessModeDirect;
+
     if (sij->is_shutdown)
         return SoundIoErrorBackendDisconnected;
 
@@ -801,12 +810,11 @@ static int instream_get_latency_jack(struct SoundIoPrivate *si, struct SoundIoIn
 }
 
 static void notify_devices_change(SoundIoPrivate *si) {
-    SoundIo *soundio = &si->pub;
     SoundIoJack *sij = &si->backend_data.jack;
     sij->refresh_devices_flag.clear();
     soundio_os_mutex_lock(sij->mutex);
     soundio_os_cond_signal(sij->cond, sij->mutex);
-    soundio->on_events_signal(soundio);
+    soundio_signal_events(si);
     soundio_os_mutex_unlock(sij->mutex);
 }
 
@@ -840,12 +848,11 @@ static void port_rename_calllback(jack_port_id_t port_id,
 
 static void shutdown_callback(void *arg) {
     SoundIoPrivate *si = (SoundIoPrivate *)arg;
-    SoundIo *soundio = &si->pub;
     SoundIoJack *sij = &si->backend_data.jack;
     soundio_os_mutex_lock(sij->mutex);
     sij->is_shutdown = true;
     soundio_os_cond_signal(sij->cond, sij->mutex);
-    soundio->on_events_signal(soundio);
+    soundio_signal_events(si);
     soundio_os_mutex_unlock(sij->mutex);
 }
 
@@ -862,19 +869,63 @@ static void destroy_jack(SoundIoPrivate *si) {
         soundio_os_mutex_destroy(sij->mutex);
 }
 
+static void set_message_callbacks(void (*info_callback)(const char *),
+        void (*error_callback)(const char *))
+{
+    if (!global_msg_callback_flag.test_and_set()) {
+        if (error_callback)
+            jack_set_error_function(error_callback);
+        if (info_callback)
+            jack_set_info_function(info_callback);
+        global_msg_callback_flag.clear();
+    }
+}
+
+static jack_client_t *open_client(const char *app_name, int *out_err) {
+    // We pass JackNoStartServer due to
+    // https://github.com/jackaudio/jack2/issues/138
+    jack_status_t status;
+    jack_client_t *client = jack_client_open(app_name, JackNoStartServer, &status);
+    if (!client) {
+        assert(!(status & JackInvalidOption));
+        if (status & JackShmFailure)
+            *out_err = SoundIoErrorSystemResources;
+        else if (status & JackNoSuchClient)
+            *out_err = SoundIoErrorNoSuchClient;
+        else
+            *out_err = SoundIoErrorInitAudioBackend;
+    }
+    return client;
+}
+
+static void close_client(void *client) {
+    jack_client_close((jack_client_t *)client);
+}
+
+int soundio_jack_probe(SoundIoConnectProbe *probe) {
+    set_message_callbacks(probe->jack_info_callback, probe->jack_error_callback);
+
+    // jack_client_open cannot be cut short, so the client is handed to
+    // soundio_jack_init rather than opened a second time
+    int err;
+    jack_client_t *client = open_client(probe->app_name, &err);
+    if (!client)
+        return err;
+    probe->handoff = client;
+    probe->release_handoff = close_client;
+    return 0;
+}
+
 int soundio_jack_init(struct SoundIoPrivate *si) {
     SoundIoJack *sij = &si->backend_data.jack;
     SoundIo *soundio = &si->pub;
 
-    if (!global_msg_callback_flag.test_and_set()) {
-        if (soundio->jack_error_callback)
-            jack_set_error_function(soundio->jack_error_callback);
-        if (soundio->jack_info_callback)
-            jack_set_info_function(soundio->jack_info_callback);
-        global_msg_callback_flag.clear();
-    }
+    sij->client = (jack_client_t *)si->connect_handoff;
+    si->connect_handoff = nullptr;
 
-    sij->mutex = soundio_os_mutex_create();
+    set_message_callbacks(soundio->jack_info_callback, soundio->jack_error_callback);
+
+    sij->mutex = soundio_os_mutex_create_pi();
     if (!sij->mutex) {
         destroy_jack(si);
         return SoundIoErrorNoMem;
@@ -886,22 +937,12 @@ int soundio_jack_init(struct SoundIoPrivate *si) {
         return SoundIoErrorNoMem;
     }
 
-    // We pass JackNoStartServer due to
-    // https://github.com/jackaudio/jack2/issues/138
-    jack_status_t status;
-    sij->client = jack_client_open(soundio->app_name, JackNoStartServer, &status);
-    if (!sij->client) {
+    int err;
+    if (!sij->client && !(sij->client = open_client(soundio->app_name, &err))) {
         destroy_jack(si);
-        assert(!(status & JackInvalidOption));
-        if (status & JackShmFailure)
-            return SoundIoErrorSystemResources;
-        if (status & JackNoSuchClient)
-            return SoundIoErrorNoSuchClient;
-
-        return SoundIoErrorInitAudioBackend;
+        return err;
     }
 
-    int err;
     if ((err = jack_set_buffer_size_callback(sij->client, buffer_size_callback, si))) {
         destroy_jack(si);
         return SoundIoErrorInitAudioBackend;
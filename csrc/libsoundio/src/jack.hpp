@@ -15,6 +15,7 @@
 #include <jack/jack.h>
 
 int soundio_jack_init(struct SoundIoPrivate *si);
+int soundio_jack_probe(struct SoundIoConnectProbe *probe);
 
 struct SoundIoDeviceJackPort {
     char *full_name;
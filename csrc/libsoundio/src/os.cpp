@@ -8,6 +8,7 @@
 #include "os.h"
 #include "soundio_private.h"
 #include "util.hpp"
+#include "atomics.hpp"
 
 #include <stdlib.h>
 #include <time.h>
@@ -66,9 +67,17 @@
 #include <sys/time.h>
 #endif
 
+#if defined(__linux__)
+#define SOUNDIO_OS_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #if defined(__MACH__)
 #include <mach/clock.h>
 #include <mach/mach.h>
+#include <mach/semaphore.h>
+#elif !defined(_WIN32)
+#include <semaphore.h>
 #endif
 
 struct SoundIoOsThread {
@@ -84,6 +93,10 @@ struct SoundIoOsThread {
 #endif
     void *arg;
     void (*run)(void *arg);
+    bool rt;
+    // held by the creator and by the running thread, so that a detached
+    // thread frees the handle when it exits
+    atomic_int ref_count;
 };
 
 struct SoundIoOsMutex {
@@ -93,8 +106,27 @@ struct SoundIoOsMutex {
     pthread_mutex_t id;
     bool id_init;
 #endif
+    bool pi;
 };
 
+#if defined(SOUNDIO_DEBUG_RT_LOCKS)
+static thread_local bool current_thread_is_rt = false;
+
+// A real-time thread must never block on a mutex that can be held by a lower
+// priority thread without boosting it.
+static void assert_rt_safe_lock(struct SoundIoOsMutex *mutex) {
+    assert(!current_thread_is_rt || mutex->pi);
+}
+#else
+static inline void assert_rt_safe_lock(struct SoundIoOsMutex *) { }
+#endif
+
+void soundio_os_mark_rt_thread(void) {
+#if defined(SOUNDIO_DEBUG_RT_LOCKS)
+    current_thread_is_rt = true;
+#endif
+}
+
 #if defined(SOUNDIO_OS_KQUEUE)
 static const uintptr_t notify_ident = 1;
 struct SoundIoOsCond {
@@ -118,6 +150,16 @@ struct SoundIoOsCond {
 };
 #endif
 
+struct SoundIoOsSemaphore {
+#if defined(SOUNDIO_OS_WINDOWS)
+    HANDLE handle;
+#elif defined(__MACH__)
+    semaphore_t id;
+#else
+    sem_t id;
+#endif
+};
+
 #if defined(SOUNDIO_OS_WINDOWS)
 static INIT_ONCE win32_init_once = INIT_ONCE_STATIC_INIT;
 static double win32_time_resolution;
@@ -156,23 +198,42 @@ double soundio_os_get_time(void) {
 #endif
 }
 
+#if !defined(SOUNDIO_OS_WINDOWS)
+static void assert_no_err(int err) {
+    assert(!err);
+}
+#endif
+
+static void release_thread(struct SoundIoOsThread *thread) {
+    if (thread->ref_count.fetch_sub(1) != 1)
+        return;
+#if !defined(SOUNDIO_OS_WINDOWS)
+    if (thread->attr_init) {
+        assert_no_err(pthread_attr_destroy(&thread->attr));
+    }
+#endif
+    free(thread);
+}
+
 #if defined(SOUNDIO_OS_WINDOWS)
 static DWORD WINAPI run_win32_thread(LPVOID userdata) {
     struct SoundIoOsThread *thread = (struct SoundIoOsThread *)userdata;
     HRESULT err = CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
     assert(err == S_OK);
+    if (thread->rt)
+        soundio_os_mark_rt_thread();
     thread->run(thread->arg);
     CoUninitialize();
+    release_thread(thread);
     return 0;
 }
 #else
-static void assert_no_err(int err) {
-    assert(!err);
-}
-
 static void *run_pthread(void *userdata) {
     struct SoundIoOsThread *thread = (struct SoundIoOsThread *)userdata;
+    if (thread->rt)
+        soundio_os_mark_rt_thread();
     thread->run(thread->arg);
+    release_thread(thread);
     return NULL;
 }
 #endif
@@ -192,10 +253,14 @@ int soundio_os_thread_create(
 
     thread->run = run;
     thread->arg = arg;
+    thread->rt = (emit_rtprio_warning != nullptr);
+    thread->ref_count.store(1);
 
 #if defined(SOUNDIO_OS_WINDOWS)
+    thread->ref_count.store(2);
     thread->handle = CreateThread(NULL, 0, run_win32_thread, thread, 0, &thread->id);
     if (!thread->handle) {
+        thread->ref_count.store(1);
         soundio_os_thread_destroy(thread);
         return SoundIoErrorSystemResources;
     }
@@ -233,12 +298,14 @@ int soundio_os_thread_create(
 
     }
 
+    thread->ref_count.store(2);
     if ((err = pthread_create(&thread->id, &thread->attr, run_pthread, thread))) {
         if (err == EPERM && emit_rtprio_warning) {
             emit_rtprio_warning();
             err = pthread_create(&thread->id, NULL, run_pthread, thread);
         }
         if (err) {
+            thread->ref_count.store(1);
             soundio_os_thread_destroy(thread);
             return SoundIoErrorNoMem;
         }
@@ -262,31 +329,61 @@ void soundio_os_thread_destroy(struct SoundIoOsThread *thread) {
         assert(ok);
     }
 #else
-
     if (thread->running) {
         assert_no_err(pthread_join(thread->id, NULL));
     }
+#endif
 
-    if (thread->attr_init) {
-        assert_no_err(pthread_attr_destroy(&thread->attr));
-    }
+    release_thread(thread);
+}
+
+void soundio_os_thread_detach(struct SoundIoOsThread *thread) {
+#if defined(SOUNDIO_OS_WINDOWS)
+    BOOL ok = CloseHandle(thread->handle);
+    assert(ok);
+#else
+    assert_no_err(pthread_detach(thread->id));
 #endif
 
-    free(thread);
+    release_thread(thread);
 }
 
-struct SoundIoOsMutex *soundio_os_mutex_create(void) {
+#if !defined(SOUNDIO_OS_WINDOWS)
+// Falls back to a plain mutex where the protocol is not supported, and then
+// clears *pi so that the caller knows.
+static int init_pthread_mutex(pthread_mutex_t *id, bool *pi) {
+#if defined(_POSIX_THREAD_PRIO_INHERIT) && _POSIX_THREAD_PRIO_INHERIT > 0
+    if (*pi) {
+        pthread_mutexattr_t attr;
+        if (!pthread_mutexattr_init(&attr)) {
+            int err = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+            if (!err)
+                err = pthread_mutex_init(id, &attr);
+            assert_no_err(pthread_mutexattr_destroy(&attr));
+            if (!err)
+                return 0;
+        }
+    }
+#endif
+    *pi = false;
+    return pthread_mutex_init(id, NULL);
+}
+#endif
+
+static struct SoundIoOsMutex *mutex_create(bool pi) {
     struct SoundIoOsMutex *mutex = allocate<SoundIoOsMutex>(1);
     if (!mutex) {
         soundio_os_mutex_destroy(mutex);
         return NULL;
     }
 
+    mutex->pi = pi;
+
 #if defined(SOUNDIO_OS_WINDOWS)
     InitializeCriticalSection(&mutex->id);
 #else
     int err;
-    if ((err = pthread_mutex_init(&mutex->id, NULL))) {
+    if ((err = init_pthread_mutex(&mutex->id, &mutex->pi))) {
         soundio_os_mutex_destroy(mutex);
         return NULL;
     }
@@ -296,6 +393,14 @@ struct SoundIoOsMutex *soundio_os_mutex_create(void) {
     return mutex;
 }
 
+struct SoundIoOsMutex *soundio_os_mutex_create(void) {
+    return mutex_create(false);
+}
+
+struct SoundIoOsMutex *soundio_os_mutex_create_pi(void) {
+    return mutex_create(true);
+}
+
 void soundio_os_mutex_destroy(struct SoundIoOsMutex *mutex) {
     if (!mutex)
         return;
@@ -312,6 +417,7 @@ void soundio_os_mutex_destroy(struct SoundIoOsMutex *mutex) {
 }
 
 void soundio_os_mutex_lock(struct SoundIoOsMutex *mutex) {
+    assert_rt_safe_lock(mutex);
 #if defined(SOUNDIO_OS_WINDOWS)
     EnterCriticalSection(&mutex->id);
 #else
@@ -360,7 +466,10 @@ struct SoundIoOsCond * soundio_os_cond_create(void) {
     }
     cond->id_init = true;
 
-    if ((pthread_mutex_init(&cond->default_mutex_id, NULL))) {
+    // only held for the duration of a signal or wait setup, but it can be
+    // taken from real-time threads, so don't let it cause an inversion
+    bool pi = true;
+    if ((init_pthread_mutex(&cond->default_mutex_id, &pi))) {
         soundio_os_cond_destroy(cond);
         return NULL;
     }
@@ -598,6 +707,101 @@ int soundio_os_init(void) {
     return 0;
 }
 
+struct SoundIoOsSemaphore *soundio_os_semaphore_create(void) {
+    struct SoundIoOsSemaphore *sem = allocate<SoundIoOsSemaphore>(1);
+    if (!sem)
+        return NULL;
+
+#if defined(SOUNDIO_OS_WINDOWS)
+    sem->handle = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+    if (!sem->handle) {
+        free(sem);
+        return NULL;
+    }
+#elif defined(__MACH__)
+    if (semaphore_create(mach_task_self(), &sem->id, SYNC_POLICY_FIFO, 0) != KERN_SUCCESS) {
+        free(sem);
+        return NULL;
+    }
+#else
+    if (sem_init(&sem->id, 0, 0)) {
+        free(sem);
+        return NULL;
+    }
+#endif
+
+    return sem;
+}
+
+void soundio_os_semaphore_destroy(struct SoundIoOsSemaphore *sem) {
+    if (!sem)
+        return;
+
+#if defined(SOUNDIO_OS_WINDOWS)
+    CloseHandle(sem->handle);
+#elif defined(__MACH__)
+    semaphore_destroy(mach_task_self(), sem->id);
+#else
+    sem_destroy(&sem->id);
+#endif
+
+    free(sem);
+}
+
+void soundio_os_semaphore_post(struct SoundIoOsSemaphore *sem) {
+#if defined(SOUNDIO_OS_WINDOWS)
+    ReleaseSemaphore(sem->handle, 1, NULL);
+#elif defined(__MACH__)
+    semaphore_signal(sem->id);
+#else
+    sem_post(&sem->id);
+#endif
+}
+
+void soundio_os_semaphore_wait(struct SoundIoOsSemaphore *sem) {
+#if defined(SOUNDIO_OS_WINDOWS)
+    WaitForSingleObject(sem->handle, INFINITE);
+#elif defined(__MACH__)
+    semaphore_wait(sem->id);
+#else
+    while (sem_wait(&sem->id) && errno == EINTR) { }
+#endif
+}
+
+int soundio_os_event_fd_create(int *out_fd) {
+#if defined(SOUNDIO_OS_EVENTFD)
+    int fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (fd == -1)
+        return SoundIoErrorSystemResources;
+    *out_fd = fd;
+    return 0;
+#else
+    *out_fd = -1;
+    return SoundIoErrorIncompatibleBackend;
+#endif
+}
+
+void soundio_os_event_fd_destroy(int fd) {
+#if defined(SOUNDIO_OS_EVENTFD)
+    close(fd);
+#endif
+}
+
+void soundio_os_event_fd_signal(int fd) {
+#if defined(SOUNDIO_OS_EVENTFD)
+    // EAGAIN means the counter is saturated, in which case the fd is
+    // readable anyway.
+    eventfd_write(fd, 1);
+#endif
+}
+
+void soundio_os_event_fd_drain(int fd) {
+#if defined(SOUNDIO_OS_EVENTFD)
+    eventfd_t value;
+    eventfd_read(fd, &value);
+#endif
+}
+
 int soundio_os_page_size(void) {
     return page_size;
 }
@@ -25,10 +25,23 @@ int soundio_os_thread_create(
         struct SoundIoOsThread ** out_thread);
 
 void soundio_os_thread_destroy(struct SoundIoOsThread *thread);
+// Instead of joining the thread, lets it run to completion on its own. The
+// handle may not be used afterwards.
+void soundio_os_thread_detach(struct SoundIoOsThread *thread);
 
+// Threads created with emit_rtprio_warning are considered real-time. Call this
+// at the top of real-time callbacks running on threads libsoundio did not
+// create (JACK process callback, CoreAudio IOProc). Only has an effect when
+// built with SOUNDIO_DEBUG_RT_LOCKS, in which case locking a mutex which was
+// not created with soundio_os_mutex_create_pi from a real-time thread asserts.
+void soundio_os_mark_rt_thread(void);
 
 struct SoundIoOsMutex;
 struct SoundIoOsMutex *soundio_os_mutex_create(void);
+// Use for any mutex which a real-time thread may lock. Uses priority
+// inheritance where available so that a lower priority owner is boosted while
+// the real-time thread waits on it.
+struct SoundIoOsMutex *soundio_os_mutex_create_pi(void);
 void soundio_os_mutex_destroy(struct SoundIoOsMutex *mutex);
 void soundio_os_mutex_lock(struct SoundIoOsMutex *mutex);
 void soundio_os_mutex_unlock(struct SoundIoOsMutex *mutex);
@@ -49,6 +62,23 @@ void soundio_os_cond_timed_wait(struct SoundIoOsCond *cond,
 void soundio_os_cond_wait(struct SoundIoOsCond *cond,
         struct SoundIoOsMutex *locked_mutex);
 
+// Counting semaphore. Unlike a condition, posting takes no lock, so a
+// real-time thread may use it to hand work to an ordinary thread.
+struct SoundIoOsSemaphore;
+struct SoundIoOsSemaphore *soundio_os_semaphore_create(void);
+void soundio_os_semaphore_destroy(struct SoundIoOsSemaphore *sem);
+// safe to call from any thread, including real-time threads
+void soundio_os_semaphore_post(struct SoundIoOsSemaphore *sem);
+void soundio_os_semaphore_wait(struct SoundIoOsSemaphore *sem);
+
+// A pollable file descriptor which becomes readable when signaled and stays
+// readable until drained. Only available on Linux; elsewhere create returns
+// SoundIoErrorIncompatibleBackend.
+int soundio_os_event_fd_create(int *out_fd);
+void soundio_os_event_fd_destroy(int fd);
+// safe to call from any thread, including real-time threads
+void soundio_os_event_fd_signal(int fd);
+void soundio_os_event_fd_drain(int fd);
 
 int soundio_os_page_size(void);
 
@@ -11,16 +11,14 @@
 #include <string.h>
 #include <stdio.h>
 
+static void start_device_scan(SoundIoPrivate *si);
+static void device_scan_op_done(SoundIoPrivate *si);
 
 static void subscribe_callback(pa_context *context,
         pa_subscription_event_type_t event_bits, uint32_t index, void *userdata)
 {
     SoundIoPrivate *si = (SoundIoPrivate *)userdata;
-    SoundIo *soundio = &si->pub;
-    SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
-    sipa->device_scan_queued = true;
-    pa_threaded_mainloop_signal(sipa->main_loop, 0);
-    soundio->on_events_signal(soundio);
+    start_device_scan(si);
 }
 
 static int subscribe_to_events(SoundIoPrivate *si) {
@@ -37,7 +35,6 @@ static int subscribe_to_events(SoundIoPrivate *si) {
 static void context_state_callback(pa_context *context, void *userdata) {
     SoundIoPrivate *si = (SoundIoPrivate *)userdata;
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
-    SoundIo *soundio = &si->pub;
 
     switch (pa_context_get_state(context)) {
     case PA_CONTEXT_UNCONNECTED: // The context hasn't been connected yet.
@@ -63,11 +60,22 @@ static void context_state_callback(pa_context *context, void *userdata) {
             sipa->ready_flag = true;
         }
         pa_threaded_mainloop_signal(sipa->main_loop, 0);
-        soundio->on_events_signal(soundio);
+        soundio_signal_events(si);
         return;
     }
 }
 
+static void connect_timeout_callback(pa_mainloop_api *api, pa_time_event *event,
+        const struct timeval *tv, void *userdata)
+{
+    SoundIoPrivate *si = (SoundIoPrivate *)userdata;
+    SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
+    if (!sipa->connection_err)
+        sipa->connection_err = SoundIoErrorInitAudioBackend;
+    sipa->ready_flag = true;
+    pa_threaded_mainloop_signal(sipa->main_loop, 0);
+}
+
 static void destroy_pa(SoundIoPrivate *si) {
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
 
@@ -101,13 +109,13 @@ static SoundIoFormat from_pulseaudio_format(pa_sample_spec sample_spec) {
     case PA_SAMPLE_S32BE:       return SoundIoFormatS32BE;
     case PA_SAMPLE_S24_32LE:    return SoundIoFormatS24LE;
     case PA_SAMPLE_S24_32BE:    return SoundIoFormatS24BE;
+    case PA_SAMPLE_S24LE:       return SoundIoFormatS24PackedLE;
+    case PA_SAMPLE_S24BE:       return SoundIoFormatS24PackedBE;
 
     case PA_SAMPLE_MAX:
     case PA_SAMPLE_INVALID:
     case PA_SAMPLE_ALAW:
     case PA_SAMPLE_ULAW:
-    case PA_SAMPLE_S24LE:
-    case PA_SAMPLE_S24BE:
         return SoundIoFormatInvalid;
     }
     return SoundIoFormatInvalid;
@@ -183,7 +191,7 @@ static int set_all_device_channel_layouts(SoundIoDevice *device) {
 }
 
 static int set_all_device_formats(SoundIoDevice *device) {
-    device->format_count = 9;
+    device->format_count = 11;
     device->formats = allocate<SoundIoFormat>(device->format_count);
     if (!device->formats)
         return SoundIoErrorNoMem;
@@ -196,6 +204,8 @@ static int set_all_device_formats(SoundIoDevice *device) {
     device->formats[6] = SoundIoFormatS32BE;
     device->formats[7] = SoundIoFormatS24LE;
     device->formats[8] = SoundIoFormatS24BE;
+    device->formats[9] = SoundIoFormatS24PackedLE;
+    device->formats[10] = SoundIoFormatS24PackedBE;
     return 0;
 }
 
@@ -224,7 +234,7 @@ static void sink_info_callback(pa_context *pulse_context, const pa_sink_info *in
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
     int err;
     if (eol) {
-        pa_threaded_mainloop_signal(sipa->main_loop, 0);
+        device_scan_op_done(si);
         return;
     }
     if (sipa->device_query_err)
@@ -237,7 +247,7 @@ static void sink_info_callback(pa_context *pulse_context, const pa_sink_info *in
     }
     SoundIoDevice *device = &dev->pub;
 
-    device->ref_count = 1;
+    dev->ref_count.store(1);
     device->soundio = soundio;
     device->id = strdup(info->name);
     device->name = strdup(info->description);
@@ -288,7 +298,7 @@ static void source_info_callback(pa_context *pulse_context, const pa_source_info
     int err;
 
     if (eol) {
-        pa_threaded_mainloop_signal(sipa->main_loop, 0);
+        device_scan_op_done(si);
         return;
     }
     if (sipa->device_query_err)
@@ -301,7 +311,7 @@ static void source_info_callback(pa_context *pulse_context, const pa_source_info
     }
     SoundIoDevice *device = &dev->pub;
 
-    device->ref_count = 1;
+    dev->ref_count.store(1);
     device->soundio = soundio;
     device->id = strdup(info->name);
     device->name = strdup(info->description);
@@ -359,10 +369,10 @@ static void server_info_callback(pa_context *pulse_context, const pa_server_info
     if (!sipa->default_sink_name || !sipa->default_source_name)
         sipa->device_query_err = SoundIoErrorNoMem;
 
-    pa_threaded_mainloop_signal(sipa->main_loop, 0);
+    device_scan_op_done(si);
 }
 
-// always called even when refresh_devices succeeds
+// always called when a device scan finishes, successful or not
 static void cleanup_refresh_devices(SoundIoPrivate *si) {
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
 
@@ -376,34 +386,12 @@ static void cleanup_refresh_devices(SoundIoPrivate *si) {
     sipa->default_source_name = nullptr;
 }
 
-// call this while holding the main loop lock
-static int refresh_devices(SoundIoPrivate *si) {
-    SoundIo *soundio = &si->pub;
+// runs on the main loop thread once the last introspection reply is in
+static int finish_refresh_devices(SoundIoPrivate *si) {
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
 
-    assert(!sipa->current_devices_info);
-    sipa->current_devices_info = allocate<SoundIoDevicesInfo>(1);
-    if (!sipa->current_devices_info)
-        return SoundIoErrorNoMem;
-
-    pa_operation *list_sink_op = pa_context_get_sink_info_list(sipa->pulse_context, sink_info_callback, si);
-    pa_operation *list_source_op = pa_context_get_source_info_list(sipa->pulse_context, source_info_callback, si);
-    pa_operation *server_info_op = pa_context_get_server_info(sipa->pulse_context, server_info_callback, si);
-
-    int err;
-    if ((err = perform_operation(si, list_sink_op))) {
-        return err;
-    }
-    if ((err = perform_operation(si, list_source_op))) {
-        return err;
-    }
-    if ((err = perform_operation(si, server_info_op))) {
-        return err;
-    }
-
-    if (sipa->device_query_err) {
+    if (sipa->device_query_err)
         return sipa->device_query_err;
-    }
 
     // based on the default sink name, figure out the default output index
     // if the name doesn't match just pick the first one. if there are no
@@ -436,10 +424,72 @@ static int refresh_devices(SoundIoPrivate *si) {
     soundio_destroy_devices_info(sipa->ready_devices_info);
     sipa->ready_devices_info = sipa->current_devices_info;
     sipa->current_devices_info = nullptr;
+    return 0;
+}
+
+static void device_scan_op_done(SoundIoPrivate *si) {
+    SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
+
+    assert(sipa->scan_ops_pending > 0);
+    sipa->scan_ops_pending -= 1;
+    if (sipa->scan_ops_pending > 0)
+        return;
+
+    if (!sipa->connection_err)
+        sipa->connection_err = finish_refresh_devices(si);
+    cleanup_refresh_devices(si);
+
     pa_threaded_mainloop_signal(sipa->main_loop, 0);
-    soundio->on_events_signal(soundio);
+    soundio_signal_events(si);
 
-    return 0;
+    if (sipa->device_scan_queued) {
+        sipa->device_scan_queued = false;
+        start_device_scan(si);
+    }
+}
+
+// Issues the introspection requests and returns without waiting for them;
+// the replies build current_devices_info on the main loop thread and the
+// last one publishes it as ready_devices_info. Call this on the main loop
+// thread or while holding the main loop lock.
+static void start_device_scan(SoundIoPrivate *si) {
+    SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
+
+    if (sipa->connection_err)
+        return;
+
+    if (sipa->scan_ops_pending > 0) {
+        sipa->device_scan_queued = true;
+        return;
+    }
+
+    assert(!sipa->current_devices_info);
+    sipa->current_devices_info = allocate<SoundIoDevicesInfo>(1);
+    if (!sipa->current_devices_info) {
+        sipa->connection_err = SoundIoErrorNoMem;
+        pa_threaded_mainloop_signal(sipa->main_loop, 0);
+        soundio_signal_events(si);
+        return;
+    }
+
+    pa_operation *ops[] = {
+        pa_context_get_sink_info_list(sipa->pulse_context, sink_info_callback, si),
+        pa_context_get_source_info_list(sipa->pulse_context, source_info_callback, si),
+        pa_context_get_server_info(sipa->pulse_context, server_info_callback, si),
+    };
+
+    // hold one count ourselves so that replies cannot finish the scan
+    // before every request has been issued
+    sipa->scan_ops_pending = 1;
+    for (int i = 0; i < array_length(ops); i += 1) {
+        if (!ops[i]) {
+            sipa->device_query_err = SoundIoErrorNoMem;
+            continue;
+        }
+        sipa->scan_ops_pending += 1;
+        pa_operation_unref(ops[i]);
+    }
+    device_scan_op_done(si);
 }
 
 static void my_flush_events(SoundIoPrivate *si, bool wait) {
@@ -455,12 +505,6 @@ static void my_flush_events(SoundIoPrivate *si, bool wait) {
     if (wait)
         pa_threaded_mainloop_wait(sipa->main_loop);
 
-    if (sipa->device_scan_queued && !sipa->connection_err) {
-        sipa->device_scan_queued = false;
-        sipa->connection_err = refresh_devices(si);
-        cleanup_refresh_devices(si);
-    }
-
     if (sipa->connection_err && !sipa->emitted_shutdown_cb) {
         sipa->emitted_shutdown_cb = true;
         cb_shutdown = true;
@@ -498,12 +542,9 @@ static void wakeup_pa(SoundIoPrivate *si) {
 }
 
 static void force_device_scan_pa(SoundIoPrivate *si) {
-    SoundIo *soundio = &si->pub;
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
     pa_threaded_mainloop_lock(sipa->main_loop);
-    sipa->device_scan_queued = true;
-    pa_threaded_mainloop_signal(sipa->main_loop, 0);
-    soundio->on_events_signal(soundio);
+    start_device_scan(si);
     pa_threaded_mainloop_unlock(sipa->main_loop);
 }
 
@@ -518,6 +559,8 @@ static pa_sample_format_t to_pulseaudio_format(SoundIoFormat format) {
     case SoundIoFormatS32BE:      return PA_SAMPLE_S32BE;
     case SoundIoFormatFloat32LE:  return PA_SAMPLE_FLOAT32LE;
     case SoundIoFormatFloat32BE:  return PA_SAMPLE_FLOAT32BE;
+    case SoundIoFormatS24PackedLE: return PA_SAMPLE_S24LE;
+    case SoundIoFormatS24PackedBE: return PA_SAMPLE_S24BE;
 
     case SoundIoFormatInvalid:
     case SoundIoFormatS8:
@@ -589,6 +632,55 @@ static pa_channel_map to_pulseaudio_channel_map(const SoundIoChannelLayout *chan
     return channel_map;
 }
 
+// Call this on the main loop thread or while holding the main loop lock.
+// `queued_usec` is audio held on our side of the stream, which the server
+// does not know about.
+static void store_timing(SoundIoPulseAudioTiming *timing, pa_stream *stream, bool playback,
+        long queued_usec)
+{
+    pa_usec_t usec;
+    int negative;
+    if (pa_stream_get_latency(stream, &usec, &negative))
+        return;
+    // the server only reports underruns for playback streams
+    const pa_timing_info *info = pa_stream_get_timing_info(stream);
+    bool underrun = playback && info && !info->playing;
+    bool playing = !pa_stream_is_corked(stream) && !underrun;
+
+    long seq = timing->seq.load();
+    timing->seq.store(seq + 1);
+    timing->latency.store((negative ? -(long)usec : (long)usec) + queued_usec);
+    timing->snapshot_time.store((long)(soundio_os_get_time() * 1000000.0));
+    timing->playing.store(playing);
+    timing->seq.store(seq + 2);
+}
+
+// Lock-free, from any thread. While the stream runs, playback latency
+// shrinks and capture latency grows with the time since the snapshot;
+// `direction` is -1 or 1 accordingly.
+static int load_latency(SoundIoPulseAudioTiming *timing, int direction, double *out_latency) {
+    long seq;
+    long latency;
+    long snapshot_time;
+    bool playing;
+    do {
+        seq = timing->seq.load();
+        latency = timing->latency.load();
+        snapshot_time = timing->snapshot_time.load();
+        playing = timing->playing.load();
+    } while ((seq & 1) || seq != timing->seq.load());
+
+    // no timing information yet
+    if (seq == 0)
+        return SoundIoErrorStreaming;
+
+    double seconds = latency / 1000000.0;
+    if (playing)
+        seconds += direction * (soundio_os_get_time() - snapshot_time / 1000000.0);
+    *out_latency = max(seconds, 0.0);
+    return 0;
+}
+
 static void playback_stream_state_callback(pa_stream *stream, void *userdata) {
     SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate*) userdata;
     SoundIoOutStream *outstream = &os->pub;
@@ -612,15 +704,36 @@ static void playback_stream_state_callback(pa_stream *stream, void *userdata) {
 }
 
 static void playback_stream_underflow_callback(pa_stream *stream, void *userdata) {
-    SoundIoOutStream *outstream = (SoundIoOutStream*)userdata;
-    outstream->underflow_callback(outstream);
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)userdata;
+    soundio_outstream_run_underflow_callback(os);
 }
 
 static void playback_stream_write_callback(pa_stream *stream, size_t nbytes, void *userdata) {
     SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate*)(userdata);
     SoundIoOutStream *outstream = &os->pub;
+    SoundIoOutStreamPulseAudio *ospa = &os->backend_data.pulseaudio;
+    if (ospa->draining.load())
+        return;
     int frame_count = nbytes / outstream->bytes_per_frame;
-    outstream->write_callback(outstream, 0, frame_count);
+    soundio_outstream_run_write_callback(os, 0, frame_count);
+}
+
+static void playback_stream_latency_update_callback(pa_stream *stream, void *userdata) {
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate*)(userdata);
+    store_timing(&os->backend_data.pulseaudio.timing, stream, true, 0);
+}
+
+static void playback_stream_drain_callback(pa_stream *stream, int success, void *userdata) {
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate*)(userdata);
+    SoundIoOutStream *outstream = &os->pub;
+    if (success) {
+        soundio_outstream_report_drained(os);
+        return;
+    }
+    // A failed stream has already been reported by the state callback.
+    // Otherwise the stream will neither drain nor ask for more frames.
+    if (pa_stream_get_state(stream) != PA_STREAM_FAILED)
+        outstream->error_callback(outstream, SoundIoErrorStreaming);
 }
 
 static void outstream_destroy_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
@@ -635,6 +748,7 @@ static void outstream_destroy_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os
         pa_stream_set_state_callback(stream, nullptr, nullptr);
         pa_stream_set_underflow_callback(stream, nullptr, nullptr);
         pa_stream_set_overflow_callback(stream, nullptr, nullptr);
+        pa_stream_set_latency_update_callback(stream, nullptr, nullptr);
         pa_stream_disconnect(stream);
 
         pa_stream_unref(stream);
@@ -655,6 +769,11 @@ static int outstream_open_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
     SoundIoOutStreamPulseAudio *ospa = &os->backend_data.pulseaudio;
     SoundIoOutStream *outstream = &os->pub;
 
+    // the areas always point into the memory block from pa_stream_begin_write
+    if (outstream->access_mode == SoundIoAccessModeCopy)
+        return SoundIoErrorIncompatibleDevice;
+    outstream->access_mode = SoundIoAccessModeDirect;
+
     if ((unsigned)outstream->layout.channel_count > PA_CHANNELS_MAX)
         return SoundIoErrorIncompatibleBackend;
 
@@ -664,6 +783,8 @@ static int outstream_open_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
     ospa->stream_ready.store(false);
     ospa->clear_buffer_flag.test_and_set();
+    ospa->draining.store(false);
+    ospa->timing.seq.store(0);
 
     assert(sipa->pulse_context);
 
@@ -683,6 +804,7 @@ static int outstream_open_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
         return SoundIoErrorNoMem;
     }
     pa_stream_set_state_callback(ospa->stream, playback_stream_state_callback, os);
+    pa_stream_set_latency_update_callback(ospa->stream, playback_stream_latency_update_callback, os);
 
     ospa->buffer_attr.maxlength = UINT32_MAX;
     ospa->buffer_attr.tlength = UINT32_MAX;
@@ -698,9 +820,18 @@ static int outstream_open_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
         ospa->buffer_attr.maxlength = buffer_length;
         ospa->buffer_attr.tlength = buffer_length;
     }
+    if (outstream->period_duration > 0.0) {
+        ospa->buffer_attr.minreq = outstream->bytes_per_frame *
+            ceil_dbl_to_int(outstream->period_duration * outstream->sample_rate);
+    }
 
     pa_stream_flags_t flags = (pa_stream_flags_t)(PA_STREAM_START_CORKED|PA_STREAM_AUTO_TIMING_UPDATE);
-    if (outstream->software_latency > 0.0)
+    if (outstream->interpolate_timing)
+        flags = (pa_stream_flags_t) (flags | PA_STREAM_INTERPOLATE_TIMING);
+    // the two modes are mutually exclusive
+    if (outstream->early_requests)
+        flags = (pa_stream_flags_t) (flags | PA_STREAM_EARLY_REQUESTS);
+    else if (outstream->software_latency > 0.0)
         flags = (pa_stream_flags_t) (flags | PA_STREAM_ADJUST_LATENCY);
 
     int err = pa_stream_connect_playback(ospa->stream,
@@ -720,8 +851,15 @@ static int outstream_open_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
         return err;
     }
 
-    size_t writable_size = pa_stream_writable_size(ospa->stream);
-    outstream->software_latency = writable_size / bytes_per_second;
+    // the server may have granted something other than what we asked for
+    const pa_buffer_attr *attr = pa_stream_get_buffer_attr(ospa->stream);
+    if (attr)
+        ospa->buffer_attr = *attr;
+    outstream->software_latency = ospa->buffer_attr.tlength / (double)bytes_per_second;
+    outstream->period_duration = ospa->buffer_attr.minreq / (double)bytes_per_second;
+    os->watchdog.buffer_frames = ospa->buffer_attr.tlength / outstream->bytes_per_frame;
+
+    store_timing(&ospa->timing, ospa->stream, true, 0);
 
     pa_threaded_mainloop_unlock(sipa->main_loop);
 
@@ -737,7 +875,7 @@ static int outstream_start_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
 
     ospa->write_byte_count = pa_stream_writable_size(ospa->stream);
     int frame_count = ospa->write_byte_count / outstream->bytes_per_frame;
-    outstream->write_callback(outstream, 0, frame_count);
+    soundio_outstream_run_write_callback(os, 0, frame_count);
 
     pa_operation *op = pa_stream_cork(ospa->stream, false, nullptr, nullptr);
     if (!op) {
@@ -745,9 +883,10 @@ static int outstream_start_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
         return SoundIoErrorStreaming;
     }
     pa_operation_unref(op);
+    store_timing(&ospa->timing, ospa->stream, true, 0);
     pa_stream_set_write_callback(ospa->stream, playback_stream_write_callback, os);
-    pa_stream_set_underflow_callback(ospa->stream, playback_stream_underflow_callback, outstream);
-    pa_stream_set_overflow_callback(ospa->stream, playback_stream_underflow_callback, outstream);
+    pa_stream_set_underflow_callback(ospa->stream, playback_stream_underflow_callback, os);
+    pa_stream_set_overflow_callback(ospa->stream, playback_stream_underflow_callback, os);
 
     pa_threaded_mainloop_unlock(sipa->main_loop);
 
@@ -784,6 +923,7 @@ static int outstream_end_write_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *o
     if (pa_stream_write(stream, ospa->write_ptr, ospa->write_byte_count, nullptr, 0, seek_mode))
         return SoundIoErrorStreaming;
 
+    store_timing(&ospa->timing, stream, true, 0);
     return 0;
 }
 
@@ -795,6 +935,27 @@ static int outstream_clear_buffer_pa(SoundIoPrivate *si,
     return 0;
 }
 
+static int outstream_drain_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
+    SoundIoOutStreamPulseAudio *ospa = &os->backend_data.pulseaudio;
+    SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
+
+    if (ospa->draining.exchange(true))
+        return 0;
+
+    bool locked = !pa_threaded_mainloop_in_thread(sipa->main_loop);
+    if (locked)
+        pa_threaded_mainloop_lock(sipa->main_loop);
+
+    pa_operation *op = pa_stream_drain(ospa->stream, playback_stream_drain_callback, os);
+    if (op)
+        pa_operation_unref(op);
+
+    if (locked)
+        pa_threaded_mainloop_unlock(sipa->main_loop);
+
+    return op ? 0 : SoundIoErrorStreaming;
+}
+
 static int outstream_pause_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os, bool pause) {
     SoundIoOutStreamPulseAudio *ospa = &os->backend_data.pulseaudio;
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
@@ -810,6 +971,7 @@ static int outstream_pause_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os, b
             return SoundIoErrorStreaming;
         }
         pa_operation_unref(op);
+        store_timing(&ospa->timing, ospa->stream, true, 0);
     }
 
     if (!pa_threaded_mainloop_in_thread(sipa->main_loop)) {
@@ -821,15 +983,7 @@ static int outstream_pause_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os, b
 
 static int outstream_get_latency_pa(SoundIoPrivate *si, SoundIoOutStreamPrivate *os, double *out_latency) {
     SoundIoOutStreamPulseAudio *ospa = &os->backend_data.pulseaudio;
-
-    int err;
-    pa_usec_t r_usec;
-    int negative;
-    if ((err = pa_stream_get_latency(ospa->stream, &r_usec, &negative))) {
-        return SoundIoErrorStreaming;
-    }
-    *out_latency = r_usec / 1000000.0;
-    return 0;
+    return load_latency(&ospa->timing, -1, out_latency);
 }
 
 static void recording_stream_state_callback(pa_stream *stream, void *userdata) {
@@ -854,13 +1008,92 @@ static void recording_stream_state_callback(pa_stream *stream, void *userdata) {
     }
 }
 
+static void store_capture_timing(SoundIoInStreamPrivate *is) {
+    SoundIoInStream *instream = &is->pub;
+    SoundIoInStreamPulseAudio *ispa = &is->backend_data.pulseaudio;
+    long staged_bytes = soundio_ring_buffer_fill_count(&ispa->ring_buffer);
+    long bytes_per_second = instream->bytes_per_frame * instream->sample_rate;
+    store_timing(&ispa->timing, ispa->stream, false, staged_bytes * 1000000 / bytes_per_second);
+}
+
+// Copies a peeked fragment into the staging ring buffer, or zeros if it is a
+// hole. Returns false if it does not fit.
+static bool stage_fragment(SoundIoInStreamPulseAudio *ispa, const char *data, size_t size) {
+    if (size > (size_t)soundio_ring_buffer_free_count(&ispa->ring_buffer))
+        return false;
+    char *dest = soundio_ring_buffer_write_ptr(&ispa->ring_buffer);
+    if (data)
+        memcpy(dest, data, size);
+    else
+        memset(dest, 0, size);
+    soundio_ring_buffer_advance_write_ptr(&ispa->ring_buffer, size);
+    return true;
+}
+
+// Collects everything captured so far into one contiguous run and returns
+// its length in frames. A lone fragment is read in place; only when several
+// are pending are they copied into the ring buffer, whose mirrored memory
+// keeps them contiguous across the wrap.
+static int gather_capture(SoundIoInStreamPrivate *is, int *out_frame_count) {
+    SoundIoInStream *instream = &is->pub;
+    SoundIoInStreamPulseAudio *ispa = &is->backend_data.pulseaudio;
+    pa_stream *stream = ispa->stream;
+    const char *data;
+    size_t size;
+
+    if (ispa->peek_buf) {
+        size_t left = ispa->peek_buf_size - ispa->peek_buf_index;
+        // the fragment is still queued, so anything beyond it arrived since
+        if (pa_stream_readable_size(stream) <= ispa->peek_buf_size ||
+            !stage_fragment(ispa, ispa->peek_buf + ispa->peek_buf_index, left))
+        {
+            *out_frame_count = left / instream->bytes_per_frame;
+            return 0;
+        }
+        ispa->peek_buf = nullptr;
+        if (pa_stream_drop(stream))
+            return SoundIoErrorStreaming;
+    } else if (soundio_ring_buffer_fill_count(&ispa->ring_buffer) == 0) {
+        if (pa_stream_peek(stream, (const void **)&data, &size))
+            return SoundIoErrorStreaming;
+        if (data && size >= pa_stream_readable_size(stream)) {
+            ispa->peek_buf = (char *)data;
+            ispa->peek_buf_size = size;
+            ispa->peek_buf_index = 0;
+            *out_frame_count = size / instream->bytes_per_frame;
+            return 0;
+        }
+    }
+
+    for (;;) {
+        if (pa_stream_peek(stream, (const void **)&data, &size))
+            return SoundIoErrorStreaming;
+        if (size == 0 || !stage_fragment(ispa, data, size))
+            break;
+        if (pa_stream_drop(stream))
+            return SoundIoErrorStreaming;
+    }
+
+    *out_frame_count = soundio_ring_buffer_fill_count(&ispa->ring_buffer) / instream->bytes_per_frame;
+    return 0;
+}
+
 static void recording_stream_read_callback(pa_stream *stream, size_t nbytes, void *userdata) {
     SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate*)userdata;
     SoundIoInStream *instream = &is->pub;
-    assert(nbytes % instream->bytes_per_frame == 0);
-    assert(nbytes > 0);
-    int available_frame_count = nbytes / instream->bytes_per_frame;
-    instream->read_callback(instream, 0, available_frame_count);
+    int frame_count;
+    if (gather_capture(is, &frame_count)) {
+        instream->error_callback(instream, SoundIoErrorStreaming);
+        return;
+    }
+    store_capture_timing(is);
+    if (frame_count > 0)
+        soundio_instream_run_read_callback(is, 0, frame_count);
+}
+
+static void recording_stream_latency_update_callback(pa_stream *stream, void *userdata) {
+    SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate*)userdata;
+    store_capture_timing(is);
 }
 
 static void instream_destroy_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
@@ -872,6 +1105,7 @@ static void instream_destroy_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is)
 
         pa_stream_set_state_callback(stream, nullptr, nullptr);
         pa_stream_set_read_callback(stream, nullptr, nullptr);
+        pa_stream_set_latency_update_callback(stream, nullptr, nullptr);
         pa_stream_disconnect(stream);
         pa_stream_unref(stream);
 
@@ -879,12 +1113,23 @@ static void instream_destroy_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is)
 
         ispa->stream = nullptr;
     }
+
+    if (ispa->ring_buffer.mem.address) {
+        soundio_ring_buffer_deinit(&ispa->ring_buffer);
+        ispa->ring_buffer.mem.address = nullptr;
+    }
 }
 
 static int instream_open_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     SoundIoInStreamPulseAudio *ispa = &is->backend_data.pulseaudio;
     SoundIoInStream *instream = &is->pub;
 
+    // fragments are copied into the staging ring buffer whenever more than
+    // one is pending, and holes are always filled in there
+    if (instream->access_mode == SoundIoAccessModeDirect)
+        return SoundIoErrorIncompatibleDevice;
+    instream->access_mode = SoundIoAccessModeCopy;
+
     if ((unsigned)instream->layout.channel_count > PA_CHANNELS_MAX)
         return SoundIoErrorIncompatibleBackend;
     if (!instream->name)
@@ -892,6 +1137,7 @@ static int instream_open_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
 
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
     ispa->stream_ready = false;
+    ispa->timing.seq.store(0);
 
     pa_threaded_mainloop_lock(sipa->main_loop);
 
@@ -912,7 +1158,7 @@ static int instream_open_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     pa_stream *stream = ispa->stream;
 
     pa_stream_set_state_callback(stream, recording_stream_state_callback, is);
-    pa_stream_set_read_callback(stream, recording_stream_read_callback, is);
+    pa_stream_set_latency_update_callback(stream, recording_stream_latency_update_callback, is);
 
     ispa->buffer_attr.maxlength = UINT32_MAX;
     ispa->buffer_attr.tlength = UINT32_MAX;
@@ -920,11 +1166,11 @@ static int instream_open_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     ispa->buffer_attr.minreq = UINT32_MAX;
     ispa->buffer_attr.fragsize = UINT32_MAX;
 
-    if (instream->software_latency > 0.0) {
-        int bytes_per_second = instream->bytes_per_frame * instream->sample_rate;
-        int buffer_length = instream->bytes_per_frame *
-            ceil_dbl_to_int(instream->software_latency * bytes_per_second / (double)instream->bytes_per_frame);
-        ispa->buffer_attr.fragsize = buffer_length;
+    double fragment_duration = (instream->period_duration > 0.0) ?
+        instream->period_duration : instream->software_latency;
+    if (fragment_duration > 0.0) {
+        ispa->buffer_attr.fragsize = instream->bytes_per_frame *
+            ceil_dbl_to_int(fragment_duration * instream->sample_rate);
     }
 
     pa_threaded_mainloop_unlock(sipa->main_loop);
@@ -939,7 +1185,9 @@ static int instream_start_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     pa_threaded_mainloop_lock(sipa->main_loop);
 
     pa_stream_flags_t flags = PA_STREAM_AUTO_TIMING_UPDATE;
-    if (instream->software_latency > 0.0)
+    if (instream->interpolate_timing)
+        flags = (pa_stream_flags_t) (flags|PA_STREAM_INTERPOLATE_TIMING);
+    if (instream->software_latency > 0.0 || instream->period_duration > 0.0)
         flags = (pa_stream_flags_t) (flags|PA_STREAM_ADJUST_LATENCY);
 
     int err = pa_stream_connect_record(ispa->stream,
@@ -955,10 +1203,34 @@ static int instream_start_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
 
     pa_operation *update_timing_info_op = pa_stream_update_timing_info(ispa->stream, timing_update_callback, si);
     if ((err = perform_operation(si, update_timing_info_op))) {
+        pa_stream_disconnect(ispa->stream);
         pa_threaded_mainloop_unlock(sipa->main_loop);
         return err;
     }
 
+    // without the attributes the server chose, maxlength would still be the
+    // UINT32_MAX requested at open, far too big for the ring buffer
+    const pa_buffer_attr *attr = pa_stream_get_buffer_attr(ispa->stream);
+    if (!attr) {
+        pa_stream_disconnect(ispa->stream);
+        pa_threaded_mainloop_unlock(sipa->main_loop);
+        return SoundIoErrorStreaming;
+    }
+    ispa->buffer_attr = *attr;
+    int bytes_per_second = instream->bytes_per_frame * instream->sample_rate;
+    instream->software_latency = ispa->buffer_attr.fragsize / (double)bytes_per_second;
+    instream->period_duration = instream->software_latency;
+    is->watchdog.buffer_frames = ispa->buffer_attr.maxlength / instream->bytes_per_frame;
+
+    // the server never holds more than maxlength, so neither does the ring
+    if ((err = soundio_ring_buffer_init(&ispa->ring_buffer, ispa->buffer_attr.maxlength))) {
+        pa_stream_disconnect(ispa->stream);
+        pa_threaded_mainloop_unlock(sipa->main_loop);
+        return SoundIoErrorNoMem;
+    }
+    pa_stream_set_read_callback(ispa->stream, recording_stream_read_callback, is);
+
+    store_capture_timing(is);
 
     pa_threaded_mainloop_unlock(sipa->main_loop);
     return 0;
@@ -969,29 +1241,23 @@ static int instream_begin_read_pa(SoundIoPrivate *si,
 {
     SoundIoInStream *instream = &is->pub;
     SoundIoInStreamPulseAudio *ispa = &is->backend_data.pulseaudio;
-    pa_stream *stream = ispa->stream;
 
     assert(ispa->stream_ready);
 
-    if (!ispa->peek_buf) {
-        if (pa_stream_peek(stream, (const void **)&ispa->peek_buf, &ispa->peek_buf_size))
-            return SoundIoErrorStreaming;
-
-        ispa->peek_buf_frames_left = ispa->peek_buf_size / instream->bytes_per_frame;
-        ispa->peek_buf_index = 0;
-
-        // hole
-        if (!ispa->peek_buf) {
-            *frame_count = ispa->peek_buf_frames_left;
-            *out_areas = nullptr;
-            return 0;
-        }
+    char *read_ptr;
+    int available_frame_count;
+    if (ispa->peek_buf) {
+        read_ptr = ispa->peek_buf + ispa->peek_buf_index;
+        available_frame_count = (ispa->peek_buf_size - ispa->peek_buf_index) / instream->bytes_per_frame;
+    } else {
+        read_ptr = soundio_ring_buffer_read_ptr(&ispa->ring_buffer);
+        available_frame_count = soundio_ring_buffer_fill_count(&ispa->ring_buffer) / instream->bytes_per_frame;
     }
 
-    ispa->read_frame_count = min(*frame_count, ispa->peek_buf_frames_left);
+    ispa->read_frame_count = min(*frame_count, available_frame_count);
     *frame_count = ispa->read_frame_count;
     for (int ch = 0; ch < instream->layout.channel_count; ch += 1) {
-        ispa->areas[ch].ptr = ispa->peek_buf + ispa->peek_buf_index + instream->bytes_per_sample * ch;
+        ispa->areas[ch].ptr = read_ptr + instream->bytes_per_sample * ch;
         ispa->areas[ch].step = instream->bytes_per_frame;
     }
 
@@ -1003,25 +1269,20 @@ static int instream_begin_read_pa(SoundIoPrivate *si,
 static int instream_end_read_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is) {
     SoundIoInStream *instream = &is->pub;
     SoundIoInStreamPulseAudio *ispa = &is->backend_data.pulseaudio;
-    pa_stream *stream = ispa->stream;
-
-    // hole
-    if (!ispa->peek_buf) {
-        if (pa_stream_drop(stream))
-            return SoundIoErrorStreaming;
-        return 0;
-    }
 
     size_t advance_bytes = ispa->read_frame_count * instream->bytes_per_frame;
-    ispa->peek_buf_index += advance_bytes;
-    ispa->peek_buf_frames_left -= ispa->read_frame_count;
-
-    if (ispa->peek_buf_index >= ispa->peek_buf_size) {
-        if (pa_stream_drop(stream))
-            return SoundIoErrorStreaming;
-        ispa->peek_buf = nullptr;
+    if (ispa->peek_buf) {
+        ispa->peek_buf_index += advance_bytes;
+        if (ispa->peek_buf_index >= ispa->peek_buf_size) {
+            ispa->peek_buf = nullptr;
+            if (pa_stream_drop(ispa->stream))
+                return SoundIoErrorStreaming;
+        }
+    } else {
+        soundio_ring_buffer_advance_read_ptr(&ispa->ring_buffer, advance_bytes);
     }
 
+    store_capture_timing(is);
     return 0;
 }
 
@@ -1038,6 +1299,7 @@ static int instream_pause_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is, boo
         if (!op)
             return SoundIoErrorStreaming;
         pa_operation_unref(op);
+        store_capture_timing(is);
     }
 
     if (!pa_threaded_mainloop_in_thread(sipa->main_loop)) {
@@ -1049,23 +1311,56 @@ static int instream_pause_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is, boo
 
 static int instream_get_latency_pa(SoundIoPrivate *si, SoundIoInStreamPrivate *is, double *out_latency) {
     SoundIoInStreamPulseAudio *ispa = &is->backend_data.pulseaudio;
+    return load_latency(&ispa->timing, 1, out_latency);
+}
 
-    int err;
-    pa_usec_t r_usec;
-    int negative;
-    if ((err = pa_stream_get_latency(ispa->stream, &r_usec, &negative))) {
-        return SoundIoErrorStreaming;
+int soundio_pulseaudio_probe(SoundIoConnectProbe *probe) {
+    // a bare context on a private main loop, so that the attempt can be
+    // abandoned at any point without touching the SoundIo instance
+    pa_mainloop *main_loop = pa_mainloop_new();
+    if (!main_loop)
+        return SoundIoErrorNoMem;
+
+    pa_context *context = pa_context_new(pa_mainloop_get_api(main_loop), probe->app_name);
+    if (!context) {
+        pa_mainloop_free(main_loop);
+        return SoundIoErrorNoMem;
     }
-    *out_latency = r_usec / 1000000.0;
-    return 0;
+
+    int err = SoundIoErrorInitAudioBackend;
+    if (!pa_context_connect(context, NULL, (pa_context_flags_t)0, NULL)) {
+        for (;;) {
+            pa_context_state_t state = pa_context_get_state(context);
+            if (state == PA_CONTEXT_READY) {
+                err = 0;
+                break;
+            }
+            if (!PA_CONTEXT_IS_GOOD(state) || probe->abort.load())
+                break;
+            double remaining = probe->deadline - soundio_os_get_time();
+            if (remaining <= 0.0)
+                break;
+            // wake up regularly to notice an abandoned probe
+            int timeout_usec = (int)(min(remaining, 0.01) * 1000000.0);
+            if (pa_mainloop_prepare(main_loop, timeout_usec) < 0 ||
+                pa_mainloop_poll(main_loop) < 0 ||
+                pa_mainloop_dispatch(main_loop) < 0)
+            {
+                break;
+            }
+        }
+        pa_context_disconnect(context);
+    }
+
+    pa_context_unref(context);
+    pa_mainloop_free(main_loop);
+    return err;
 }
 
 int soundio_pulseaudio_init(SoundIoPrivate *si) {
     SoundIo *soundio = &si->pub;
     SoundIoPulseAudio *sipa = &si->backend_data.pulseaudio;
 
-    sipa->device_scan_queued = true;
-
     sipa->main_loop = pa_threaded_mainloop_new();
     if (!sipa->main_loop) {
         destroy_pa(si);
@@ -1089,6 +1384,17 @@ int soundio_pulseaudio_init(SoundIoPrivate *si) {
     pa_context_set_subscribe_callback(sipa->pulse_context, subscribe_callback, si);
     pa_context_set_state_callback(sipa->pulse_context, context_state_callback, si);
 
+    if (si->connect_deadline > 0.0) {
+        double remaining = max(si->connect_deadline - soundio_os_get_time(), 0.0);
+        struct timeval tv;
+        pa_timeval_add(pa_gettimeofday(&tv), (pa_usec_t)(remaining * 1000000.0));
+        sipa->connect_timer = main_loop_api->time_new(main_loop_api, &tv, connect_timeout_callback, si);
+        if (!sipa->connect_timer) {
+            destroy_pa(si);
+            return SoundIoErrorNoMem;
+        }
+    }
+
     int err = pa_context_connect(sipa->pulse_context, NULL, (pa_context_flags_t)0, NULL);
     if (err) {
         destroy_pa(si);
@@ -1118,6 +1424,23 @@ int soundio_pulseaudio_init(SoundIoPrivate *si) {
         return err;
     }
 
+    // the first device list is ready by the time we return, so that the
+    // first flush_events has devices to report without blocking
+    start_device_scan(si);
+    while (!sipa->ready_devices_info && !sipa->connection_err)
+        pa_threaded_mainloop_wait(sipa->main_loop);
+
+    if (sipa->connection_err) {
+        pa_threaded_mainloop_unlock(sipa->main_loop);
+        destroy_pa(si);
+        return sipa->connection_err;
+    }
+
+    if (sipa->connect_timer) {
+        main_loop_api->time_free(sipa->connect_timer);
+        sipa->connect_timer = nullptr;
+    }
+
     pa_threaded_mainloop_unlock(sipa->main_loop);
 
     si->destroy = destroy_pa;
@@ -1132,6 +1455,7 @@ int soundio_pulseaudio_init(SoundIoPrivate *si) {
     si->outstream_begin_write = outstream_begin_write_pa;
     si->outstream_end_write = outstream_end_write_pa;
     si->outstream_clear_buffer = outstream_clear_buffer_pa;
+    si->outstream_drain = outstream_drain_pa;
     si->outstream_pause = outstream_pause_pa;
     si->outstream_get_latency = outstream_get_latency_pa;
 
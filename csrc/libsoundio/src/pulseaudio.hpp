@@ -10,10 +10,12 @@
 
 #include "soundio_private.h"
 #include "atomics.hpp"
+#include "ring_buffer.hpp"
 
 #include <pulse/pulseaudio.h>
 
 int soundio_pulseaudio_init(struct SoundIoPrivate *si);
+int soundio_pulseaudio_probe(struct SoundIoConnectProbe *probe);
 
 struct SoundIoDevicePulseAudio { };
 
@@ -23,6 +25,9 @@ struct SoundIoPulseAudio {
     bool emitted_shutdown_cb;
 
     pa_context *pulse_context;
+    // introspection operations still outstanding for the scan in progress
+    int scan_ops_pending;
+    // a change arrived while a scan was in progress; scan again when it ends
     bool device_scan_queued;
 
     // the one that we're working on building
@@ -34,11 +39,25 @@ struct SoundIoPulseAudio {
     struct SoundIoDevicesInfo *ready_devices_info;
 
     bool ready_flag;
+    // fails the connection at SoundIoPrivate::connect_deadline while init
+    // is still waiting on the server
+    pa_time_event *connect_timer;
 
     pa_threaded_mainloop *main_loop;
     pa_proplist *props;
 };
 
+// Stream latency as of the last timing update or write, published by the
+// main loop thread and read lock-free by get_latency. A seqlock: seq is odd
+// while the writer is updating the fields, and readers retry when it changed
+// under them. Times are in microseconds.
+struct SoundIoPulseAudioTiming {
+    atomic_long seq;
+    atomic_long latency;
+    atomic_long snapshot_time;
+    atomic_bool playing;
+};
+
 struct SoundIoOutStreamPulseAudio {
     pa_stream *stream;
     atomic_bool stream_ready;
@@ -46,6 +65,9 @@ struct SoundIoOutStreamPulseAudio {
     char *write_ptr;
     size_t write_byte_count;
     atomic_flag clear_buffer_flag;
+    // set once pa_stream_drain has been issued; write requests are ignored
+    atomic_bool draining;
+    SoundIoPulseAudioTiming timing;
     SoundIoChannelArea areas[SOUNDIO_MAX_CHANNELS];
 };
 
@@ -53,11 +75,15 @@ struct SoundIoInStreamPulseAudio {
     pa_stream *stream;
     atomic_bool stream_ready;
     pa_buffer_attr buffer_attr;
+    // the fragment being read in place, or null when reading from ring_buffer
     char *peek_buf;
     size_t peek_buf_index;
     size_t peek_buf_size;
-    int peek_buf_frames_left;
     int read_frame_count;
+    // fragments are copied here when more than one is pending, so that
+    // everything captured so far can be read in one contiguous run
+    struct SoundIoRingBuffer ring_buffer;
+    SoundIoPulseAudioTiming timing;
     SoundIoChannelArea areas[SOUNDIO_MAX_CHANNELS];
 };
 
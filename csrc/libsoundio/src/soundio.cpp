@@ -63,6 +63,26 @@ static int (*backend_init_fns[])(SoundIoPrivate *) = {
     [SoundIoBackendDummy] = soundio_dummy_init,
 };
 
+// Backends which talk to a server, which may be slow to answer or never
+// answer. soundio_connect_timeout checks them before connecting.
+static int (*backend_probe_fns[])(SoundIoConnectProbe *) = {
+    [SoundIoBackendNone] = nullptr,
+#ifdef SOUNDIO_HAVE_JACK
+    [SoundIoBackendJack] = soundio_jack_probe,
+#else
+    [SoundIoBackendJack] = nullptr,
+#endif
+#ifdef SOUNDIO_HAVE_PULSEAUDIO
+    [SoundIoBackendPulseAudio] = soundio_pulseaudio_probe,
+#else
+    [SoundIoBackendPulseAudio] = nullptr,
+#endif
+    [SoundIoBackendAlsa] = nullptr,
+    [SoundIoBackendCoreAudio] = nullptr,
+    [SoundIoBackendWasapi] = nullptr,
+    [SoundIoBackendDummy] = nullptr,
+};
+
 const char *soundio_strerror(int error) {
     switch ((enum SoundIoError)error) {
         case SoundIoErrorNone: return "(no error)";
@@ -81,6 +101,7 @@ const char *soundio_strerror(int error) {
         case SoundIoErrorInterrupted: return "interrupted; try again";
         case SoundIoErrorUnderflow: return "buffer underflow";
         case SoundIoErrorEncodingString: return "failed to encode string";
+        case SoundIoErrorNotProbed: return "device not probed";
     }
     return "(invalid error)";
 }
@@ -105,6 +126,8 @@ int soundio_get_bytes_per_sample(enum SoundIoFormat format) {
     case SoundIoFormatFloat32BE:  return 4;
     case SoundIoFormatFloat64LE:  return 8;
     case SoundIoFormatFloat64BE:  return 8;
+    case SoundIoFormatS24PackedLE: return 3;
+    case SoundIoFormatS24PackedBE: return 3;
 
     case SoundIoFormatInvalid:    return -1;
     }
@@ -131,6 +154,8 @@ const char * soundio_format_string(enum SoundIoFormat format) {
     case SoundIoFormatFloat32BE:  return "float 32-bit BE";
     case SoundIoFormatFloat64LE:  return "float 64-bit LE";
     case SoundIoFormatFloat64BE:  return "float 64-bit BE";
+    case SoundIoFormatS24PackedLE: return "signed 24-bit packed LE";
+    case SoundIoFormatS24PackedBE: return "signed 24-bit packed BE";
 
     case SoundIoFormatInvalid:
         return "(invalid sample format)";
@@ -157,6 +182,20 @@ void soundio_destroy(struct SoundIo *soundio) {
 
     soundio_disconnect(soundio);
 
+    if (si) {
+        int event_fd = si->event_fd.load();
+        if (event_fd != -1)
+            soundio_os_event_fd_destroy(event_fd);
+
+        si->watched_outstreams.deinit();
+        si->watched_instreams.deinit();
+        si->drainable_outstreams.deinit();
+        si->report_outstreams.deinit();
+        si->report_instreams.deinit();
+        soundio_os_mutex_destroy(si->watchdog_mutex);
+        soundio_os_semaphore_destroy(si->report_sem);
+    }
+
     free(si);
 }
 
@@ -184,6 +223,18 @@ struct SoundIo *soundio_create(void) {
     if (!si)
         return nullptr;
     SoundIo *soundio = &si->pub;
+    si->event_fd.store(-1);
+    si->watchdog_mutex = soundio_os_mutex_create();
+    if (!si->watchdog_mutex) {
+        free(si);
+        return nullptr;
+    }
+    si->report_sem = soundio_os_semaphore_create();
+    if (!si->report_sem) {
+        soundio_os_mutex_destroy(si->watchdog_mutex);
+        free(si);
+        return nullptr;
+    }
     soundio->on_devices_change = do_nothing_cb;
     soundio->on_backend_disconnect = default_backend_disconnect_cb;
     soundio->on_events_signal = do_nothing_cb;
@@ -209,6 +260,155 @@ int soundio_connect(struct SoundIo *soundio) {
     return err;
 }
 
+static void release_connect_probe(SoundIoConnectProbe *probe) {
+    if (probe->ref_count.fetch_sub(1) != 1)
+        return;
+    if (probe->handoff)
+        probe->release_handoff(probe->handoff);
+    if (probe->cond)
+        soundio_os_cond_destroy(probe->cond);
+    if (probe->mutex)
+        soundio_os_mutex_destroy(probe->mutex);
+    free(probe->app_name);
+    free(probe);
+}
+
+static void connect_probe_run(void *arg) {
+    SoundIoConnectProbe *probe = (SoundIoConnectProbe *)arg;
+
+    int err = backend_probe_fns[probe->backend](probe);
+
+    soundio_os_mutex_lock(probe->mutex);
+    probe->err = err;
+    probe->done = true;
+    soundio_os_cond_signal(probe->cond, probe->mutex);
+    soundio_os_mutex_unlock(probe->mutex);
+
+    release_connect_probe(probe);
+}
+
+static int start_connect_probe(SoundIoPrivate *si, SoundIoBackend backend,
+        double deadline, SoundIoConnectProbe **out_probe)
+{
+    SoundIo *soundio = &si->pub;
+
+    SoundIoConnectProbe *probe = allocate<SoundIoConnectProbe>(1);
+    if (!probe)
+        return SoundIoErrorNoMem;
+    probe->ref_count.store(1);
+    probe->backend = backend;
+    probe->deadline = deadline;
+    probe->jack_info_callback = soundio->jack_info_callback;
+    probe->jack_error_callback = soundio->jack_error_callback;
+
+    probe->app_name = strdup(soundio->app_name);
+    probe->mutex = soundio_os_mutex_create();
+    probe->cond = soundio_os_cond_create();
+    if (!probe->app_name || !probe->mutex || !probe->cond) {
+        release_connect_probe(probe);
+        return SoundIoErrorNoMem;
+    }
+
+    SoundIoOsThread *thread;
+    probe->ref_count.store(2);
+    int err;
+    if ((err = soundio_os_thread_create(connect_probe_run, probe, nullptr, &thread))) {
+        probe->ref_count.store(1);
+        release_connect_probe(probe);
+        return err;
+    }
+    soundio_os_thread_detach(thread);
+
+    *out_probe = probe;
+    return 0;
+}
+
+// Waits until the probe finishes or the deadline passes, and then lets go of
+// it. On success the probe's connection, if any, moves to
+// SoundIoPrivate::connect_handoff.
+static int finish_connect_probe(SoundIoPrivate *si, SoundIoConnectProbe *probe) {
+    int err = SoundIoErrorInitAudioBackend;
+
+    soundio_os_mutex_lock(probe->mutex);
+    for (;;) {
+        if (probe->done) {
+            err = probe->err;
+            if (!err) {
+                si->connect_handoff = probe->handoff;
+                probe->handoff = nullptr;
+            }
+            break;
+        }
+        double remaining = probe->deadline - soundio_os_get_time();
+        if (remaining <= 0.0)
+            break;
+        soundio_os_cond_timed_wait(probe->cond, probe->mutex, remaining);
+    }
+    soundio_os_mutex_unlock(probe->mutex);
+
+    probe->abort.store(true);
+    release_connect_probe(probe);
+    return err;
+}
+
+int soundio_connect_timeout(struct SoundIo *soundio, double timeout) {
+    SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+
+    if (soundio->current_backend)
+        return SoundIoErrorInvalid;
+
+    double deadline = soundio_os_get_time() + timeout;
+
+    SoundIoConnectProbe *probes[SoundIoBackendDummy + 1] = {};
+    int err = 0;
+    for (int i = 0; i < array_length(available_backends); i += 1) {
+        SoundIoBackend backend = available_backends[i];
+        if (backend_probe_fns[backend] && (err = start_connect_probe(si, backend, deadline, &probes[backend])))
+            break;
+    }
+
+    if (!err) {
+        err = SoundIoErrorInitAudioBackend;
+        for (int i = 0; i < array_length(available_backends); i += 1) {
+            SoundIoBackend backend = available_backends[i];
+            if (probes[backend]) {
+                err = finish_connect_probe(si, probes[backend]);
+                probes[backend] = nullptr;
+                if (err == SoundIoErrorInitAudioBackend)
+                    continue;
+                if (err)
+                    break;
+            }
+            si->connect_deadline = deadline;
+            err = soundio_connect_backend(soundio, backend);
+            si->connect_deadline = 0.0;
+            // backend inits take the connection over before anything can fail
+            assert(!si->connect_handoff);
+            if (err != SoundIoErrorInitAudioBackend)
+                break;
+        }
+    }
+
+    // the servers after the one which answered are not needed any more
+    for (int i = 0; i < array_length(probes); i += 1) {
+        if (probes[i]) {
+            probes[i]->abort.store(true);
+            release_connect_probe(probes[i]);
+        }
+    }
+    return err;
+}
+
+static void report_thread_run(void *arg) {
+    SoundIoPrivate *si = (SoundIoPrivate *)arg;
+    for (;;) {
+        soundio_os_semaphore_wait(si->report_sem);
+        if (si->report_thread_abort.load())
+            return;
+        si->wakeup(si);
+    }
+}
+
 int soundio_connect_backend(SoundIo *soundio, SoundIoBackend backend) {
     SoundIoPrivate *si = (SoundIoPrivate *)soundio;
 
@@ -230,6 +430,12 @@ int soundio_connect_backend(SoundIo *soundio, SoundIoBackend backend) {
     }
     soundio->current_backend = backend;
 
+    si->report_thread_abort.store(false);
+    if ((err = soundio_os_thread_create(report_thread_run, si, nullptr, &si->report_thread))) {
+        soundio_disconnect(soundio);
+        return err;
+    }
+
     return 0;
 }
 
@@ -239,6 +445,13 @@ void soundio_disconnect(struct SoundIo *soundio) {
     if (!si)
         return;
 
+    if (si->report_thread) {
+        si->report_thread_abort.store(true);
+        soundio_os_semaphore_post(si->report_sem);
+        soundio_os_thread_destroy(si->report_thread);
+        si->report_thread = nullptr;
+    }
+
     if (si->destroy)
         si->destroy(si);
     memset(&si->backend_data, 0, sizeof(SoundIoBackendData));
@@ -262,6 +475,8 @@ void soundio_disconnect(struct SoundIo *soundio) {
     si->outstream_clear_buffer = nullptr;
     si->outstream_pause = nullptr;
     si->outstream_get_latency = nullptr;
+    si->outstream_get_timestamp = nullptr;
+    si->outstream_drain = nullptr;
 
     si->instream_open = nullptr;
     si->instream_destroy = nullptr;
@@ -270,12 +485,141 @@ void soundio_disconnect(struct SoundIo *soundio) {
     si->instream_end_read = nullptr;
     si->instream_pause = nullptr;
     si->instream_get_latency = nullptr;
+    si->instream_get_timestamp = nullptr;
+
+    si->duplex_stream_open = nullptr;
+    si->duplex_stream_destroy = nullptr;
+    si->duplex_stream_start = nullptr;
+}
+
+static void drain_event_fd(SoundIoPrivate *si) {
+    int event_fd = si->event_fd.load();
+    if (event_fd != -1)
+        soundio_os_event_fd_drain(event_fd);
+}
+
+void soundio_signal_events(SoundIoPrivate *si) {
+    int event_fd = si->event_fd.load();
+    if (event_fd != -1)
+        soundio_os_event_fd_signal(event_fd);
+    si->pub.on_events_signal(&si->pub);
+}
+
+int soundio_get_event_fd(struct SoundIo *soundio, int *out_fd) {
+    SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+    int event_fd = si->event_fd.load();
+    if (event_fd == -1) {
+        int err;
+        if ((err = soundio_os_event_fd_create(&event_fd)))
+            return err;
+        int expected = -1;
+        if (!si->event_fd.compare_exchange_strong(expected, event_fd)) {
+            soundio_os_event_fd_destroy(event_fd);
+            event_fd = expected;
+        }
+        // Events may have been signaled before the fd existed.
+        soundio_os_event_fd_signal(event_fd);
+    }
+    *out_fd = event_fd;
+    return 0;
+}
+
+template <typename T>
+static bool list_contains(SoundIoList<T *> *list, T *item) {
+    for (int i = 0; i < list->length; i += 1) {
+        if (list->at(i) == item)
+            return true;
+    }
+    return false;
+}
+
+template <typename T>
+static int copy_list(SoundIoList<T *> *dest, SoundIoList<T *> *src) {
+    int err;
+    if ((err = dest->resize(src->length)))
+        return err;
+    for (int i = 0; i < src->length; i += 1)
+        dest->at(i) = src->at(i);
+    return 0;
+}
+
+// The callbacks may destroy streams, so each stream in the snapshot is
+// looked up again before it is reported, and the mutex is not held while
+// calling them. Streams opened by a callback are reported next time.
+static void report_deadline_misses(SoundIoPrivate *si) {
+    soundio_os_mutex_lock(si->watchdog_mutex);
+    int err = copy_list(&si->report_outstreams, &si->watched_outstreams);
+    if (!err)
+        err = copy_list(&si->report_instreams, &si->watched_instreams);
+    soundio_os_mutex_unlock(si->watchdog_mutex);
+    // the counters are left alone, so the misses are reported next time
+    if (err) {
+        si->reports_pending.store(true);
+        return;
+    }
+
+    for (int i = 0; i < si->report_outstreams.length; i += 1) {
+        SoundIoOutStreamPrivate *os = si->report_outstreams.at(i);
+        SoundIoOutStream *outstream = &os->pub;
+        soundio_os_mutex_lock(si->watchdog_mutex);
+        long miss_count = 0;
+        if (list_contains(&si->watched_outstreams, os) && outstream->on_deadline_miss)
+            miss_count = os->watchdog.unreported_miss_count.exchange(0);
+        soundio_os_mutex_unlock(si->watchdog_mutex);
+        if (miss_count > 0)
+            outstream->on_deadline_miss(outstream, miss_count);
+    }
+    for (int i = 0; i < si->report_instreams.length; i += 1) {
+        SoundIoInStreamPrivate *is = si->report_instreams.at(i);
+        SoundIoInStream *instream = &is->pub;
+        soundio_os_mutex_lock(si->watchdog_mutex);
+        long miss_count = 0;
+        if (list_contains(&si->watched_instreams, is) && instream->on_deadline_miss)
+            miss_count = is->watchdog.unreported_miss_count.exchange(0);
+        soundio_os_mutex_unlock(si->watchdog_mutex);
+        if (miss_count > 0)
+            instream->on_deadline_miss(instream, miss_count);
+    }
+}
+
+static void report_drained_streams(SoundIoPrivate *si) {
+    // See report_deadline_misses.
+    soundio_os_mutex_lock(si->watchdog_mutex);
+    int err = copy_list(&si->report_outstreams, &si->drainable_outstreams);
+    soundio_os_mutex_unlock(si->watchdog_mutex);
+    if (err) {
+        si->reports_pending.store(true);
+        return;
+    }
+
+    for (int i = 0; i < si->report_outstreams.length; i += 1) {
+        SoundIoOutStreamPrivate *os = si->report_outstreams.at(i);
+        SoundIoOutStream *outstream = &os->pub;
+        soundio_os_mutex_lock(si->watchdog_mutex);
+        bool drained = list_contains(&si->drainable_outstreams, os) &&
+            outstream->on_drained && os->drained.exchange(false);
+        soundio_os_mutex_unlock(si->watchdog_mutex);
+        if (drained)
+            outstream->on_drained(outstream);
+    }
+}
+
+static void report_events(SoundIoPrivate *si) {
+    // Cleared first so that anything recorded from here on is seen by the
+    // next call.
+    si->reports_pending.store(false);
+    report_deadline_misses(si);
+    report_drained_streams(si);
 }
 
 void soundio_flush_events(struct SoundIo *soundio) {
     assert(soundio->current_backend != SoundIoBackendNone);
     SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+    // Drain before flushing so that events arriving during the flush leave
+    // the fd readable.
+    drain_event_fd(si);
     si->flush_events(si);
+    report_events(si);
 }
 
 int soundio_input_device_count(struct SoundIo *soundio) {
@@ -380,11 +724,11 @@ void soundio_device_unref(struct SoundIoDevice *device) {
     if (!device)
         return;
 
-    device->ref_count -= 1;
-    assert(device->ref_count >= 0);
+    SoundIoDevicePrivate *dev = (SoundIoDevicePrivate *)device;
+    int ref_count = dev->ref_count.fetch_sub(1) - 1;
+    assert(ref_count >= 0);
 
-    if (device->ref_count == 0) {
-        SoundIoDevicePrivate *dev = (SoundIoDevicePrivate *)device;
+    if (ref_count == 0) {
         if (dev->destruct)
             dev->destruct(dev);
 
@@ -410,12 +754,19 @@ void soundio_device_unref(struct SoundIoDevice *device) {
 
 void soundio_device_ref(struct SoundIoDevice *device) {
     assert(device);
-    device->ref_count += 1;
+    SoundIoDevicePrivate *dev = (SoundIoDevicePrivate *)device;
+    dev->ref_count.fetch_add(1);
 }
 
 void soundio_wait_events(struct SoundIo *soundio) {
     SoundIoPrivate *si = (SoundIoPrivate *)soundio;
-    si->wait_events(si);
+    drain_event_fd(si);
+    // A wakeup from report_thread before wait_events blocks would be lost.
+    if (si->reports_pending.load())
+        si->flush_events(si);
+    else
+        si->wait_events(si);
+    report_events(si);
 }
 
 void soundio_wakeup(struct SoundIo *soundio) {
@@ -476,7 +827,7 @@ int soundio_outstream_open(struct SoundIoOutStream *outstream) {
     if (device->aim != SoundIoDeviceAimOutput)
         return SoundIoErrorInvalid;
 
-    if (device->probe_error)
+    if (soundio_device_probe(device))
         return device->probe_error;
 
     if (outstream->layout.channel_count > SOUNDIO_MAX_CHANNELS)
@@ -504,7 +855,23 @@ int soundio_outstream_open(struct SoundIoOutStream *outstream) {
 
     SoundIo *soundio = device->soundio;
     SoundIoPrivate *si = (SoundIoPrivate *)soundio;
-    return si->outstream_open(si, os);
+    int err;
+    if ((err = si->outstream_open(si, os)))
+        return err;
+
+    if (si->outstream_drain) {
+        soundio_os_mutex_lock(si->watchdog_mutex);
+        err = si->drainable_outstreams.append(os);
+        soundio_os_mutex_unlock(si->watchdog_mutex);
+        if (err)
+            return SoundIoErrorNoMem;
+    }
+
+    // Backends which adapt the fill level overwrite this.
+    if (!os->xruns.fill_frames.load())
+        os->xruns.fill_frames.store((long)(outstream->software_latency * outstream->sample_rate));
+
+    return 0;
 }
 
 void soundio_outstream_destroy(SoundIoOutStream *outstream) {
@@ -518,6 +885,21 @@ void soundio_outstream_destroy(SoundIoOutStream *outstream) {
     if (si->outstream_destroy)
         si->outstream_destroy(si, os);
 
+    soundio_os_mutex_lock(si->watchdog_mutex);
+    for (int i = 0; i < si->watched_outstreams.length; i += 1) {
+        if (si->watched_outstreams.at(i) == os) {
+            si->watched_outstreams.swap_remove(i);
+            break;
+        }
+    }
+    for (int i = 0; i < si->drainable_outstreams.length; i += 1) {
+        if (si->drainable_outstreams.at(i) == os) {
+            si->drainable_outstreams.swap_remove(i);
+            break;
+        }
+    }
+    soundio_os_mutex_unlock(si->watchdog_mutex);
+
     soundio_device_unref(outstream->device);
     free(os);
 }
@@ -526,6 +908,13 @@ int soundio_outstream_start(struct SoundIoOutStream *outstream) {
     SoundIo *soundio = outstream->device->soundio;
     SoundIoPrivate *si = (SoundIoPrivate *)soundio;
     SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)outstream;
+    if (outstream->watchdog) {
+        soundio_os_mutex_lock(si->watchdog_mutex);
+        int err = si->watched_outstreams.append(os);
+        soundio_os_mutex_unlock(si->watchdog_mutex);
+        if (err)
+            return SoundIoErrorNoMem;
+    }
     return si->outstream_start(si, os);
 }
 
@@ -543,6 +932,30 @@ int soundio_outstream_clear_buffer(struct SoundIoOutStream *outstream) {
     return si->outstream_clear_buffer(si, os);
 }
 
+int soundio_outstream_drain(struct SoundIoOutStream *outstream) {
+    SoundIo *soundio = outstream->device->soundio;
+    SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)outstream;
+    if (!si->outstream_drain)
+        return SoundIoErrorIncompatibleBackend;
+    if (os->drain_requested.exchange(true))
+        return 0;
+    return si->outstream_drain(si, os);
+}
+
+// Called from audio threads, so wait_events is woken by report_thread.
+static void signal_reports(SoundIoPrivate *si) {
+    si->reports_pending.store(true);
+    soundio_signal_events(si);
+    soundio_os_semaphore_post(si->report_sem);
+}
+
+void soundio_outstream_report_drained(SoundIoOutStreamPrivate *os) {
+    SoundIoPrivate *si = (SoundIoPrivate *)os->pub.device->soundio;
+    os->drained.store(true);
+    signal_reports(si);
+}
+
 int soundio_outstream_get_latency(struct SoundIoOutStream *outstream, double *out_latency) {
     SoundIo *soundio = outstream->device->soundio;
     SoundIoPrivate *si = (SoundIoPrivate *)soundio;
@@ -550,6 +963,112 @@ int soundio_outstream_get_latency(struct SoundIoOutStream *outstream, double *ou
     return si->outstream_get_latency(si, os, out_latency);
 }
 
+// Seconds until the device runs dry (output) or over (input) if the
+// callback took longer.
+static double watchdog_deadline(SoundIoWatchdog *wd, int frame_count_max, int sample_rate) {
+    int frame_count = (wd->buffer_frames > 0) ? wd->buffer_frames - frame_count_max : frame_count_max;
+    return frame_count / (double)sample_rate;
+}
+
+static void watchdog_record(SoundIoPrivate *si, SoundIoWatchdog *wd,
+        double duration, double deadline)
+{
+    // nothing buffered yet, so there is nothing to miss
+    if (deadline <= 0.0)
+        return;
+
+    wd->callback_count += 1;
+
+    long duration_us = (long)(duration * 1000000.0);
+    long max_duration = wd->max_duration.load();
+    while (duration_us > max_duration &&
+            !wd->max_duration.compare_exchange_weak(max_duration, duration_us))
+    { }
+
+    int bucket = min((int)(duration / deadline * 10.0), SOUNDIO_CALLBACK_LOAD_BUCKETS - 1);
+    wd->load_histogram[bucket] += 1;
+
+    if (bucket == SOUNDIO_CALLBACK_LOAD_BUCKETS - 1) {
+        wd->miss_count += 1;
+        // Only the first unreported miss needs to wake up the event loop.
+        if (wd->unreported_miss_count.fetch_add(1) == 0)
+            signal_reports(si);
+    }
+}
+
+static void xrun_record(SoundIoXrunCounters *xruns) {
+    xruns->xrun_count += 1;
+    xruns->last_xrun_time.store((long)(soundio_os_get_time() * 1000000.0));
+}
+
+static void xrun_get_stats(SoundIoXrunCounters *xruns, int sample_rate,
+        SoundIoXrunStats *out_stats)
+{
+    out_stats->xrun_count = xruns->xrun_count.load();
+    out_stats->last_xrun_time = xruns->last_xrun_time.load() / 1000000.0;
+    out_stats->fill_time = xruns->fill_frames.load() / (double)sample_rate;
+    out_stats->grow_count = xruns->grow_count.load();
+    out_stats->shrink_count = xruns->shrink_count.load();
+}
+
+static void watchdog_get_stats(SoundIoWatchdog *wd, SoundIoCallbackStats *out_stats) {
+    out_stats->callback_count = wd->callback_count.load();
+    out_stats->deadline_miss_count = wd->miss_count.load();
+    out_stats->max_duration = wd->max_duration.load() / 1000000.0;
+    for (int i = 0; i < SOUNDIO_CALLBACK_LOAD_BUCKETS; i += 1)
+        out_stats->load_histogram[i] = wd->load_histogram[i].load();
+}
+
+void soundio_outstream_run_write_callback(SoundIoOutStreamPrivate *os,
+        int frame_count_min, int frame_count_max)
+{
+    SoundIoOutStream *outstream = &os->pub;
+    if (!outstream->watchdog) {
+        outstream->write_callback(outstream, frame_count_min, frame_count_max);
+        return;
+    }
+    double start_time = soundio_os_get_time();
+    outstream->write_callback(outstream, frame_count_min, frame_count_max);
+    double duration = soundio_os_get_time() - start_time;
+    SoundIoPrivate *si = (SoundIoPrivate *)outstream->device->soundio;
+    watchdog_record(si, &os->watchdog, duration,
+            watchdog_deadline(&os->watchdog, frame_count_max, outstream->sample_rate));
+}
+
+void soundio_outstream_run_underflow_callback(SoundIoOutStreamPrivate *os) {
+    SoundIoOutStream *outstream = &os->pub;
+    xrun_record(&os->xruns);
+    outstream->underflow_callback(outstream);
+}
+
+void soundio_outstream_get_xrun_stats(struct SoundIoOutStream *outstream,
+        struct SoundIoXrunStats *out_stats)
+{
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)outstream;
+    xrun_get_stats(&os->xruns, outstream->sample_rate, out_stats);
+}
+
+int soundio_outstream_get_timestamp(struct SoundIoOutStream *outstream,
+        struct SoundIoTimestamp *out_timestamp)
+{
+    SoundIo *soundio = outstream->device->soundio;
+    SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)outstream;
+    if (!si->outstream_get_timestamp)
+        return SoundIoErrorIncompatibleBackend;
+    return si->outstream_get_timestamp(si, os, out_timestamp);
+}
+
+int soundio_outstream_get_callback_stats(struct SoundIoOutStream *outstream,
+        struct SoundIoCallbackStats *out_stats)
+{
+    SoundIoOutStreamPrivate *os = (SoundIoOutStreamPrivate *)outstream;
+    if (!outstream->watchdog)
+        return SoundIoErrorInvalid;
+    watchdog_get_stats(&os->watchdog, out_stats);
+    return 0;
+}
+
 static void default_instream_error_callback(struct SoundIoInStream *is, int err) {
     soundio_panic("libsoundio: %s", soundio_strerror(err));
 }
@@ -585,7 +1104,7 @@ int soundio_instream_open(struct SoundIoInStream *instream) {
     if (instream->layout.channel_count > SOUNDIO_MAX_CHANNELS)
         return SoundIoErrorInvalid;
 
-    if (device->probe_error)
+    if (soundio_device_probe(device))
         return device->probe_error;
 
     if (instream->format == SoundIoFormatInvalid) {
@@ -607,13 +1126,26 @@ int soundio_instream_open(struct SoundIoInStream *instream) {
     SoundIo *soundio = device->soundio;
     SoundIoPrivate *si = (SoundIoPrivate *)soundio;
     SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *)instream;
-    return si->instream_open(si, is);
+    int err;
+    if ((err = si->instream_open(si, is)))
+        return err;
+
+    is->xruns.fill_frames.store((long)(instream->software_latency * instream->sample_rate));
+
+    return 0;
 }
 
 int soundio_instream_start(struct SoundIoInStream *instream) {
     SoundIo *soundio = instream->device->soundio;
     SoundIoPrivate *si = (SoundIoPrivate *)soundio;
     SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *)instream;
+    if (instream->watchdog) {
+        soundio_os_mutex_lock(si->watchdog_mutex);
+        int err = si->watched_instreams.append(is);
+        soundio_os_mutex_unlock(si->watchdog_mutex);
+        if (err)
+            return SoundIoErrorNoMem;
+    }
     return si->instream_start(si, is);
 }
 
@@ -628,6 +1160,15 @@ void soundio_instream_destroy(struct SoundIoInStream *instream) {
     if (si->instream_destroy)
         si->instream_destroy(si, is);
 
+    soundio_os_mutex_lock(si->watchdog_mutex);
+    for (int i = 0; i < si->watched_instreams.length; i += 1) {
+        if (si->watched_instreams.at(i) == is) {
+            si->watched_instreams.swap_remove(i);
+            break;
+        }
+    }
+    soundio_os_mutex_unlock(si->watchdog_mutex);
+
     soundio_device_unref(instream->device);
     free(is);
 }
@@ -662,6 +1203,119 @@ int soundio_instream_get_latency(struct SoundIoInStream *instream, double *out_l
     return si->instream_get_latency(si, is, out_latency);
 }
 
+void soundio_instream_run_read_callback(SoundIoInStreamPrivate *is,
+        int frame_count_min, int frame_count_max)
+{
+    SoundIoInStream *instream = &is->pub;
+    if (!instream->watchdog) {
+        instream->read_callback(instream, frame_count_min, frame_count_max);
+        return;
+    }
+    double start_time = soundio_os_get_time();
+    instream->read_callback(instream, frame_count_min, frame_count_max);
+    double duration = soundio_os_get_time() - start_time;
+    SoundIoPrivate *si = (SoundIoPrivate *)instream->device->soundio;
+    watchdog_record(si, &is->watchdog, duration,
+            watchdog_deadline(&is->watchdog, frame_count_max, instream->sample_rate));
+}
+
+void soundio_instream_run_overflow_callback(SoundIoInStreamPrivate *is) {
+    SoundIoInStream *instream = &is->pub;
+    xrun_record(&is->xruns);
+    instream->overflow_callback(instream);
+}
+
+void soundio_instream_get_xrun_stats(struct SoundIoInStream *instream,
+        struct SoundIoXrunStats *out_stats)
+{
+    SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *)instream;
+    xrun_get_stats(&is->xruns, instream->sample_rate, out_stats);
+}
+
+int soundio_instream_get_timestamp(struct SoundIoInStream *instream,
+        struct SoundIoTimestamp *out_timestamp)
+{
+    SoundIo *soundio = instream->device->soundio;
+    SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+    SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *)instream;
+    if (!si->instream_get_timestamp)
+        return SoundIoErrorIncompatibleBackend;
+    return si->instream_get_timestamp(si, is, out_timestamp);
+}
+
+int soundio_instream_get_callback_stats(struct SoundIoInStream *instream,
+        struct SoundIoCallbackStats *out_stats)
+{
+    SoundIoInStreamPrivate *is = (SoundIoInStreamPrivate *)instream;
+    if (!instream->watchdog)
+        return SoundIoErrorInvalid;
+    watchdog_get_stats(&is->watchdog, out_stats);
+    return 0;
+}
+
+static void default_duplex_stream_error_callback(struct SoundIoDuplexStream *duplex, int err) {
+    soundio_panic("libsoundio: %s", soundio_strerror(err));
+}
+
+struct SoundIoDuplexStream *soundio_duplex_stream_create(struct SoundIoOutStream *outstream,
+        struct SoundIoInStream *instream)
+{
+    SoundIoDuplexStreamPrivate *ds = allocate<SoundIoDuplexStreamPrivate>(1);
+    if (!ds)
+        return nullptr;
+    SoundIoDuplexStream *duplex = &ds->pub;
+
+    duplex->outstream = outstream;
+    duplex->instream = instream;
+    duplex->error_callback = default_duplex_stream_error_callback;
+
+    return duplex;
+}
+
+int soundio_duplex_stream_open(struct SoundIoDuplexStream *duplex) {
+    SoundIoDuplexStreamPrivate *ds = (SoundIoDuplexStreamPrivate *)duplex;
+    SoundIoOutStream *outstream = duplex->outstream;
+    SoundIoInStream *instream = duplex->instream;
+
+    if (!duplex->duplex_callback)
+        return SoundIoErrorInvalid;
+
+    if (outstream->device->soundio != instream->device->soundio)
+        return SoundIoErrorInvalid;
+
+    if (outstream->sample_rate != instream->sample_rate)
+        return SoundIoErrorInvalid;
+
+    SoundIo *soundio = outstream->device->soundio;
+    SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+    if (!si->duplex_stream_open)
+        return SoundIoErrorIncompatibleBackend;
+    return si->duplex_stream_open(si, ds);
+}
+
+void soundio_duplex_stream_destroy(struct SoundIoDuplexStream *duplex) {
+    if (!duplex)
+        return;
+
+    SoundIoDuplexStreamPrivate *ds = (SoundIoDuplexStreamPrivate *)duplex;
+    SoundIo *soundio = duplex->outstream->device->soundio;
+    SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+
+    if (si->duplex_stream_destroy)
+        si->duplex_stream_destroy(si, ds);
+
+    free(ds);
+}
+
+int soundio_duplex_stream_start(struct SoundIoDuplexStream *duplex) {
+    SoundIoDuplexStreamPrivate *ds = (SoundIoDuplexStreamPrivate *)duplex;
+    SoundIo *soundio = duplex->outstream->device->soundio;
+    SoundIoPrivate *si = (SoundIoPrivate *)soundio;
+    if (!si->duplex_stream_start)
+        return SoundIoErrorIncompatibleBackend;
+    return si->duplex_stream_start(si, ds);
+}
+
 void soundio_destroy_devices_info(SoundIoDevicesInfo *devices_info) {
     if (!devices_info)
         return;
@@ -732,11 +1386,22 @@ void soundio_sort_channel_layouts(struct SoundIoChannelLayout *layouts, int layo
     qsort(layouts, layouts_count, sizeof(SoundIoChannelLayout), compare_layouts);
 }
 
+int soundio_device_probe(struct SoundIoDevice *device) {
+    SoundIoDevicePrivate *dev = (SoundIoDevicePrivate *)device;
+    if (device->probe_error != SoundIoErrorNotProbed)
+        return device->probe_error;
+    assert(dev->probe);
+    device->probe_error = dev->probe(dev);
+    return device->probe_error;
+}
+
 void soundio_device_sort_channel_layouts(struct SoundIoDevice *device) {
+    soundio_device_probe(device);
     soundio_sort_channel_layouts(device->layouts, device->layout_count);
 }
 
 bool soundio_device_supports_format(struct SoundIoDevice *device, enum SoundIoFormat format) {
+    soundio_device_probe(device);
     for (int i = 0; i < device->format_count; i += 1) {
         if (device->formats[i] == format)
             return true;
@@ -747,6 +1412,7 @@ bool soundio_device_supports_format(struct SoundIoDevice *device, enum SoundIoFo
 bool soundio_device_supports_layout(struct SoundIoDevice *device,
         const struct SoundIoChannelLayout *layout)
 {
+    soundio_device_probe(device);
     for (int i = 0; i < device->layout_count; i += 1) {
         if (soundio_channel_layout_equal(&device->layouts[i], layout))
             return true;
@@ -755,6 +1421,7 @@ bool soundio_device_supports_layout(struct SoundIoDevice *device,
 }
 
 bool soundio_device_supports_sample_rate(struct SoundIoDevice *device, int sample_rate) {
+    soundio_device_probe(device);
     for (int i = 0; i < device->sample_rate_count; i += 1) {
         SoundIoSampleRateRange *range = &device->sample_rates[i];
         if (sample_rate >= range->min && sample_rate <= range->max)
@@ -769,6 +1436,7 @@ static int abs_diff_int(int a, int b) {
 }
 
 int soundio_device_nearest_sample_rate(struct SoundIoDevice *device, int sample_rate) {
+    soundio_device_probe(device);
     int best_rate = -1;
     int best_delta = -1;
     for (int i = 0; i < device->sample_rate_count; i += 1) {
@@ -10,6 +10,8 @@
 
 #include "soundio_private.h"
 #include "list.hpp"
+#include "atomics.hpp"
+#include "os.h"
 
 #ifdef SOUNDIO_HAVE_JACK
 #include "jack.hpp"
@@ -109,6 +111,39 @@ union SoundIoInStreamBackendData {
     SoundIoInStreamDummy dummy;
 };
 
+union SoundIoDuplexStreamBackendData {
+#ifdef SOUNDIO_HAVE_ALSA
+    SoundIoDuplexStreamAlsa alsa;
+#endif
+    // only ALSA supports duplex streams
+    char none;
+};
+
+// Checks on its own thread whether the server of a backend answers, for
+// soundio_connect_timeout. The thread is detached and the probe is shared
+// with it, so an attempt which cannot be cut short never blocks the
+// application; whichever lets go last frees the probe.
+struct SoundIoConnectProbe {
+    SoundIoBackend backend;
+    // copied from the SoundIo, which the probe may outlive
+    char *app_name;
+    void (*jack_info_callback)(const char *msg);
+    void (*jack_error_callback)(const char *msg);
+    double deadline;
+    // set when the result is no longer wanted
+    atomic_bool abort;
+    atomic_int ref_count;
+    SoundIoOsMutex *mutex;
+    SoundIoOsCond *cond;
+    // protected by mutex
+    bool done;
+    int err;
+    // A connection which the backend init can take over, or null.
+    // release_handoff closes it if nobody does.
+    void *handoff;
+    void (*release_handoff)(void *handoff);
+};
+
 struct SoundIoDevicesInfo {
     SoundIoList<SoundIoDevice *> input_devices;
     SoundIoList<SoundIoDevice *> output_devices;
@@ -117,14 +152,52 @@ struct SoundIoDevicesInfo {
     int default_input_index;
 };
 
+// Updated lock-free from the audio thread when the stream's watchdog is on.
+struct SoundIoWatchdog {
+    atomic_long callback_count;
+    atomic_long miss_count;
+    // misses not yet passed to on_deadline_miss
+    atomic_long unreported_miss_count;
+    // microseconds
+    atomic_long max_duration;
+    atomic_long load_histogram[SOUNDIO_CALLBACK_LOAD_BUCKETS];
+    // Frames the callbacks keep filled (output) or drain (input), set by
+    // backends which call back as soon as there is room or data, so that
+    // the deadline is the audio left in the buffer. 0 for backends which
+    // call back once per period, where the period is the deadline.
+    int buffer_frames;
+};
+
+// Updated lock-free by the audio thread, read by get_xrun_stats.
+struct SoundIoXrunCounters {
+    atomic_long xrun_count;
+    // microseconds on the monotonic clock
+    atomic_long last_xrun_time;
+    atomic_long grow_count;
+    atomic_long shrink_count;
+    atomic_long fill_frames;
+};
+
 struct SoundIoOutStreamPrivate {
     SoundIoOutStream pub;
     SoundIoOutStreamBackendData backend_data;
+    SoundIoWatchdog watchdog;
+    SoundIoXrunCounters xruns;
+    atomic_bool drain_requested;
+    // set by the backend, cleared when on_drained is called
+    atomic_bool drained;
 };
 
 struct SoundIoInStreamPrivate {
     SoundIoInStream pub;
     SoundIoInStreamBackendData backend_data;
+    SoundIoWatchdog watchdog;
+    SoundIoXrunCounters xruns;
+};
+
+struct SoundIoDuplexStreamPrivate {
+    SoundIoDuplexStream pub;
+    SoundIoDuplexStreamBackendData backend_data;
 };
 
 struct SoundIoPrivate {
@@ -133,6 +206,39 @@ struct SoundIoPrivate {
     // Safe to read from a single thread without a mutex.
     struct SoundIoDevicesInfo *safe_devices_info;
 
+    // -1 until ::soundio_get_event_fd is called. Read from backend threads.
+    atomic_int event_fd;
+
+    // Started streams with the watchdog enabled, so that flush_events can
+    // report their deadline misses, and open streams of backends which can
+    // drain, so that it can call on_drained. Registered when the stream is
+    // opened so that draining from the write callback takes no lock.
+    // Protected by watchdog_mutex.
+    SoundIoOsMutex *watchdog_mutex;
+    SoundIoList<SoundIoOutStreamPrivate *> watched_outstreams;
+    SoundIoList<SoundIoInStreamPrivate *> watched_instreams;
+    SoundIoList<SoundIoOutStreamPrivate *> drainable_outstreams;
+    // Set by audio threads which have something for flush_events to report.
+    // They cannot call wakeup, which takes the backend's lock, so they post
+    // report_sem and report_thread calls it for them. wait_events also
+    // checks this before blocking, in case the wakeup came too early.
+    atomic_bool reports_pending;
+    SoundIoOsSemaphore *report_sem;
+    SoundIoOsThread *report_thread;
+    atomic_bool report_thread_abort;
+    // Copies of the lists above which flush_events walks, so that callbacks
+    // may open and destroy streams. Only used from the event thread.
+    SoundIoList<SoundIoOutStreamPrivate *> report_outstreams;
+    SoundIoList<SoundIoInStreamPrivate *> report_instreams;
+
+    // Monotonic time by which a backend init should give up, or 0 for no
+    // limit. Set by soundio_connect_timeout.
+    double connect_deadline;
+    // Server connection made by a SoundIoConnectProbe, which the backend
+    // init takes over instead of connecting again. See
+    // SoundIoConnectProbe::handoff.
+    void *connect_handoff;
+
     void (*destroy)(struct SoundIoPrivate *);
     void (*flush_events)(struct SoundIoPrivate *);
     void (*wait_events)(struct SoundIoPrivate *);
@@ -148,6 +254,12 @@ struct SoundIoPrivate {
     int (*outstream_clear_buffer)(struct SoundIoPrivate *, struct SoundIoOutStreamPrivate *);
     int (*outstream_pause)(struct SoundIoPrivate *, struct SoundIoOutStreamPrivate *, bool pause);
     int (*outstream_get_latency)(struct SoundIoPrivate *, struct SoundIoOutStreamPrivate *, double *out_latency);
+    // null for backends which do not report timestamps
+    int (*outstream_get_timestamp)(struct SoundIoPrivate *, struct SoundIoOutStreamPrivate *,
+            struct SoundIoTimestamp *out_timestamp);
+    // null for backends which cannot drain. Must not block; the backend
+    // calls soundio_outstream_report_drained when done.
+    int (*outstream_drain)(struct SoundIoPrivate *, struct SoundIoOutStreamPrivate *);
 
 
     int (*instream_open)(struct SoundIoPrivate *, struct SoundIoInStreamPrivate *);
@@ -158,14 +270,26 @@ struct SoundIoPrivate {
     int (*instream_end_read)(struct SoundIoPrivate *, struct SoundIoInStreamPrivate *);
     int (*instream_pause)(struct SoundIoPrivate *, struct SoundIoInStreamPrivate *, bool pause);
     int (*instream_get_latency)(struct SoundIoPrivate *, struct SoundIoInStreamPrivate *, double *out_latency);
+    int (*instream_get_timestamp)(struct SoundIoPrivate *, struct SoundIoInStreamPrivate *,
+            struct SoundIoTimestamp *out_timestamp);
+
+    // null for backends which do not support duplex streams
+    int (*duplex_stream_open)(struct SoundIoPrivate *, struct SoundIoDuplexStreamPrivate *);
+    void (*duplex_stream_destroy)(struct SoundIoPrivate *, struct SoundIoDuplexStreamPrivate *);
+    int (*duplex_stream_start)(struct SoundIoPrivate *, struct SoundIoDuplexStreamPrivate *);
 
     SoundIoBackendData backend_data;
 };
 
 struct SoundIoDevicePrivate {
     SoundIoDevice pub;
+    // Backend threads hold references too, so the count lives here rather
+    // than in SoundIoDevice::ref_count, which cannot be atomic.
+    atomic_int ref_count;
     SoundIoDeviceBackendData backend_data;
     void (*destruct)(SoundIoDevicePrivate *);
+    // set by backends which list devices with SoundIoErrorNotProbed
+    int (*probe)(SoundIoDevicePrivate *);
     SoundIoSampleRateRange prealloc_sample_rate_range;
     SoundIoList<SoundIoSampleRateRange> sample_rates;
     SoundIoFormat prealloc_format;
@@ -173,6 +297,26 @@ struct SoundIoDevicePrivate {
 
 void soundio_destroy_devices_info(struct SoundIoDevicesInfo *devices_info);
 
+// Backends call this instead of on_events_signal directly so that the
+// event fd is signaled as well. Safe to call from any thread.
+void soundio_signal_events(struct SoundIoPrivate *si);
+
+// Backends call these instead of write_callback and read_callback directly
+// so that the watchdog can time them.
+void soundio_outstream_run_write_callback(struct SoundIoOutStreamPrivate *os,
+        int frame_count_min, int frame_count_max);
+void soundio_instream_run_read_callback(struct SoundIoInStreamPrivate *is,
+        int frame_count_min, int frame_count_max);
+
+// Likewise for underflow_callback and overflow_callback, so that xruns are
+// counted.
+void soundio_outstream_run_underflow_callback(struct SoundIoOutStreamPrivate *os);
+void soundio_instream_run_overflow_callback(struct SoundIoInStreamPrivate *is);
+
+// Called by backends once a drained stream has played its last frame, so
+// that flush_events calls on_drained. Safe to call from any thread.
+void soundio_outstream_report_drained(struct SoundIoOutStreamPrivate *os);
+
 static const int SOUNDIO_MIN_SAMPLE_RATE = 8000;
 static const int SOUNDIO_MAX_SAMPLE_RATE = 5644800;
 
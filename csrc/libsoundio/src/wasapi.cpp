@@ -46,6 +46,7 @@ static SoundIoFormat test_formats[] = {
     SoundIoFormatU8,
     SoundIoFormatS16LE,
     SoundIoFormatS24LE,
+    SoundIoFormatS24PackedLE,
     SoundIoFormatS32LE,
     SoundIoFormatFloat32LE,
     SoundIoFormatFloat64LE,
@@ -214,6 +215,9 @@ static SoundIoFormat from_wave_format_format(WAVEFORMATEXTENSIBLE *wave_format)
         } else if (wave_format->Format.wBitsPerSample == 16) {
             if (is_pcm)
                 return SoundIoFormatS16LE;
+        } else if (wave_format->Format.wBitsPerSample == 24) {
+            if (is_pcm)
+                return SoundIoFormatS24PackedLE;
         } else if (wave_format->Format.wBitsPerSample == 32) {
             if (is_pcm)
                 return SoundIoFormatS32LE;
@@ -317,6 +321,11 @@ static void to_wave_format_format(SoundIoFormat format, WAVEFORMATEXTENSIBLE *wa
         wave_format->Format.wBitsPerSample = 32;
         wave_format->Samples.wValidBitsPerSample = 24;
         break;
+    case SoundIoFormatS24PackedLE:
+        wave_format->SubFormat = SOUNDIO_KSDATAFORMAT_SUBTYPE_PCM;
+        wave_format->Format.wBitsPerSample = 24;
+        wave_format->Samples.wValidBitsPerSample = 24;
+        break;
     case SoundIoFormatS32LE:
         wave_format->SubFormat = SOUNDIO_KSDATAFORMAT_SUBTYPE_PCM;
         wave_format->Format.wBitsPerSample = 32;
@@ -672,7 +681,7 @@ static int refresh_devices(SoundIoPrivate *si) {
         dev_shared->destruct = destruct_device;
         assert(!rd.device_shared);
         rd.device_shared = &dev_shared->pub;
-        rd.device_shared->ref_count = 1;
+        dev_shared->ref_count.store(1);
         rd.device_shared->soundio = soundio;
         rd.device_shared->is_raw = false;
         rd.device_shared->software_latency_max = 2.0;
@@ -686,7 +695,7 @@ static int refresh_devices(SoundIoPrivate *si) {
         dev_raw->destruct = destruct_device;
         assert(!rd.device_raw);
         rd.device_raw = &dev_raw->pub;
-        rd.device_raw->ref_count = 1;
+        dev_raw->ref_count.store(1);
         rd.device_raw->soundio = soundio;
         rd.device_raw->is_raw = true;
         rd.device_raw->software_latency_max = 0.5;
@@ -910,7 +919,7 @@ static int refresh_devices(SoundIoPrivate *si) {
     siw->ready_devices_info = rd.devices_info;
     siw->have_devices_flag = true;
     soundio_os_cond_signal(siw->cond, siw->mutex);
-    soundio->on_events_signal(soundio);
+    soundio_signal_events(si);
     soundio_os_mutex_unlock(siw->mutex);
 
     rd.devices_info = nullptr;
@@ -921,12 +930,11 @@ static int refresh_devices(SoundIoPrivate *si) {
 
 
 static void shutdown_backend(SoundIoPrivate *si, int err) {
-    SoundIo *soundio = &si->pub;
     SoundIoWasapi *siw = &si->backend_data.wasapi;
     soundio_os_mutex_lock(siw->mutex);
     siw->shutdown_err = err;
     soundio_os_cond_signal(siw->cond, siw->mutex);
-    soundio->on_events_signal(soundio);
+    soundio_signal_events(si);
     soundio_os_mutex_unlock(siw->mutex);
 }
 
@@ -1179,6 +1187,9 @@ static int outstream_do_open(SoundIoPrivate *si, SoundIoOutStreamPrivate *os) {
         return SoundIoErrorOpeningDevice;
     }
     outstream->software_latency = osw->buffer_frame_count / (double)outstream->sample_rate;
+    // exclusive mode callbacks fill one whole period at a time
+    if (!osw->is_raw)
+        os->watchdog.buffer_frames = osw->buffer_frame_count;
 
     if (osw->is_raw) {
         if (FAILED(hr = IAudioClient_SetEventHandle(osw->audio_client, osw->h_event))) {
@@ -1241,7 +1252,7 @@ void outstream_shared_run(SoundIoOutStreamPrivate *os) {
         return;
     }
     int frame_count_min = max(0, (int)osw->min_padding_frames - (int)frames_used);
-    outstream->write_callback(outstream, frame_count_min, osw->writable_frame_count);
+    soundio_outstream_run_write_callback(os, frame_count_min, osw->writable_frame_count);
 
     if (FAILED(hr = IAudioClient_Start(osw->audio_client))) {
         outstream->error_callback(outstream, SoundIoErrorStreaming);
@@ -1303,9 +1314,9 @@ void outstream_shared_run(SoundIoOutStreamPrivate *os) {
         osw->writable_frame_count = osw->buffer_frame_count - frames_used;
         if (osw->writable_frame_count > 0) {
             if (frames_used == 0 && !reset_buffer)
-                outstream->underflow_callback(outstream);
+                soundio_outstream_run_underflow_callback(os);
             int frame_count_min = max(0, (int)osw->min_padding_frames - (int)frames_used);
-            outstream->write_callback(outstream, frame_count_min, osw->writable_frame_count);
+            soundio_outstream_run_write_callback(os, frame_count_min, osw->writable_frame_count);
         }
     }
 }
@@ -1316,7 +1327,7 @@ void outstream_raw_run(SoundIoOutStreamPrivate *os) {
 
     HRESULT hr;
 
-    outstream->write_callback(outstream, osw->buffer_frame_count, osw->buffer_frame_count);
+    soundio_outstream_run_write_callback(os, osw->buffer_frame_count, osw->buffer_frame_count);
 
     if (FAILED(hr = IAudioClient_Start(osw->audio_client))) {
         outstream->error_callback(outstream, SoundIoErrorStreaming);
@@ -1344,7 +1355,7 @@ void outstream_raw_run(SoundIoOutStreamPrivate *os) {
             }
         }
 
-        outstream->write_callback(outstream, osw->buffer_frame_count, osw->buffer_frame_count);
+        soundio_outstream_run_write_callback(os, osw->buffer_frame_count, osw->buffer_frame_count);
     }
 }
 
@@ -1397,6 +1408,11 @@ static int outstream_open_wasapi(struct SoundIoPrivate *si, struct SoundIoOutStr
     SoundIoDevice *device = outstream->device;
     SoundIo *soundio = &si->pub;
 
+    // the areas always point into the render client's buffer
+    if (outstream->access_mode == SoundIoAccessModeCopy)
+        return SoundIoErrorIncompatibleDevice;
+    outstream->access_mode = SoundIoAccessModeDirect;
+
     osw->pause_resume_flag.test_and_set();
     osw->clear_buffer_flag.test_and_set();
     osw->desired_pause_state.store(false);
@@ -1420,7 +1436,7 @@ static int outstream_open_wasapi(struct SoundIoPrivate *si, struct SoundIoOutStr
         return SoundIoErrorNoMem;
     }
 
-    if (!(osw->mutex = soundio_os_mutex_create())) {
+    if (!(osw->mutex = soundio_os_mutex_create_pi())) {
         outstream_destroy_wasapi(si, os);
         return SoundIoErrorNoMem;
     }
@@ -1684,6 +1700,8 @@ static int instream_do_open(struct SoundIoPrivate *si, struct SoundIoInStreamPri
     }
     if (isw->is_raw)
         instream->software_latency = isw->buffer_frame_count / (double)instream->sample_rate;
+    else
+        is->watchdog.buffer_frames = isw->buffer_frame_count;
 
     if (isw->is_raw) {
         if (FAILED(hr = IAudioClient_SetEventHandle(isw->audio_client, isw->h_event))) {
@@ -1734,7 +1752,7 @@ static void instream_raw_run(SoundIoInStreamPrivate *is) {
         if (!isw->thread_exit_flag.test_and_set())
             return;
 
-        instream->read_callback(instream, isw->buffer_frame_count, isw->buffer_frame_count);
+        soundio_instream_run_read_callback(is, isw->buffer_frame_count, isw->buffer_frame_count);
     }
 }
 
@@ -1766,7 +1784,7 @@ static void instream_shared_run(SoundIoInStreamPrivate *is) {
 
         isw->readable_frame_count = frames_available;
         if (isw->readable_frame_count > 0)
-            instream->read_callback(instream, 0, isw->readable_frame_count);
+            soundio_instream_run_read_callback(is, 0, isw->readable_frame_count);
     }
 }
 
@@ -1819,6 +1837,11 @@ static int instream_open_wasapi(struct SoundIoPrivate *si, struct SoundIoInStrea
     SoundIoDevice *device = instream->device;
     SoundIo *soundio = &si->pub;
 
+    // the areas always point into the capture client's buffer
+    if (instream->access_mode == SoundIoAccessModeCopy)
+        return SoundIoErrorIncompatibleDevice;
+    instream->access_mode = SoundIoAccessModeDirect;
+
     // All the COM functions are supposed to be called from the same thread. libsoundio API does not
     // restrict the calling thread context in this way. Furthermore, the user might have called
     // CoInitializeEx with a different threading model than Single Threaded Apartment.
@@ -1838,7 +1861,7 @@ static int instream_open_wasapi(struct SoundIoPrivate *si, struct SoundIoInStrea
         return SoundIoErrorNoMem;
     }
 
-    if (!(isw->mutex = soundio_os_mutex_create())) {
+    if (!(isw->mutex = soundio_os_mutex_create_pi())) {
         instream_destroy_wasapi(si, is);
         return SoundIoErrorNoMem;
     }
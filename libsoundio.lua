@@ -71,9 +71,13 @@ local function tobackend(backend)
 end
 
 function sio:connect(backend)
-	check(backend
-		and C.soundio_connect_backend(self, tobackend(backend))
-		or C.soundio_connect(self))
+	if type(backend) == 'number' then
+		check(C.soundio_connect_timeout(self, backend))
+	else
+		check(backend
+			and C.soundio_connect_backend(self, tobackend(backend))
+			or C.soundio_connect(self))
+	end
 	self:flush_events()
 end
 
@@ -101,6 +105,12 @@ sio.flush_events = C.soundio_flush_events
 sio.wait_events = C.soundio_wait_events
 sio.wakeup = C.soundio_wakeup
 
+local ibuf = ffi.new'int[1]'
+function sio:event_fd()
+	check(C.soundio_get_event_fd(self, ibuf))
+	return ibuf[0]
+end
+
 --device list ----------------------------------------------------------------
 
 sio.force_device_scan = C.soundio_force_device_scan
@@ -224,6 +234,24 @@ function devprop:probe_error()
 	return self.probe_error_code ~= 0 and self.probe_error_code or nil
 end
 
+function dev:probe()
+	return C.soundio_device_probe(self) == 0
+end
+
+--capabilities of lazily listed devices are probed on first access.
+for _,k in ipairs{
+	'layouts', 'layout_count', 'current_layout',
+	'formats', 'format_count', 'current_format',
+	'sample_rates', 'sample_rate_count', 'sample_rate_current',
+	'software_latency_min', 'software_latency_max', 'software_latency_current',
+} do
+	local field = '_'..k
+	devprop[k] = function(self)
+		C.soundio_device_probe(self)
+		return self[field]
+	end
+end
+
 dev.__eq = C.soundio_device_equal
 dev.__index = vprops(dev, devprop)
 
@@ -243,12 +271,18 @@ function M.bytes_per_second(format, channel_count, sample_rate)
 	return M.bytes_per_frame(format, channel_count) * sample_rate
 end
 
+M.pack_s24_float32 = C.soundio_pack_s24_float32
+M.pack_s24_s32 = C.soundio_pack_s24_s32
+M.unpack_s24_float32 = C.soundio_unpack_s24_float32
+M.unpack_s24_s32 = C.soundio_unpack_s24_s32
+
 local sample_ranges = {
 	[C.SoundIoFormatS8]        = { -2^7,  2^7-1},
 	[C.SoundIoFormatU8]        = {    0,  2^8-1},
 	[C.SoundIoFormatS16NE]     = {-2^15, 2^15-1},
 	[C.SoundIoFormatU16NE]     = {    0, 2^16-1},
 	[C.SoundIoFormatS24LE]     = {-2^23, 2^23-1},
+	[C.SoundIoFormatS24PackedLE] = {-2^23, 2^23-1},
 	[C.SoundIoFormatU24LE]     = {    0, 2^24-1},
 	[C.SoundIoFormatS32LE]     = {-2^31, 2^31-1},
 	[C.SoundIoFormatU32LE]     = {    0, 2^32-1},
@@ -347,7 +381,6 @@ function dev:print(print_)
 	print('  latency range       : '..self.software_latency_min..' - '..self.software_latency_max)
 	print('  current_latency     : '..self.software_latency_current)
 	print('  is_raw              : '..tostring(self.is_raw))
-	print('  ref_count           : '..self.ref_count)
 	print('  probe_error         : '..tostring(self.probe_error))
 end
 
@@ -359,7 +392,7 @@ function dev:stream()
 		C.soundio_outstream_create(self) or
 		C.soundio_instream_create(self))
 	ffi.gc(self, self.free)
-	if not dev.probe_error then
+	if dev:probe() then
 		assert(dev:supports_sample_rate(48000))
 		assert(dev:supports_format(C.SoundIoFormatFloat32NE))
 	end
@@ -409,6 +442,10 @@ function strout:clear_buffer()
 	check(C.soundio_outstream_clear_buffer(self))
 end
 
+function strout:drain()
+	check(C.soundio_outstream_drain(self))
+end
+
 function strout:pause(pause)
 	check(C.soundio_outstream_pause(self, pause))
 end
@@ -420,6 +457,27 @@ function strout:latency()
 	return dbuf[0]
 end
 
+local tstamp = ffi.new'struct SoundIoTimestamp'
+
+function strout:timestamp()
+	check(C.soundio_outstream_get_timestamp(self, tstamp))
+	return tonumber(tstamp.frame), tstamp.time
+end
+
+local stats = ffi.new'struct SoundIoCallbackStats'
+
+function strout:callback_stats()
+	check(C.soundio_outstream_get_callback_stats(self, stats))
+	return stats
+end
+
+local xstats = ffi.new'struct SoundIoXrunStats'
+
+function strout:xrun_stats()
+	C.soundio_outstream_get_xrun_stats(self, xstats)
+	return xstats
+end
+
 function stroutprop:bytes_per_second()
 	return self.bytes_per_frame * self.sample_rate
 end
@@ -460,8 +518,42 @@ function strin:latency()
 	return dbuf[0]
 end
 
+function strin:timestamp()
+	check(C.soundio_instream_get_timestamp(self, tstamp))
+	return tonumber(tstamp.frame), tstamp.time
+end
+
+function strin:callback_stats()
+	check(C.soundio_instream_get_callback_stats(self, stats))
+	return stats
+end
+
+function strin:xrun_stats()
+	C.soundio_instream_get_xrun_stats(self, xstats)
+	return xstats
+end
+
 strinprop.bytes_per_second = stroutprop.bytes_per_second
 
+--streams/duplex -------------------------------------------------------------
+
+local duplex = {}
+duplex.__index = duplex
+
+--free the duplex stream before freeing its streams.
+function strout:duplex(sin)
+	local self = checkptr(C.soundio_duplex_stream_create(self, sin))
+	return ffi.gc(self, self.free)
+end
+
+function duplex:free()
+	ffi.gc(self, nil)
+	C.soundio_duplex_stream_destroy(self)
+end
+
+function duplex:open() check(C.soundio_duplex_stream_open(self)) end
+function duplex:start() check(C.soundio_duplex_stream_start(self)) end
+
 --ringbuffers ----------------------------------------------------------------
 
 local rb = {}
@@ -604,6 +696,7 @@ ffi.metatype('struct SoundIoDevice', dev)
 ffi.metatype('struct SoundIoRingBuffer', rb)
 ffi.metatype('struct SoundIoOutStream', strout)
 ffi.metatype('struct SoundIoInStream', strin)
+ffi.metatype('struct SoundIoDuplexStream', duplex)
 ffi.metatype('struct SoundIoChannelLayout', layout)
 
 return M
@@ -74,11 +74,17 @@ local function play_vorbis_file()
 		time.sleep(0.01)
 	end
 
-	while buf:fill_count() > 0 or str:latency() > 0 do
-		print(str:latency())
+	while buf:fill_count() > 0 do
 		time.sleep(0.1)
 	end
 
+	local drained
+	str.on_drained = function() drained = true end
+	str:drain()
+	repeat
+		sio:wait_events()
+	until drained
+
 end
 
 local function play_tone()
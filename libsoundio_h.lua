@@ -20,6 +20,7 @@ enum SoundIoError {
 	SoundIoErrorInterrupted,
 	SoundIoErrorUnderflow,
 	SoundIoErrorEncodingString,
+	SoundIoErrorNotProbed,
 };
 enum SoundIoChannelId {
 	SoundIoChannelIdInvalid,
@@ -133,6 +134,11 @@ enum SoundIoDeviceAim {
 	SoundIoDeviceAimInput,  // capture / recording
 	SoundIoDeviceAimOutput, // playback
 };
+enum SoundIoAccessMode {
+	SoundIoAccessModeAuto,
+	SoundIoAccessModeDirect,
+	SoundIoAccessModeCopy,
+};
 enum SoundIoFormat {
 	SoundIoFormatInvalid,
 	SoundIoFormatS8,        // Signed 8 bit
@@ -153,6 +159,8 @@ enum SoundIoFormat {
 	SoundIoFormatFloat32BE, // Float 32 bit Big Endian, Range -1.0 to 1.0
 	SoundIoFormatFloat64LE, // Float 64 bit Little Endian, Range -1.0 to 1.0
 	SoundIoFormatFloat64BE, // Float 64 bit Big Endian, Range -1.0 to 1.0
+	SoundIoFormatS24PackedLE, // Signed 24 bit Little Endian packed into three bytes
+	SoundIoFormatS24PackedBE, // Signed 24 bit Big Endian packed into three bytes
 };
 enum {
 	SoundIoFormatS16NE     = SoundIoFormatS16LE,
@@ -163,6 +171,7 @@ enum {
 	SoundIoFormatU32NE     = SoundIoFormatU32LE,
 	SoundIoFormatFloat32NE = SoundIoFormatFloat32LE,
 	SoundIoFormatFloat64NE = SoundIoFormatFloat64LE,
+	SoundIoFormatS24PackedNE = SoundIoFormatS24PackedLE,
 	SoundIoFormatS16FE     = SoundIoFormatS16BE,
 	SoundIoFormatU16FE     = SoundIoFormatU16BE,
 	SoundIoFormatS24FE     = SoundIoFormatS24BE,
@@ -171,6 +180,7 @@ enum {
 	SoundIoFormatU32FE     = SoundIoFormatU32BE,
 	SoundIoFormatFloat32FE = SoundIoFormatFloat32BE,
 	SoundIoFormatFloat64FE = SoundIoFormatFloat64BE,
+	SoundIoFormatS24PackedFE = SoundIoFormatS24PackedBE,
 };
 enum {
 	SOUNDIO_MAX_CHANNELS = 24,
@@ -184,6 +194,26 @@ struct SoundIoSampleRateRange {
 	int min;
 	int max;
 };
+enum {
+	SOUNDIO_CALLBACK_LOAD_BUCKETS = 11,
+};
+struct SoundIoCallbackStats {
+	long callback_count;
+	long deadline_miss_count;
+	double max_duration;
+	long load_histogram[SOUNDIO_CALLBACK_LOAD_BUCKETS];
+};
+struct SoundIoTimestamp {
+	int64_t frame;
+	double time;
+};
+struct SoundIoXrunStats {
+	long xrun_count;
+	double last_xrun_time;
+	double fill_time;
+	long grow_count;
+	long shrink_count;
+};
 struct SoundIoChannelArea {
 	char *ptr;
 	int step;
@@ -198,24 +228,27 @@ struct SoundIo {
 	void (*emit_rtprio_warning)(void);
 	void (*jack_info_callback)(const char *msg);
 	void (*jack_error_callback)(const char *msg);
+	int alsa_engine_thread_count;
+	bool alsa_capability_cache;
+	bool lazy_probe;
 };
 struct SoundIoDevice {
 	struct SoundIo *soundio;
 	char *id_ptr;
 	char *name_ptr;
 	enum SoundIoDeviceAim aim_enum;
-	struct SoundIoChannelLayout *layouts;
-	int layout_count;
-	struct SoundIoChannelLayout current_layout;
-	enum SoundIoFormat *formats;
-	int format_count;
-	enum SoundIoFormat current_format;
-	struct SoundIoSampleRateRange *sample_rates;
-	int sample_rate_count;
-	int sample_rate_current;
-	double software_latency_min;
-	double software_latency_max;
-	double software_latency_current;
+	struct SoundIoChannelLayout *_layouts;
+	int _layout_count;
+	struct SoundIoChannelLayout _current_layout;
+	enum SoundIoFormat *_formats;
+	int _format_count;
+	enum SoundIoFormat _current_format;
+	struct SoundIoSampleRateRange *_sample_rates;
+	int _sample_rate_count;
+	int _sample_rate_current;
+	double _software_latency_min;
+	double _software_latency_max;
+	double _software_latency_current;
 	bool is_raw;
 	int ref_count;
 	int probe_error_code;
@@ -239,6 +272,16 @@ struct SoundIoOutStream {
 	int bytes_per_frame;
 	int bytes_per_sample;
 	int layout_error_code;
+	bool watchdog;
+	void (*on_deadline_miss)(struct SoundIoOutStream *, int miss_count);
+	enum SoundIoAccessMode access_mode;
+	bool timer_scheduling;
+	bool adaptive_latency;
+	void (*on_drained)(struct SoundIoOutStream *);
+	bool exclusive;
+	double period_duration;
+	bool early_requests;
+	bool interpolate_timing;
 };
 typedef void (*SoundIoReadCallback)(struct SoundIoInStream *,
 	int frame_count_min, int frame_count_max);
@@ -258,6 +301,20 @@ struct SoundIoInStream {
 	int bytes_per_frame;
 	int bytes_per_sample;
 	int layout_error_code;
+	bool watchdog;
+	void (*on_deadline_miss)(struct SoundIoInStream *, int miss_count);
+	enum SoundIoAccessMode access_mode;
+	bool exclusive;
+	double period_duration;
+	bool interpolate_timing;
+};
+struct SoundIoDuplexStream {
+	struct SoundIoOutStream *outstream;
+	struct SoundIoInStream *instream;
+	void *userdata;
+	void (*duplex_callback)(struct SoundIoDuplexStream *, int frame_count);
+	void (*error_callback)(struct SoundIoDuplexStream *, int err);
+	double software_latency;
 };
 
 struct SoundIo *soundio_create(void);
@@ -265,6 +322,7 @@ void soundio_destroy(struct SoundIo *soundio);
 const char *soundio_strerror(int error);
 
 int soundio_connect(struct SoundIo *soundio);
+int soundio_connect_timeout(struct SoundIo *soundio, double timeout);
 int soundio_connect_backend(struct SoundIo *soundio, enum SoundIoBackend backend);
 void soundio_disconnect(struct SoundIo *soundio);
 int soundio_backend_count(struct SoundIo *soundio);
@@ -275,6 +333,7 @@ const char *soundio_backend_name(enum SoundIoBackend backend);
 void soundio_flush_events(struct SoundIo *soundio);
 void soundio_wait_events(struct SoundIo *soundio);
 void soundio_wakeup(struct SoundIo *soundio);
+int soundio_get_event_fd(struct SoundIo *soundio, int *out_fd);
 
 void soundio_force_device_scan(struct SoundIo *soundio);
 
@@ -289,6 +348,7 @@ void soundio_device_unref(struct SoundIoDevice *device);
 bool soundio_device_equal(
         const struct SoundIoDevice *a,
         const struct SoundIoDevice *b);
+int soundio_device_probe(struct SoundIoDevice *device);
 void soundio_device_sort_channel_layouts(struct SoundIoDevice *device);
 bool soundio_device_supports_format(struct SoundIoDevice *device,
         enum SoundIoFormat format);
@@ -317,6 +377,14 @@ const char *soundio_get_channel_name(enum SoundIoChannelId id);
 
 int soundio_get_bytes_per_sample(enum SoundIoFormat format);
 const char * soundio_format_string(enum SoundIoFormat format);
+void soundio_pack_s24_float32(char *dest, enum SoundIoFormat dest_format,
+        const float *src, int sample_count);
+void soundio_pack_s24_s32(char *dest, enum SoundIoFormat dest_format,
+        const int32_t *src, int sample_count);
+void soundio_unpack_s24_float32(float *dest, const char *src,
+        enum SoundIoFormat src_format, int sample_count);
+void soundio_unpack_s24_s32(int32_t *dest, const char *src,
+        enum SoundIoFormat src_format, int sample_count);
 
 struct SoundIoOutStream *soundio_outstream_create(struct SoundIoDevice *device);
 void soundio_outstream_destroy(struct SoundIoOutStream *outstream);
@@ -326,9 +394,16 @@ int soundio_outstream_begin_write(struct SoundIoOutStream *outstream,
         struct SoundIoChannelArea **areas, int *frame_count);
 int soundio_outstream_end_write(struct SoundIoOutStream *outstream);
 int soundio_outstream_clear_buffer(struct SoundIoOutStream *outstream);
+int soundio_outstream_drain(struct SoundIoOutStream *outstream);
 int soundio_outstream_pause(struct SoundIoOutStream *outstream, bool pause);
 int soundio_outstream_get_latency(struct SoundIoOutStream *outstream,
         double *out_latency);
+int soundio_outstream_get_timestamp(struct SoundIoOutStream *outstream,
+        struct SoundIoTimestamp *out_timestamp);
+int soundio_outstream_get_callback_stats(struct SoundIoOutStream *outstream,
+        struct SoundIoCallbackStats *out_stats);
+void soundio_outstream_get_xrun_stats(struct SoundIoOutStream *outstream,
+        struct SoundIoXrunStats *out_stats);
 struct SoundIoInStream *soundio_instream_create(struct SoundIoDevice *device);
 void soundio_instream_destroy(struct SoundIoInStream *instream);
 int soundio_instream_open(struct SoundIoInStream *instream);
@@ -339,6 +414,17 @@ int soundio_instream_end_read(struct SoundIoInStream *instream);
 int soundio_instream_pause(struct SoundIoInStream *instream, bool pause);
 int soundio_instream_get_latency(struct SoundIoInStream *instream,
         double *out_latency);
+int soundio_instream_get_timestamp(struct SoundIoInStream *instream,
+        struct SoundIoTimestamp *out_timestamp);
+int soundio_instream_get_callback_stats(struct SoundIoInStream *instream,
+        struct SoundIoCallbackStats *out_stats);
+void soundio_instream_get_xrun_stats(struct SoundIoInStream *instream,
+        struct SoundIoXrunStats *out_stats);
+struct SoundIoDuplexStream *soundio_duplex_stream_create(
+        struct SoundIoOutStream *outstream, struct SoundIoInStream *instream);
+void soundio_duplex_stream_destroy(struct SoundIoDuplexStream *duplex);
+int soundio_duplex_stream_open(struct SoundIoDuplexStream *duplex);
+int soundio_duplex_stream_start(struct SoundIoDuplexStream *duplex);
 struct SoundIoRingBuffer;
 struct SoundIoRingBuffer *soundio_ring_buffer_create(struct SoundIo *soundio, int requested_capacity);
 void soundio_ring_buffer_destroy(struct SoundIoRingBuffer *ring_buffer);